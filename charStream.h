@@ -11,6 +11,7 @@
 #include <string>
 #include <string.h>
 #include <bitset>
+#include <type_traits>
 #include <arpa/inet.h>
 
 typedef uint8_t U8;
@@ -22,16 +23,84 @@ typedef int16_t S16;
 typedef int32_t S32;
 typedef int64_t S64;
 
+/**
+ * Integers always go over the wire little endian, whatever the host is, so mixed-endian nodes can
+ * talk to each other. Swapping is its own inverse so this works in both directions. On little
+ * endian hosts it's a no-op, and on big endian ones the compiler turns the loop into a bswap.
+ */
+template<typename T>
+inline T wireOrder(T value) {
+	static_assert(std::is_integral<T>::value, "Only integers have a byte order");
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	T swapped;
+	const U8 *in = reinterpret_cast<const U8 *>(&value);
+	U8 *out = reinterpret_cast<U8 *>(&swapped);
+	for (size_t i = 0; i < sizeof(T); i ++) {
+		out[i] = in[sizeof(T) - 1 - i];
+	}
+	return swapped;
+#else
+	return value;
+#endif
+}
+
 class CharStream {
 	std::vector<U8> mData;
-public:
-	CharStream() {
+	//When set, the stream reads from someone else's memory instead of mData (see view())
+	const U8 *mView;
+	size_t mViewLength;
+	//Everything before this has already been popped, so pops are just moving this forward
+	size_t mReadPos;
+	//Size of mData before the last prepareWrite()
+	size_t mWriteStart;
+
+	//Don't bother shuffling popped bytes out of the way until there's at least this many
+	static const size_t compactThreshold = 4096;
+
+	const U8 *readBase() const {
+		return mView != nullptr ? mView : mData.data();
+	}
 
+	size_t readLength() const {
+		return mView != nullptr ? mViewLength : mData.size();
 	}
-	CharStream(const U8 *data, const U32 &length) {
-		for (U32 i = 0; i < length; i ++) {
-			mData.push_back(data[i]);
+
+	/**
+	 * Drop everything that has already been popped. Views get their remaining bytes copied in so
+	 * the stream can be written to.
+	 */
+	void compact() {
+		if (mView != nullptr) {
+			mData.assign(mView + mReadPos, mView + mViewLength);
+			mView = nullptr;
+			mViewLength = 0;
+		} else if (mReadPos == mData.size()) {
+			mData.clear();
+		} else if (mReadPos > 0) {
+			mData.erase(mData.begin(), mData.begin() + mReadPos);
 		}
+		mReadPos = 0;
+	}
+
+public:
+	CharStream() : mView(nullptr), mViewLength(0), mReadPos(0), mWriteStart(0) {
+
+	}
+	CharStream(const U8 *data, const U32 &length) : mData(data, data + length), mView(nullptr),
+		mViewLength(0), mReadPos(0), mWriteStart(0) {
+
+	}
+
+	/**
+	 * Non-owning stream over bytes that already exist somewhere, eg. a recv() buffer, so they can
+	 * be decoded where they sit. The memory has to outlive the stream; pushing onto it copies
+	 * whatever is left into the stream's own storage first.
+	 */
+	static CharStream view(const U8 *data, size_t length) {
+		CharStream str;
+		str.mView = data;
+		str.mViewLength = length;
+		return str;
 	}
 
 	template <typename T>
@@ -40,30 +109,176 @@ public:
 	template <typename T>
 	T pop();
 
+	/**
+	 * Append raw bytes to the end of the stream
+	 */
+	void pushBytes(const U8 *bytes, size_t length) {
+		//Reclaim the popped space in one go once it's taking up most of the buffer
+		if (mView != nullptr || (mReadPos >= compactThreshold && mReadPos * 2 >= mData.size())) {
+			compact();
+		}
+		mData.insert(mData.end(), bytes, bytes + length);
+	}
+
+	/**
+	 * Pop raw bytes off the front of the stream, with one bounds check for the whole lot
+	 */
+	bool popBytes(U8 *bytes, size_t length) {
+		const U8 *start = consume(length);
+		if (start == nullptr) {
+			return false;
+		}
+		memcpy(bytes, start, length);
+		return true;
+	}
+
+	/**
+	 * Mark length bytes as popped and get a pointer to them, which stays valid until the next
+	 * push. Returns nullptr if there aren't that many left.
+	 */
+	const U8 *consume(size_t length) {
+		if (size() < length) {
+			assert(false);
+			return nullptr;
+		}
+		const U8 *start = readBase() + mReadPos;
+		mReadPos += length;
+		return start;
+	}
+
+	/**
+	 * Grow the stream by up to length bytes and get a pointer to write them to directly, eg.
+	 * straight from recv(). Follow up with commitWrite() saying how many were actually written.
+	 */
+	U8 *prepareWrite(size_t length) {
+		if (mView != nullptr || (mReadPos >= compactThreshold && mReadPos * 2 >= mData.size())) {
+			compact();
+		}
+		mWriteStart = mData.size();
+		mData.resize(mWriteStart + length);
+		return mData.data() + mWriteStart;
+	}
+
+	void commitWrite(size_t written) {
+		mData.resize(mWriteStart + written);
+	}
+
 	std::vector<U8> getBuffer() const {
-		std::vector<U8> data;
-		data.insert(data.end(), mData.begin(), mData.end());
-		return data;
+		return std::vector<U8>(readBase() + mReadPos, readBase() + readLength());
 	}
 
 	size_t size() const {
-		return mData.size();
+		return readLength() - mReadPos;
+	}
+
+	void clear() {
+		mData.clear();
+		mView = nullptr;
+		mViewLength = 0;
+		mReadPos = 0;
+	}
+
+	/**
+	 * Direct access to the bytes that haven't been popped yet, for transforming them in place
+	 */
+	U8 *data() {
+		if (mView != nullptr) {
+			compact();
+		}
+		return mData.data() + mReadPos;
+	}
+
+	/**
+	 * Bytes that haven't been popped yet, eg. to hand straight to send()
+	 */
+	const U8 *data() const {
+		return readBase() + mReadPos;
+	}
+
+	/**
+	 * Exchange storage with a buffer, so a caller can serialize into (or read out of) a buffer
+	 * it keeps around and reuses without copying. Anything already popped is dropped first.
+	 */
+	void swap(std::vector<U8> &buffer) {
+		compact();
+		mData.swap(buffer);
+	}
+
+	/**
+	 * Push a whole integer in wire order with a single copy
+	 */
+	template<typename T>
+	void pushWord(T value) {
+		T wire = wireOrder(value);
+		pushBytes(reinterpret_cast<const U8 *>(&wire), sizeof(wire));
+	}
+
+	/**
+	 * Pop a whole integer in wire order with one bounds check and a single copy
+	 */
+	template<typename T>
+	T popWord() {
+		T wire = 0;
+		popBytes(reinterpret_cast<U8 *>(&wire), sizeof(wire));
+		return wireOrder(wire);
+	}
+
+	/**
+	 * Push a contiguous run of integers. On little endian hosts that's just one big copy.
+	 */
+	template<typename T>
+	void pushArray(const T *values, size_t count) {
+		static_assert(std::is_integral<T>::value, "Only integers have a byte order");
+		U8 *out = prepareWrite(count * sizeof(T));
+		for (size_t i = 0; i < count; i ++) {
+			T wire = wireOrder(values[i]);
+			memcpy(out + i * sizeof(T), &wire, sizeof(T));
+		}
+	}
+
+	/**
+	 * Pop a contiguous run of integers into values, false if there weren't that many left
+	 */
+	template<typename T>
+	bool popArray(T *values, size_t count) {
+		static_assert(std::is_integral<T>::value, "Only integers have a byte order");
+		const U8 *in = consume(count * sizeof(T));
+		if (in == nullptr) {
+			return false;
+		}
+		for (size_t i = 0; i < count; i ++) {
+			T wire;
+			memcpy(&wire, in + i * sizeof(T), sizeof(T));
+			values[i] = wireOrder(wire);
+		}
+		return true;
 	}
 
 	template<size_t N>
 	std::bitset<N> push(const std::bitset<N> &value) {
-		//LSB first, I think that makes this big endian?
-		for (int i = 0; i < N; i += 8) {
-			U8 byte = (value >> i).to_ullong() & 0xFF;
-			push<U8>(byte);
+		//LSB first, so little endian like everything else. Anything that fits in a U64 goes in
+		// one copy of just the bytes it needs.
+		if (N <= 64) {
+			U64 wire = wireOrder<U64>(value.to_ullong());
+			pushBytes(reinterpret_cast<const U8 *>(&wire), (N + 7) / 8);
+		} else {
+			for (size_t i = 0; i < N; i += 8) {
+				U8 byte = (value >> i).to_ullong() & 0xFF;
+				push<U8>(byte);
+			}
 		}
 		return value;
 	}
 
 	template<size_t N>
 	std::bitset<N> pop() {
+		if (N <= 64) {
+			U64 wire = 0;
+			popBytes(reinterpret_cast<U8 *>(&wire), (N + 7) / 8);
+			return std::bitset<N>(wireOrder(wire));
+		}
 		std::bitset<N> value;
-		for (int i = 0; i < N; i += 8) {
+		for (size_t i = 0; i < N; i += 8) {
 			value |= (std::bitset<N>(pop<U8>()) << i);
 		}
 		return value;
@@ -77,21 +292,20 @@ public:
 
 template<>
 inline U8 CharStream::push(const U8 &value) {
-	mData.push_back(value);
+	//Through pushBytes() like everything else, so a view gets copied out first
+	pushBytes(&value, 1);
 	return value;
 }
 
 template<>
 inline U8 CharStream::pop() {
-	if (mData.size() == 0) {
+	if (size() == 0) {
 		assert(false);
 		return 0;
 	}
 
 	//Like a queue, pop front
-	U8 value = mData.front();
-	mData.erase(mData.begin());
-	return value;
+	return readBase()[mReadPos ++];
 }
 
 //Signed integer support, casting just assumes it works
@@ -110,27 +324,13 @@ inline S8 CharStream::pop() {
 
 template<>
 inline U16 CharStream::push(const U16 &value) {
-	//Neat little trick to convert U16 to U8
-	union {
-		U16 u16;
-		U8 u8[2];
-	} data;
-	data.u16 = value;
-
-	push<U8>(data.u8[0]);
-	push<U8>(data.u8[1]);
+	pushWord<U16>(value);
 	return value;
 }
 
 template<>
 inline U16 CharStream::pop() {
-	union {
-		U16 u16;
-		U8 u8[2];
-	} data;
-	data.u8[0] = pop<U8>();
-	data.u8[1] = pop<U8>();
-	return data.u16;
+	return popWord<U16>();
 }
 
 template<>
@@ -148,31 +348,13 @@ inline S16 CharStream::pop() {
 
 template<>
 inline U32 CharStream::push(const U32 &value) {
-	//Neat little trick to convert U32 to U8
-	union {
-		U32 u32;
-		U8 u8[4];
-	} data;
-	data.u32 = value;
-
-	push<U8>(data.u8[0]);
-	push<U8>(data.u8[1]);
-	push<U8>(data.u8[2]);
-	push<U8>(data.u8[3]);
+	pushWord<U32>(value);
 	return value;
 }
 
 template<>
 inline U32 CharStream::pop() {
-	union {
-		U32 u32;
-		U8 u8[4];
-	} data;
-	data.u8[0] = pop<U8>();
-	data.u8[1] = pop<U8>();
-	data.u8[2] = pop<U8>();
-	data.u8[3] = pop<U8>();
-	return data.u32;
+	return popWord<U32>();
 }
 
 template<>
@@ -190,39 +372,13 @@ inline S32 CharStream::pop() {
 
 template<>
 inline U64 CharStream::push(const U64 &value) {
-	//Neat little trick to convert U64 to U8
-	union {
-		U64 u64;
-		U8 u8[8];
-	} data;
-	data.u64 = value;
-
-	push<U8>(data.u8[0]);
-	push<U8>(data.u8[1]);
-	push<U8>(data.u8[2]);
-	push<U8>(data.u8[3]);
-	push<U8>(data.u8[4]);
-	push<U8>(data.u8[5]);
-	push<U8>(data.u8[6]);
-	push<U8>(data.u8[7]);
+	pushWord<U64>(value);
 	return value;
 }
 
 template<>
 inline U64 CharStream::pop() {
-	union {
-		U64 u64;
-		U8 u8[8];
-	} data;
-	data.u8[0] = pop<U8>();
-	data.u8[1] = pop<U8>();
-	data.u8[2] = pop<U8>();
-	data.u8[3] = pop<U8>();
-	data.u8[4] = pop<U8>();
-	data.u8[5] = pop<U8>();
-	data.u8[6] = pop<U8>();
-	data.u8[7] = pop<U8>();
-	return data.u64;
+	return popWord<U64>();
 }
 
 template<>
@@ -239,28 +395,24 @@ inline S64 CharStream::pop() {
 
 template<>
 inline std::string CharStream::push(const std::string &value) {
-	for (int i = 0; i < value.size(); i ++) {
-		push<U8>(value[i]);
-	}
-	push<U8>(0);
+	//Including the null terminator
+	pushBytes(reinterpret_cast<const U8 *>(value.c_str()), value.size() + 1);
 	return value;
 }
 
 template<>
 inline std::string CharStream::pop() {
-	std::vector<char> bytes;
-	while (true) {
-		char byte = pop<S8>();
-		if (byte == 0) {
-			break;
-		}
-
-		bytes.push_back(byte);
+	//Straight out of whatever it's reading, so a view stays a view
+	const U8 *start = readBase() + mReadPos;
+	const U8 *terminator = static_cast<const U8 *>(memchr(start, 0, size()));
+	if (terminator == nullptr) {
+		assert(false);
+		return std::string();
 	}
-	//Null terminate
-	bytes.push_back(0);
 
-	return std::string(bytes.data());
+	std::string value(reinterpret_cast<const char *>(start), terminator - start);
+	consume(terminator - start + 1);
+	return value;
 }
 
 template<>
@@ -279,20 +431,23 @@ inline char *CharStream::pop() {
 	return buffer;
 }
 
+//Port and address are already in network order, only the family is in host order
 template<>
 inline sockaddr_in CharStream::push(const sockaddr_in &value) {
-	for (int i = 0; i < sizeof(value); i ++) {
-		push<uint8_t>(((uint8_t *)&value)[i]);
-	}
+	pushWord<U16>(value.sin_family);
+	pushBytes(reinterpret_cast<const U8 *>(&value.sin_port), sizeof(value.sin_port));
+	pushBytes(reinterpret_cast<const U8 *>(&value.sin_addr), sizeof(value.sin_addr));
+	pushBytes(reinterpret_cast<const U8 *>(&value.sin_zero), sizeof(value.sin_zero));
 	return value;
 }
 
 template<>
 inline sockaddr_in CharStream::pop() {
-	sockaddr_in value;
-	for (int i = 0; i < sizeof(value); i ++) {
-		((uint8_t *)&value)[i] = pop<uint8_t>();
-	}
+	sockaddr_in value{};
+	value.sin_family = popWord<U16>();
+	popBytes(reinterpret_cast<U8 *>(&value.sin_port), sizeof(value.sin_port));
+	popBytes(reinterpret_cast<U8 *>(&value.sin_addr), sizeof(value.sin_addr));
+	popBytes(reinterpret_cast<U8 *>(&value.sin_zero), sizeof(value.sin_zero));
 	return value;
 }
 
@@ -0,0 +1,187 @@
+//
+// Created by Glenn Smith on 10/11/18.
+//
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include "needham-schroeder.h"
+
+/**
+ * Decoding NS1s (what the KDC reads) and NS2s (what a client reads back) off a CharStream: a
+ * buffer of them back to back, as a recv() can deliver several at once. Once the way CharStream
+ * started out, where every pop<U8>() erased the front of the buffer and every wider pop was built
+ * from those, then with the read cursor from an owned copy and from a view of the buffer.
+ *
+ * Usage: charstream_bench [messages per buffer] (default 64)
+ */
+
+//Keep going for at least this long (seconds) per measurement
+#define BENCH_MIN_SECONDS 0.25
+
+/**
+ * Just enough of the original CharStream to decode the same bytes the way it did
+ */
+struct erase_front_stream {
+	std::vector<U8> data;
+
+	U8 pop_u8() {
+		U8 value = data.front();
+		data.erase(data.begin());
+		return value;
+	}
+
+	//Wider values were a byte at a time through pop<U8>
+	template<typename T>
+	T pop_bytes(size_t length = sizeof(T)) {
+		T value{};
+		U8 *bytes = reinterpret_cast<U8 *>(&value);
+		for (size_t i = 0; i < length; i ++) {
+			bytes[i] = pop_u8();
+		}
+		return value;
+	}
+
+	ID pop_id() {
+		ID value{};
+		value.sin_family = pop_bytes<U16>();
+		value.sin_port = pop_bytes<U16>();
+		value.sin_addr.s_addr = pop_bytes<U32>();
+		pop_bytes<U64>();
+		return value;
+	}
+
+	NS1 pop_ns1() {
+		NS1 value{};
+		value.id_a = pop_id();
+		value.id_b = pop_id();
+		value.nonce_1 = pop_u8();
+		return value;
+	}
+
+	NS2 pop_ns2() {
+		NS2 value{};
+		value.session_key = cipher_key(pop_bytes<U64>(wire_size<cipher_key>::value));
+		value.id_b = pop_id();
+		value.nonce_1 = pop_u8();
+		value.timestamp = pop_bytes<U64>();
+		U16 size = pop_bytes<U16>();
+		value.encrypt_ns3.reserve(size);
+		for (U16 i = 0; i < size; i ++) {
+			value.encrypt_ns3.push_back(pop_u8());
+		}
+		return value;
+	}
+};
+
+//Something out of each message to add up
+U64 message_check(const NS1 &ns1) {
+	return ns1.nonce_1 + ns1.id_b.sin_port;
+}
+
+U64 message_check(const NS2 &ns2) {
+	return ns2.timestamp + ns2.encrypt_ns3.size();
+}
+
+/**
+ * Messages per second of decode(buffer), which decodes all count messages in it
+ */
+template<typename Decode>
+double measure(const std::vector<U8> &buffer, size_t count, Decode decode) {
+	auto start = std::chrono::steady_clock::now();
+	size_t total = 0;
+	U64 check = 0;
+	double seconds = 0;
+	do {
+		check += decode(buffer);
+		total += count;
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	} while (seconds < BENCH_MIN_SECONDS);
+	//So the decoding can't be thrown away
+	if (check == 0) {
+		printf("(nothing decoded)\n");
+	}
+	return total / seconds;
+}
+
+/**
+ * Decode count messages of type T, each after its command byte, all three ways
+ */
+template<typename T, typename OldPop>
+void row(const char *name, const T &message, size_t count, OldPop old_pop) {
+	CharStream str;
+	for (size_t i = 0; i < count; i ++) {
+		str.push<U8>(1);
+		str.push<T>(message);
+	}
+	std::vector<U8> buffer = str.getBuffer();
+
+	double before = measure(buffer, count, [count, &old_pop](const std::vector<U8> &bytes) {
+		erase_front_stream old{bytes};
+		U64 sum = 0;
+		for (size_t i = 0; i < count; i ++) {
+			sum += old.pop_u8();
+			sum += old_pop(old);
+		}
+		return sum;
+	});
+	double owned = measure(buffer, count, [count](const std::vector<U8> &bytes) {
+		CharStream cs(bytes.data(), static_cast<U32>(bytes.size()));
+		U64 sum = 0;
+		for (size_t i = 0; i < count; i ++) {
+			sum += cs.pop<U8>();
+			sum += message_check(cs.pop<T>());
+		}
+		return sum;
+	});
+	double view = measure(buffer, count, [count](const std::vector<U8> &bytes) {
+		CharStream cs = CharStream::view(bytes.data(), bytes.size());
+		U64 sum = 0;
+		for (size_t i = 0; i < count; i ++) {
+			sum += cs.pop<U8>();
+			sum += message_check(cs.pop<T>());
+		}
+		return sum;
+	});
+	printf("%-6s %8zu %16.0f %16.0f %16.0f\n", name, buffer.size(), before, owned, view);
+}
+
+int main(int argc, const char **argv) {
+	size_t count = argc > 1 ? static_cast<size_t>(atoi(argv[1])) : 64;
+	if (count < 1) {
+		fprintf(stderr, "Need at least 1 message per buffer\n");
+		return EXIT_FAILURE;
+	}
+
+	ID a{}, b{};
+	a.sin_family = b.sin_family = AF_INET;
+	a.sin_port = htons(51179);
+	b.sin_port = htons(51180);
+	a.sin_addr.s_addr = b.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	NS1 ns1{};
+	ns1.id_a = a;
+	ns1.id_b = b;
+	ns1.nonce_1 = 7;
+
+	NS3 ns3{};
+	ns3.session_key = session_cipher::random_key();
+	ns3.id_a = a;
+	ns3.timestamp = current_timestamp();
+	NS2 ns2{};
+	ns2.session_key = ns3.session_key;
+	ns2.id_b = b;
+	ns2.nonce_1 = 7;
+	ns2.timestamp = ns3.timestamp;
+	ns2.encrypt_ns3 = encrypt<NS3>(ns3, session_cipher::random_key());
+
+	printf("messages/s, %zu per buffer\n", count);
+	printf("%-6s %8s %16s %16s %16s\n", "", "bytes", "erase (before)", "cursor", "view");
+	row("NS1", ns1, count, [](erase_front_stream &old) {
+		return message_check(old.pop_ns1());
+	});
+	row("NS2", ns2, count, [](erase_front_stream &old) {
+		return message_check(old.pop_ns2());
+	});
+	return EXIT_SUCCESS;
+}
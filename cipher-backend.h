@@ -0,0 +1,91 @@
+//
+// Created by Glenn Smith on 10/10/18.
+//
+
+#ifndef CRYPTO2_CIPHER_BACKEND_H
+#define CRYPTO2_CIPHER_BACKEND_H
+
+#include <bitset>
+#include <stddef.h>
+#include <stdint.h>
+#include "des.h"
+#include "des64.h"
+#include "util.h"
+
+/**
+ * Block cipher backends for the protocol. Each one provides:
+ *   key_type                        What a key looks like, used by the messages and serialization
+ *   block_size                      Encrypted buffers are padded out to a multiple of this
+ *   encrypt(data, length, key)      Encrypt whole blocks in place
+ *   decrypt(data, length, key)      Decrypt whole blocks in place
+ *   key_from_secret(secret)         Turn a Diffie-Hellman shared secret into a key
+ *   random_key()                    Fresh key for a session
+ *   key_value(key)                  Key as an integer, for printing
+ */
+
+/**
+ * The toy DES from homework 1: 8-bit blocks, 10-bit keys
+ */
+struct toy_des_backend {
+	typedef std::bitset<10> key_type;
+	static const size_t block_size = 1;
+
+	static void encrypt(uint8_t *data, size_t length, const key_type &key) {
+		des_encrypt_buffer(data, length, key);
+	}
+
+	static void decrypt(uint8_t *data, size_t length, const key_type &key) {
+		des_decrypt_buffer(data, length, key);
+	}
+
+	static key_type key_from_secret(uint64_t secret) {
+		return key_type{secret};
+	}
+
+	static key_type random_key() {
+		return key_type{rand_u64()};
+	}
+
+	static uint64_t key_value(const key_type &key) {
+		return key.to_ullong();
+	}
+};
+
+/**
+ * Full DES: 64-bit blocks, 64-bit keys (of which 56 bits are used)
+ */
+struct des64_backend {
+	typedef uint64_t key_type;
+	static const size_t block_size = 8;
+
+	static void encrypt(uint8_t *data, size_t length, const key_type &key) {
+		des64_encrypt_buffer(data, length, key);
+	}
+
+	static void decrypt(uint8_t *data, size_t length, const key_type &key) {
+		des64_decrypt_buffer(data, length, key);
+	}
+
+	static key_type key_from_secret(uint64_t secret) {
+		return secret;
+	}
+
+	static key_type random_key() {
+		return rand_u64();
+	}
+
+	static uint64_t key_value(const key_type &key) {
+		return key;
+	}
+};
+
+//Pick the cipher the protocol runs on at compile time
+#ifdef CRYPTO2_FULL_DES
+typedef des64_backend session_cipher;
+#else
+typedef toy_des_backend session_cipher;
+#endif
+
+typedef session_cipher::key_type cipher_key;
+
+#endif //CRYPTO2_CIPHER_BACKEND_H
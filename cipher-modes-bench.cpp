@@ -0,0 +1,85 @@
+//
+// Created by Glenn Smith on 10/11/18.
+//
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+#include "cipher-modes.h"
+
+/**
+ * Throughput of each cipher mode at 1 KiB, 64 KiB and 16 MiB updates, in place, one stream per
+ * mode. CTR runs both on the calling thread alone and split over a pool.
+ *
+ * Usage: cipher_modes_bench [pool threads] (default: one per core past the first)
+ */
+
+//Keep going over the same buffer for at least this long (seconds) per measurement
+#define BENCH_MIN_SECONDS 0.25
+
+/**
+ * MB/s of running update() over a buffer of length bytes, as many times as fits in the time
+ */
+template<typename Mode>
+double measure(Mode &mode, size_t length) {
+	std::vector<uint8_t> buffer(length);
+	for (size_t i = 0; i < length; i ++) {
+		buffer[i] = static_cast<uint8_t>(i * 7 + (i >> 9));
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	size_t total = 0;
+	double seconds = 0;
+	do {
+		mode.update(buffer.data(), buffer.data(), length);
+		total += length;
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	} while (seconds < BENCH_MIN_SECONDS);
+	return total / seconds / 1e6;
+}
+
+int main(int argc, const char **argv) {
+	unsigned cores = std::thread::hardware_concurrency();
+	size_t threads = argc > 1 ? static_cast<size_t>(atoi(argv[1])) : (cores > 1 ? cores - 1 : 0);
+	thread_pool pool(threads);
+
+	std::bitset<10> toy_key(613);
+	uint64_t des64_key = 0x133457799BBCDFF1ULL;
+
+	printf("%-24s %12s %12s %12s\n", "MB/s", "1 KiB", "64 KiB", "16 MiB");
+	const size_t sizes[] = {1024, 64 * 1024, 16 * 1024 * 1024};
+
+	auto row = [&sizes](const char *name, auto make) {
+		printf("%-24s", name);
+		for (size_t size : sizes) {
+			auto mode = make();
+			printf(" %12.1f", measure(mode, size));
+		}
+		printf("\n");
+	};
+
+	row("toy CTR", [&]() {
+		return des_ctr(toy_key, 1);
+	});
+	char name[64];
+	snprintf(name, sizeof(name), "toy CTR, %zu threads", threads);
+	row(name, [&]() {
+		return des_ctr(toy_key, 1, &pool);
+	});
+	row("toy CBC encrypt", [&]() {
+		return des_cbc_encryptor(toy_key, 1);
+	});
+	row("toy CBC decrypt", [&]() {
+		return des_cbc_decryptor(toy_key, 1);
+	});
+	row("full DES CTR", [&]() {
+		return block_ctr<des64_backend>(des64_key, 1);
+	});
+	snprintf(name, sizeof(name), "full DES CTR, %zu threads", threads);
+	row(name, [&]() {
+		return block_ctr<des64_backend>(des64_key, 1, &pool);
+	});
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,230 @@
+//
+// Created by Glenn Smith on 10/10/18.
+//
+
+#ifndef CRYPTO2_CIPHER_MODES_H
+#define CRYPTO2_CIPHER_MODES_H
+
+#include <array>
+#include <bitset>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "cipher-backend.h"
+#include "des.h"
+#include "thread-pool.h"
+
+/**
+ * Counter mode over the toy DES. The keystream byte at stream position p is E(iv + p), and since
+ * the block is only 8 bits that only depends on the low byte of the counter, so the whole
+ * keystream is a 256-byte pad built once up front. (Which does mean it repeats every 256 bytes,
+ * but so does everything else about an 8-bit block cipher.) Encryption and decryption are the
+ * same operation. Every position is independent, so big updates get split over a thread pool.
+ * Nothing is ever held back between updates, so there's no final step to finish a stream.
+ */
+class des_ctr {
+	//Pad twice over so a run of up to 256 bytes starting anywhere in it is contiguous
+	std::array<uint8_t, 512> mPad;
+	uint64_t mPosition;
+	thread_pool *mPool;
+
+	//Below this it's not worth waking anyone up
+	static const size_t parallel_threshold = 256 * 1024;
+	//Multiple of the pad size so every chunk lines up with it
+	static const size_t parallel_chunk = 64 * 1024;
+
+	void apply(const uint8_t *input, uint8_t *output, size_t length, uint64_t position) const {
+		for (size_t i = 0; i < length; i += 256) {
+			const uint8_t *pad = &mPad[(position + i) & 0xFF];
+			size_t count = length - i < 256 ? length - i : 256;
+			for (size_t j = 0; j < count; j ++) {
+				output[i + j] = input[i + j] ^ pad[j];
+			}
+		}
+	}
+
+public:
+	des_ctr(const std::bitset<10> &key, uint64_t iv, thread_pool *pool = nullptr) : mPosition(0), mPool(pool) {
+		const des_codebook &codebook = get_codebook(key);
+		for (size_t i = 0; i < 512; i ++) {
+			mPad[i] = codebook.encrypt(static_cast<uint8_t>(iv + i));
+		}
+	}
+
+	/**
+	 * Encrypt or decrypt the next length bytes of the stream, input and output may be the same
+	 * buffer. Blocks are one byte so everything put in comes straight back out.
+	 */
+	size_t update(const uint8_t *input, uint8_t *output, size_t length) {
+		uint64_t position = mPosition;
+		if (mPool != nullptr && mPool->size() > 0 && length >= parallel_threshold) {
+			size_t chunks = (length + parallel_chunk - 1) / parallel_chunk;
+			mPool->run(chunks, [this, input, output, length, position](size_t chunk) {
+				size_t start = chunk * parallel_chunk;
+				size_t count = length - start < parallel_chunk ? length - start : parallel_chunk;
+				apply(input + start, output + start, count, position + start);
+			});
+		} else {
+			apply(input, output, length, position);
+		}
+		mPosition += length;
+		return length;
+	}
+};
+
+/**
+ * CBC mode encryption over the toy DES: each block is xored with the previous ciphertext block
+ * before encryption, the first one with the IV. Inherently serial. One-byte blocks never need
+ * buffering or padding, so there's no final step either way.
+ */
+class des_cbc_encryptor {
+	const des_codebook &mCodebook;
+	uint8_t mPrevious;
+
+public:
+	des_cbc_encryptor(const std::bitset<10> &key, uint8_t iv) : mCodebook(get_codebook(key)), mPrevious(iv) {}
+
+	/**
+	 * Encrypt the next length bytes of the stream, input and output may be the same buffer
+	 */
+	size_t update(const uint8_t *input, uint8_t *output, size_t length) {
+		uint8_t previous = mPrevious;
+		for (size_t i = 0; i < length; i ++) {
+			previous = mCodebook.encrypt(static_cast<uint8_t>(input[i] ^ previous));
+			output[i] = previous;
+		}
+		mPrevious = previous;
+		return length;
+	}
+};
+
+/**
+ * CBC mode decryption. Unlike encryption every block only needs the ciphertext before it, so the
+ * block decryption itself runs through the vector kernels and the chaining is a second pass.
+ */
+class des_cbc_decryptor {
+	const des_codebook &mCodebook;
+	uint8_t mPrevious;
+
+	//Enough to keep a copy of the ciphertext when decrypting in place, without allocating
+	static const size_t chunk_size = 4096;
+
+public:
+	des_cbc_decryptor(const std::bitset<10> &key, uint8_t iv) : mCodebook(get_codebook(key)), mPrevious(iv) {}
+
+	/**
+	 * Decrypt the next length bytes of the stream, input and output may be the same buffer
+	 */
+	size_t update(const uint8_t *input, uint8_t *output, size_t length) {
+		uint8_t ciphertext[chunk_size];
+		for (size_t start = 0; start < length; start += chunk_size) {
+			size_t count = length - start < chunk_size ? length - start : chunk_size;
+			memcpy(ciphertext, input + start, count);
+
+			mCodebook.decrypt(ciphertext, output + start, count);
+			output[start] ^= mPrevious;
+			for (size_t i = 1; i < count; i ++) {
+				output[start + i] ^= ciphertext[i - 1];
+			}
+			mPrevious = ciphertext[count - 1];
+		}
+		return length;
+	}
+};
+
+/**
+ * Counter mode over any of the cipher backends (cipher-backend.h): keystream block n is
+ * E(iv + n), made a batch of blocks at a time by running the counters through the backend's
+ * buffer encryption. Same interface as des_ctr, including splitting big updates over a thread
+ * pool, for backends with real block sizes where the keystream can't be precomputed. Partial
+ * blocks carry over to the next update rather than being buffered, so there's no final step.
+ */
+template<typename Cipher>
+class block_ctr {
+	typename Cipher::key_type mKey;
+	uint64_t mIv;
+	uint64_t mPosition;
+	thread_pool *mPool;
+
+	//Keystream made per call into the backend, on the stack
+	static const size_t batch_blocks = 512;
+	static const size_t parallel_threshold = 256 * 1024;
+	//Multiple of the block size so every chunk starts on a block boundary
+	static const size_t parallel_chunk = 64 * 1024;
+	static_assert(parallel_chunk % Cipher::block_size == 0, "Chunks have to line up with blocks");
+
+	void apply(const uint8_t *input, uint8_t *output, size_t length, uint64_t position) const {
+		uint8_t keystream[batch_blocks * Cipher::block_size];
+		uint64_t block = position / Cipher::block_size;
+		//Where in the first block the stream is up to, if an earlier update stopped partway
+		size_t offset = position % Cipher::block_size;
+
+		size_t done = 0;
+		while (done < length) {
+			size_t blocks = (offset + length - done + Cipher::block_size - 1) / Cipher::block_size;
+			if (blocks > batch_blocks) {
+				blocks = batch_blocks;
+			}
+			//Counters go in little endian, zero filled past 64 bits
+			memset(keystream, 0, blocks * Cipher::block_size);
+			for (size_t i = 0; i < blocks; i ++) {
+				uint64_t counter = mIv + block + i;
+				for (size_t j = 0; j < Cipher::block_size && j < sizeof(counter); j ++) {
+					keystream[i * Cipher::block_size + j] = static_cast<uint8_t>(counter >> (j * 8));
+				}
+			}
+			Cipher::encrypt(keystream, blocks * Cipher::block_size, mKey);
+
+			size_t count = blocks * Cipher::block_size - offset;
+			if (count > length - done) {
+				count = length - done;
+			}
+			for (size_t i = 0; i < count; i ++) {
+				output[done + i] = input[done + i] ^ keystream[offset + i];
+			}
+			done += count;
+			block += blocks;
+			offset = 0;
+		}
+	}
+
+public:
+	block_ctr(const typename Cipher::key_type &key, uint64_t iv, thread_pool *pool = nullptr) : mKey(key), mIv(iv),
+		mPosition(0), mPool(pool) {}
+
+	/**
+	 * Encrypt or decrypt the next length bytes of the stream, input and output may be the same
+	 * buffer. Doesn't have to be whole blocks, the next update picks up partway through the block.
+	 */
+	size_t update(const uint8_t *input, uint8_t *output, size_t length) {
+		uint64_t position = mPosition;
+		//Chunks after the first have to start on a block boundary, so the first one soaks up
+		// the rest of a partial block
+		size_t lead = (Cipher::block_size - position % Cipher::block_size) % Cipher::block_size;
+		if (mPool != nullptr && mPool->size() > 0 && length >= parallel_threshold) {
+			size_t chunks = (length - lead + parallel_chunk - 1) / parallel_chunk;
+			mPool->run(chunks, [this, input, output, length, position, lead](size_t chunk) {
+				size_t start = chunk == 0 ? 0 : lead + chunk * parallel_chunk;
+				size_t end = lead + (chunk + 1) * parallel_chunk;
+				if (end > length) {
+					end = length;
+				}
+				apply(input + start, output + start, end - start, position + start);
+			});
+		} else {
+			apply(input, output, length, position);
+		}
+		mPosition += length;
+		return length;
+	}
+};
+
+//Counter mode for whichever cipher the protocol is built with. The toy DES has its own, which
+// builds its whole keystream up front.
+#ifdef CRYPTO2_FULL_DES
+typedef block_ctr<des64_backend> session_ctr;
+#else
+typedef des_ctr session_ctr;
+#endif
+
+#endif //CRYPTO2_CIPHER_MODES_H
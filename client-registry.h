@@ -0,0 +1,252 @@
+//
+// Created by Glenn Smith on 10/10/18.
+//
+
+#ifndef CRYPTO2_CLIENT_REGISTRY_H
+#define CRYPTO2_CLIENT_REGISTRY_H
+
+#include <arpa/inet.h>
+#include <mutex>
+#include <vector>
+#include "charStream.h"
+#include "cipher-backend.h"
+
+/**
+ * How full the registry is and how far lookups have to go, for keeping an eye on it
+ */
+struct registry_stats {
+	size_t clients;
+	size_t buckets;
+	//Fraction of buckets in use
+	double occupancy;
+	//Buckets a lookup of a registered client looks at, on average and at worst
+	double mean_probe;
+	size_t max_probe;
+};
+
+/**
+ * Hash table from a client's ID to their KDC key. Entries live in slots that never move once
+ * they're in, found through an open-addressing index (linear probing) that only holds each
+ * entry's slot and hash, so a probe sequence is a short run of one small array. Removal shifts
+ * the rest of the run back instead of leaving tombstones, so probes stay as short as if the
+ * removed entry had never been there. Not thread safe on its own.
+ */
+class client_table {
+public:
+	struct entry {
+		U64 id;
+		cipher_key key;
+		//Which connection registered it, so a stale disconnect can't remove a newer registration
+		U64 owner;
+	};
+
+private:
+	struct bucket {
+		U32 slot;
+		U32 hash;
+	};
+	static const U32 empty = 0xFFFFFFFF;
+
+	std::vector<entry> mSlots;
+	std::vector<U32> mFreeSlots;
+	std::vector<bucket> mBuckets;
+	size_t mCount;
+
+	size_t mask() const {
+		return mBuckets.size() - 1;
+	}
+
+	/**
+	 * Bucket holding id, or the empty bucket its probe sequence ends at
+	 */
+	size_t locate(U64 id, U32 hash) const {
+		for (size_t i = hash & mask(); ; i = (i + 1) & mask()) {
+			const bucket &b = mBuckets[i];
+			if (b.slot == empty || (b.hash == hash && mSlots[b.slot].id == id)) {
+				return i;
+			}
+		}
+	}
+
+	void grow() {
+		std::vector<bucket> old(mBuckets.size() * 2, bucket{empty, 0});
+		old.swap(mBuckets);
+		for (const bucket &b : old) {
+			if (b.slot != empty) {
+				size_t i = b.hash & mask();
+				while (mBuckets[i].slot != empty) {
+					i = (i + 1) & mask();
+				}
+				mBuckets[i] = b;
+			}
+		}
+	}
+
+public:
+	explicit client_table(size_t buckets = 64) : mBuckets(buckets, bucket{empty, 0}), mCount(0) {}
+
+	/**
+	 * Spread the ID's bits out so neighbouring ports land nowhere near each other
+	 */
+	static U64 hash_id(U64 id) {
+		id ^= id >> 33;
+		id *= 0xFF51AFD7ED558CCDULL;
+		id ^= id >> 33;
+		id *= 0xC4CEB9FE1A85EC53ULL;
+		id ^= id >> 33;
+		return id;
+	}
+
+	size_t size() const {
+		return mCount;
+	}
+
+	void insert(U64 id, U32 hash, const cipher_key &key, U64 owner) {
+		//Linear probing falls apart as it gets full, keep it at most 3/4 of the way
+		if ((mCount + 1) * 4 > mBuckets.size() * 3) {
+			grow();
+		}
+		size_t i = locate(id, hash);
+		if (mBuckets[i].slot != empty) {
+			mSlots[mBuckets[i].slot] = entry{id, key, owner};
+			return;
+		}
+
+		U32 slot;
+		if (!mFreeSlots.empty()) {
+			slot = mFreeSlots.back();
+			mFreeSlots.pop_back();
+			mSlots[slot] = entry{id, key, owner};
+		} else {
+			slot = static_cast<U32>(mSlots.size());
+			mSlots.push_back(entry{id, key, owner});
+		}
+		mBuckets[i] = bucket{slot, hash};
+		mCount ++;
+	}
+
+	const entry *find(U64 id, U32 hash) const {
+		size_t i = locate(id, hash);
+		return mBuckets[i].slot == empty ? nullptr : &mSlots[mBuckets[i].slot];
+	}
+
+	/**
+	 * Remove an entry, but only if owner is the one that put it there
+	 */
+	void remove(U64 id, U32 hash, U64 owner) {
+		size_t i = locate(id, hash);
+		if (mBuckets[i].slot == empty || mSlots[mBuckets[i].slot].owner != owner) {
+			return;
+		}
+		mFreeSlots.push_back(mBuckets[i].slot);
+		mCount --;
+
+		//Pull later entries in the run back into the hole if that's no further than where they
+		// want to be, so nothing is ever past an empty bucket from its home
+		size_t hole = i;
+		for (size_t j = (i + 1) & mask(); mBuckets[j].slot != empty; j = (j + 1) & mask()) {
+			size_t home = mBuckets[j].hash & mask();
+			if (((j - home) & mask()) >= ((j - hole) & mask())) {
+				mBuckets[hole] = mBuckets[j];
+				hole = j;
+			}
+		}
+		mBuckets[hole] = bucket{empty, 0};
+	}
+
+	/**
+	 * Add this table's numbers to stats (mean_probe is left as a total)
+	 */
+	void add_stats(registry_stats &stats) const {
+		stats.clients += mCount;
+		stats.buckets += mBuckets.size();
+		for (size_t i = 0; i < mBuckets.size(); i ++) {
+			if (mBuckets[i].slot != empty) {
+				size_t probe = ((i - (mBuckets[i].hash & mask())) & mask()) + 1;
+				stats.mean_probe += probe;
+				if (probe > stats.max_probe) {
+					stats.max_probe = probe;
+				}
+			}
+		}
+	}
+};
+
+/**
+ * Every registered client's KDC key, by the ID they registered with, shared between all of the
+ * KDC's threads so an NS1 handled on one thread can find a client B connected to another. Split
+ * into stripes with a lock and a table each, so threads only ever wait on each other when they
+ * happen to want the same stripe at the same time.
+ */
+class client_registry {
+	struct stripe {
+		std::mutex mutex;
+		client_table table;
+	};
+
+	static const size_t stripe_count = 64;
+	stripe mStripes[stripe_count];
+
+	static U64 id_key(const sockaddr_in &id) {
+		return (static_cast<U64>(id.sin_addr.s_addr) << 16) | id.sin_port;
+	}
+
+	//The low half of the hash picks the bucket and the high half the stripe, so every stripe's
+	// table still gets well spread out hashes
+
+	stripe &stripe_for(U64 hash) {
+		return mStripes[(hash >> 32) % stripe_count];
+	}
+
+public:
+	/**
+	 * Register (or re-register) a client's key under its ID
+	 */
+	void insert(const sockaddr_in &id, const cipher_key &key, U64 owner) {
+		U64 k = id_key(id);
+		U64 hash = client_table::hash_id(k);
+		stripe &s = stripe_for(hash);
+		std::lock_guard<std::mutex> lock(s.mutex);
+		s.table.insert(k, static_cast<U32>(hash), key, owner);
+	}
+
+	/**
+	 * Look up a client's key, returning false if nobody is registered with that ID
+	 */
+	bool find(const sockaddr_in &id, cipher_key &key) {
+		U64 k = id_key(id);
+		U64 hash = client_table::hash_id(k);
+		stripe &s = stripe_for(hash);
+		std::lock_guard<std::mutex> lock(s.mutex);
+		const client_table::entry *e = s.table.find(k, static_cast<U32>(hash));
+		if (e == nullptr) {
+			return false;
+		}
+		key = e->key;
+		return true;
+	}
+
+	/**
+	 * Remove a client's registration, if it's still the one that owner made
+	 */
+	void remove(const sockaddr_in &id, U64 owner) {
+		U64 k = id_key(id);
+		U64 hash = client_table::hash_id(k);
+		stripe &s = stripe_for(hash);
+		std::lock_guard<std::mutex> lock(s.mutex);
+		s.table.remove(k, static_cast<U32>(hash), owner);
+	}
+
+	registry_stats stats() {
+		registry_stats stats{};
+		for (stripe &s : mStripes) {
+			std::lock_guard<std::mutex> lock(s.mutex);
+			s.table.add_stats(stats);
+		}
+		stats.occupancy = stats.buckets > 0 ? static_cast<double>(stats.clients) / stats.buckets : 0;
+		stats.mean_probe = stats.clients > 0 ? stats.mean_probe / stats.clients : 0;
+		return stats;
+	}
+};
+
+#endif //CRYPTO2_CLIENT_REGISTRY_H
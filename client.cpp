@@ -7,295 +7,1232 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <functional>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include "needham-schroeder.h"
+#include "data-channel.h"
 #include "diffie-hellman.h"
+#include "dh-pool.h"
+#include "event-loop.h"
+#include "connection-pool.h"
+#include "ticket-cache.h"
 #include "net.h"
 #include "util.h"
 
 #define KDC_ADDR "127.0.0.1"
 #define KDC_PORT 12345
+//How many peers' tickets to keep around
+#define TICKET_CACHE_SIZE 64
+//How many idle connections to other clients to keep open, and for how long (ms)
+#define CONNECTION_POOL_SIZE 256
+#define CONNECTION_IDLE_MS 30000
 
-int ns_starter(sockaddr_in server_addr, int client_sock, std::bitset<10> key);
-int ns_receiver(int server_sock, std::bitset<10> key);
+//How long (ms) a handshake can sit in any one state before we give up on it
+#define HANDSHAKE_TIMEOUT_MS 5000
+//How long (ms) a stream can go without getting anywhere, while it's the other end holding it up
+#define STREAM_IDLE_MS 10000
 
-int main(int argc, const char **argv) {
-	sockaddr_in server_addr{};
-	int server_sock;
-	if (get_server_sock(INADDR_ANY, 0, server_sock, server_addr) < 0) {
-		return EXIT_FAILURE;
+//How much (bytes) a stream sends and for how long (ms) before it switches keys, by default
+#define REKEY_BYTES (256ULL * 1024 * 1024)
+#define REKEY_MS 60000
+
+enum handshake_state {
+	//A: sent NS1, waiting for the KDC's NS2
+	HS_WAIT_NS2,
+	//A: connecting to B
+	HS_CONNECTING,
+	//A: sent NS3, waiting for B's NS4
+	HS_WAIT_NS4,
+	//B: accepted A, waiting for their NS3
+	HS_WAIT_NS3,
+	//B: sent NS4, waiting for A's NS5
+	HS_WAIT_NS5,
+	//A: done once NS5 makes it out
+	HS_SEND_NS5,
+	//Either: done, connection kept open for the next handshake with the same peer
+	HS_IDLE,
+	//A: done, streaming data to B and then waiting for them to say they got it all
+	HS_SENDING,
+	//B: done, A is streaming data to us
+	HS_RECEIVING,
+};
+
+const char *handshake_state_name(handshake_state state) {
+	switch (state) {
+		case HS_WAIT_NS2: return "NS2";
+		case HS_CONNECTING: return "a connection";
+		case HS_WAIT_NS4: return "NS4";
+		case HS_WAIT_NS3: return "NS3";
+		case HS_WAIT_NS5: return "NS5";
+		case HS_SEND_NS5: return "NS5 to send";
+		case HS_IDLE: return "anything";
+		case HS_SENDING: return "the stream to be acked";
+		case HS_RECEIVING: return "the rest of the stream";
 	}
+	return "?";
+}
 
-	on_scope_exit server_sock_closer{[server_sock]() {
-		close(server_sock);
-	}};
+/**
+ * One handshake in progress, from either end
+ */
+struct handshake {
+	bool active;
+	handshake_state state;
+	//New one every time the state changes, so a timeout set for an earlier state knows it's stale
+	U32 step;
+	//Connection to the other client, or -1 while waiting on the KDC
+	int sock;
+	//A: who we're talking to. B: where they connected from.
+	ID peer;
+	cipher_key session_key;
+	encrypt_buf encrypt_ns3;
+	//nonce_1 while waiting on NS2 (A), nonce_2 while waiting on NS5 (B)
+	U8 nonce;
+	//A: the ticket came out of the cache, so the KDC is worth a try if B doesn't take it
+	bool cached;
+	//A: the connection came out of the pool, so a fresh one is worth a try if it's gone dead
+	bool reused;
+	frame_reader reader;
+	frame_writer writer;
+	//A: what to stream to them once the handshake's done (ours to close), -1 for nothing
+	int send_fd;
+	std::unique_ptr<data_sender> sender;
+	std::unique_ptr<data_receiver> receiver;
+	//The kernel numbers MSG_ZEROCOPY sends per socket, not per stream, so each stream sent over
+	// this connection picks up the count from the last: the next id, and every id below this is done
+	U32 zerocopy_next;
+	U32 zerocopy_done;
+	//When the stream last got anywhere (ms), for its idle timeout
+	U64 active_at;
+};
 
-	std::bitset<10> key;
+/**
+ * Everything a client does once it's registered, driven by one event loop so any number of
+ * handshakes (started from stdin, or by other clients connecting to us) can be in flight at
+ * once. Each one is a little state machine that moves along as its messages arrive, and gets
+ * dropped if it spends too long in any one state.
+ */
+struct ns_client {
+	epoll_loop &loop;
+	//Who we are, as far as the KDC and other clients know
+	ID our_id;
+	//Shared with the KDC
+	cipher_key key;
+	ticket_cache &tickets;
+	//Handshakes' connections that are done, by whoever's on the other end
+	connection_pool pool;
+	//Where streams other clients send us go, -1 to throw them away
+	int output;
+	//Extra threads for the stream ciphers
+	thread_pool &cipher_pool;
+	//When streams we send switch keys
+	rekey_policy rekey;
+	//Streams we've been asked to send that haven't finished yet, and how many didn't make it
+	size_t pending_sends;
+	size_t failed_sends;
 
-	//Send that off to the key server
-	int client_sock;
-	sockaddr_in client_addr{};
-	if (get_client_sock(KDC_ADDR, KDC_PORT, client_sock, client_addr) < 0) {
-		return EXIT_FAILURE;
+	int kdc_sock;
+	frame_reader kdc_reader;
+	frame_writer kdc_writer;
+
+	std::vector<handshake> handshakes;
+	std::vector<size_t> free_handshakes;
+	//Handshake index + 1 for each socket fd, 0 for sockets that aren't a handshake's
+	std::vector<size_t> by_sock;
+	//A's waiting on an NS2, by who they asked about and their nonce. The KDC doesn't answer at
+	// all for peers it doesn't know, so replies can't just be matched up in order.
+	std::unordered_multimap<U64, size_t> awaiting_ns2;
+
+	struct timeout {
+		U64 deadline;
+		size_t index;
+		U32 step;
+
+		bool operator>(const timeout &other) const {
+			return deadline > other.deadline;
+		}
+	};
+	std::priority_queue<timeout, std::vector<timeout>, std::greater<timeout>> timeouts;
+	//Never reused, even when a handshake's slot is
+	U32 steps;
+
+	ns_client(epoll_loop &loop, const ID &our_id, const cipher_key &key, ticket_cache &tickets, int output,
+	          thread_pool &cipher_pool, const rekey_policy &rekey, int kdc_sock, frame_reader &&kdc_reader) : loop(loop),
+		our_id(our_id), key(key), tickets(tickets), pool(CONNECTION_POOL_SIZE, CONNECTION_IDLE_MS), output(output),
+		cipher_pool(cipher_pool), rekey(rekey), pending_sends(0), failed_sends(0), kdc_sock(kdc_sock), kdc_reader(std::move(kdc_reader)), steps(0) {}
+
+	static U64 peer_key(const ID &peer) {
+		return (static_cast<U64>(peer.sin_addr.s_addr) << 16) | peer.sin_port;
 	}
 
-	on_scope_exit client_sock_closer{[client_sock]() {
-		close(client_sock);
-	}};
+	static U64 ns2_key(const ID &peer, U8 nonce) {
+		return (static_cast<U64>(peer.sin_addr.s_addr) << 24) | (static_cast<U64>(peer.sin_port) << 8) | nonce;
+	}
 
-	//Register ourselves immediately
-	dh_key server_key{};
-	dh_key client_key{};
-	{
-		CharStream resp;
-		if (recv_stream(client_sock, resp) < 0) {
-			return EXIT_FAILURE;
+	size_t allocate() {
+		size_t index;
+		if (!free_handshakes.empty()) {
+			index = free_handshakes.back();
+			free_handshakes.pop_back();
+		} else {
+			index = handshakes.size();
+			handshakes.emplace_back();
 		}
-		if (resp.pop<U8>() != 0) {
-			printf("Unknown DH command\n");
-			return EXIT_FAILURE;
+		handshakes[index] = handshake{};
+		handshakes[index].active = true;
+		handshakes[index].sock = -1;
+		handshakes[index].send_fd = -1;
+		return index;
+	}
+
+	void set_state(size_t index, handshake_state state) {
+		handshake &h = handshakes[index];
+		h.state = state;
+		h.step = ++ steps;
+		//Idle connections time out in the pool instead. Streams take as long as they take, as
+		// long as they keep moving: this is pushed back as they do (see expire()).
+		U64 now = monotonic_ms();
+		if (state == HS_SENDING || state == HS_RECEIVING) {
+			h.active_at = now;
+			timeouts.push(timeout{now + STREAM_IDLE_MS, index, h.step});
+		} else if (state != HS_IDLE) {
+			timeouts.push(timeout{now + HANDSHAKE_TIMEOUT_MS, index, h.step});
 		}
-		//Get server's key
-		server_key.y = resp.pop<U16>();
 	}
-	//Generate own dh key
-	client_key.x = static_cast<uint16_t>(rand_u64() % global_dh.q);
-	client_key.y = exp_mod_16(global_dh.alpha, client_key.x, global_dh.q);
 
-	//k_AB = yA ^ xB mod q
-	uint16_t k_AB = exp_mod_16(server_key.y, client_key.x, global_dh.q);
-	key = std::bitset<10>{static_cast<uint64_t>(k_AB)};
+	/**
+	 * Send events on fd to a handshake: its connection, or the notifications from its stream
+	 */
+	int watch(size_t index, int fd) {
+		if (static_cast<size_t>(fd) >= by_sock.size()) {
+			by_sock.resize(fd + 1);
+		}
+		by_sock[fd] = index + 1;
+		return loop.add(fd);
+	}
 
-	//Tell server our key
-	{
-		CharStream str;
-		str.push<U8>(0); //Register
-		str.push<ID>(server_addr);
-		str.push<U16>(client_key.y);
-		if (send_stream(client_sock, str) < 0) {
-			return EXIT_FAILURE;
+	int attach(size_t index, int sock) {
+		handshakes[index].sock = sock;
+		handshakes[index].zerocopy_next = 0;
+		handshakes[index].zerocopy_done = 0;
+		return watch(index, sock);
+	}
+
+	void detach(handshake &h) {
+		if (h.sock >= 0) {
+			by_sock[h.sock] = 0;
+			close(h.sock);
+			h.sock = -1;
 		}
 	}
 
-	printf("Registered with KDC, their pubkey %d our pubkey %d\n", static_cast<int>(server_key.y), static_cast<int>(client_key.y));
+	/**
+	 * Done with a stream, one way or the other. Its notification fd goes with it. If the kernel
+	 * still has hold of some of what the stream sent (which it only will if the stream broke off)
+	 * so does the connection: it's reset and closed before the chunks go.
+	 */
+	void end_stream(handshake &h) {
+		if (h.sender) {
+			//Clears its completions off the error queue too, so the connection goes idle with it empty
+			if (h.sock >= 0) {
+				h.sender->zerocopy_ids(h.sock, h.zerocopy_next, h.zerocopy_done);
+				if (h.sender->pinned()) {
+					set_abort_on_close(h.sock);
+					detach(h);
+				}
+			}
+			by_sock[h.sender->notify_fd()] = 0;
+			h.sender.reset();
+		}
+		if (h.receiver) {
+			by_sock[h.receiver->notify_fd()] = 0;
+			h.receiver.reset();
+		}
+	}
 
-	while (true) {
-		fd_set fds;
-		FD_ZERO(&fds);
-		FD_SET(fileno(stdin), &fds);
-		FD_SET(server_sock, &fds);
-		int max_fd = std::max(fileno(stdin), server_sock);
-
-		//Being fun and writing only one client... either reads from stdin or from the socket
-		if (select(max_fd + 1, &fds, nullptr, nullptr, nullptr) < 0) {
-			perror("select");
-			if (errno == EINTR) {
-				continue;
-			} else {
-				break;
+	void send_finished(bool success) {
+		pending_sends --;
+		if (!success) {
+			failed_sends ++;
+		}
+	}
+
+	/**
+	 * Close a connection and free up its slot
+	 */
+	void release(size_t index) {
+		handshake &h = handshakes[index];
+		if (h.send_fd >= 0 || h.sender) {
+			printf("Never finished sending to %s:%d\n", inet_ntoa(h.peer.sin_addr), ntohs(h.peer.sin_port));
+			if (h.send_fd >= 0) {
+				close(h.send_fd);
 			}
+			send_finished(false);
 		}
+		end_stream(h);
+		detach(h);
+		handshakes[index] = handshake{};
+		free_handshakes.push_back(index);
+	}
 
-		if (FD_ISSET(fileno(stdin), &fds)) {
-			//We're going to be sending out the start of the handshake
-			int ns_status = ns_starter(server_addr, client_sock, key);
-			if (ns_status < 0) {
-				if (errno != EINTR) {
-					break;
-				}
-			} else if (ns_status == 0) {
-				printf("NS handshake success\n");
-			} else if (ns_status > 0) {
-				printf("Error with NS handshake\n");
-			}
-		} else if (FD_ISSET(server_sock, &fds)) {
-			//Receiving a handshake on our socket
-			int ns_status = ns_receiver(server_sock, key);
-			if (ns_status < 0) {
-				if (errno != EINTR) {
-					break;
-				}
-			} else if (ns_status == 0) {
-				printf("NS handshake success\n");
-			} else if (ns_status > 0) {
-				printf("Error with NS handshake\n");
+	/**
+	 * Keep a finished handshake's connection around for the next one with the same peer
+	 */
+	void idle(size_t index) {
+		handshake &h = handshakes[index];
+		h.cached = false;
+		h.reused = false;
+		set_state(index, HS_IDLE);
+
+		size_t evicted;
+		if (pool.put(peer_key(h.peer), index, monotonic_ms(), evicted)) {
+			release(evicted);
+		}
+	}
+
+	/**
+	 * A handshake is over, one way or the other
+	 */
+	void finish(size_t index, bool success) {
+		handshake &h = handshakes[index];
+		if (success) {
+			printf("NS handshake success (%s:%d)\n", inet_ntoa(h.peer.sin_addr), ntohs(h.peer.sin_port));
+			if (h.send_fd >= 0) {
+				start_send(index);
+				return;
 			}
+			idle(index);
+			return;
 		}
+
+		if (h.state == HS_SENDING || h.state == HS_RECEIVING) {
+			//No telling how much of it they got, or where the connection is up to
+			printf("Stream with %s:%d broke off\n", inet_ntoa(h.peer.sin_addr), ntohs(h.peer.sin_port));
+			release(index);
+			return;
+		}
+
+		detach(h);
+		h.reader = frame_reader{};
+		h.writer = frame_writer{};
+		if (h.reused && h.state == HS_WAIT_NS4) {
+			//They probably closed it for being idle just as we picked it up
+			printf("Pooled connection went dead, reconnecting\n");
+			h.reused = false;
+			encrypt_buf encrypt_ns3 = h.encrypt_ns3;
+			connect_b(index, h.session_key, encrypt_ns3);
+			return;
+		} else if (h.cached) {
+			//They might have restarted (new KDC key) or the ticket aged out on their clock; either
+			// way a fresh one from the KDC will do
+			printf("Cached ticket not accepted, asking the KDC\n");
+			tickets.remove(h.peer);
+			h.cached = false;
+			send_ns1(index);
+			return;
+		}
+		printf("Error with NS handshake (%s:%d)\n", inet_ntoa(h.peer.sin_addr), ntohs(h.peer.sin_port));
+		release(index);
 	}
 
-	return 0;
-}
+	/**
+	 * Start a handshake with B, from a ticket we already have if we can. The NS1 (if it needs one)
+	 * goes out with the next flush_kdc(). If send_fd isn't -1, everything in it gets streamed to B
+	 * once the handshake's done (and closed after).
+	 */
+	void start(const ID &peer, int send_fd = -1) {
+		//Still connected from last time, so this can skip the connection setup too
+		size_t index;
+		bool reused = pool.take(peer_key(peer), index);
+		if (reused) {
+			printf("Reusing connection to %s:%d\n", inet_ntoa(peer.sin_addr), ntohs(peer.sin_port));
+		} else {
+			index = allocate();
+		}
+		handshake &h = handshakes[index];
+		h.peer = peer;
+		h.reused = reused;
+		h.send_fd = send_fd;
+		if (send_fd >= 0) {
+			pending_sends ++;
+		}
 
-int ns_starter(sockaddr_in server_addr, int client_sock, std::bitset<10> key) {
-	char addr[128];
-	short port;
-	fscanf(stdin, "%s %hd", addr, &port);
+		//Talked to them recently, so we can skip the KDC and go straight to NS3
+		if (const ticket *cached = tickets.find(peer)) {
+			printf("Reusing ticket, session key: %llu\n",
+			       static_cast<unsigned long long>(session_cipher::key_value(cached->session_key)));
+			h.cached = true;
+			connect_b(index, cached->session_key, cached->encrypt_ns3);
+			return;
+		}
+		send_ns1(index);
+	}
 
-	NS1 ns1{};
-	ns1.id_a = server_addr;
-	inet_pton(AF_INET, addr, &ns1.id_b.sin_addr);
-	ns1.id_b.sin_port = htons(port);
-	ns1.nonce_1 = static_cast<uint8_t>(rand_u64());
+	void send_ns1(size_t index) {
+		handshake &h = handshakes[index];
+		NS1 ns1{};
+		ns1.id_a = our_id;
+		ns1.id_b = h.peer;
+		ns1.nonce_1 = static_cast<uint8_t>(rand_u64());
+		h.nonce = ns1.nonce_1;
+
+		//Fixed size, so this fits on the stack
+		U8 packet[1 + wire_size<NS1>::value];
+		packet[0] = 1;
+		encode_message<NS1>(ns1, packet + 1);
+		kdc_writer.push(CharStream::view(packet, sizeof(packet)));
+
+		awaiting_ns2.emplace(ns2_key(h.peer, h.nonce), index);
+		set_state(index, HS_WAIT_NS2);
+	}
+
+	/**
+	 * Now we gotta talk to b, over the connection we already have if there is one
+	 */
+	void connect_b(size_t index, const cipher_key &session_key, const encrypt_buf &encrypt_ns3) {
+		handshake &h = handshakes[index];
+		h.session_key = session_key;
+		h.encrypt_ns3 = encrypt_ns3;
 
-	{
 		CharStream str;
-		str.push<U8>(1);
-		str.push(ns1);
+		str.push<U8>(3);
+		str.push<encrypt_buf>(h.encrypt_ns3);
+		h.writer.push(str);
 
-		if (send_stream(client_sock, str) < 0) {
-			return -1;
+		if (h.sock >= 0) {
+			set_state(index, HS_WAIT_NS4);
+			//Already writable, so there won't be an event saying so
+			if (h.writer.flush(h.sock) < 0) {
+				finish(index, false);
+			}
+			return;
+		}
+
+		int sock;
+		if (start_connect(h.peer, sock) < 0) {
+			finish(index, false);
+			return;
 		}
+		if (attach(index, sock) < 0) {
+			finish(index, false);
+			return;
+		}
+		set_state(index, HS_CONNECTING);
 	}
 
-	//Expect a NS2 message back
-	CharStream resp;
-	if (recv_stream(client_sock, resp) < 0) {
-		return -1;
+	/**
+	 * The handshake's done and there's something to send them, so start streaming it under the
+	 * session key
+	 */
+	void start_send(size_t index) {
+		handshake &h = handshakes[index];
+		h.cached = false;
+		h.reused = false;
+		h.sender.reset(new data_sender(h.send_fd, h.session_key, rekey, &cipher_pool));
+		h.sender->use_zerocopy(h.sock, h.zerocopy_next, h.zerocopy_done);
+		h.send_fd = -1;
+		set_state(index, HS_SENDING);
+		if (watch(index, h.sender->notify_fd()) < 0) {
+			finish(index, false);
+			return;
+		}
+
+		CharStream str;
+		str.push<U8>(DATA_OPEN);
+		str.push<U64>(h.sender->iv());
+		str.push<U64>(h.sender->length());
+		str.push<U64>(h.sender->nonce());
+		h.writer.push(str);
+		if (pump_send(index) < 0) {
+			finish(index, false);
+		}
 	}
-	if (resp.pop<U8>() != 2) {
-		printf("Did not get a NS2 response\n");
-		return 1;
+
+	/**
+	 * Send as much of a stream as the connection will take. Returns < 0 if it's broken.
+	 */
+	int pump_send(size_t index) {
+		handshake &h = handshakes[index];
+		//Anything already queued (the DATA_OPEN) goes first
+		if (!h.writer.empty() && h.writer.flush(h.sock) < 0) {
+			perror("send");
+			return -1;
+		}
+		if (!h.writer.empty()) {
+			return 0;
+		}
+		U64 sent = h.sender->sent();
+		int status = h.sender->pump(h.sock);
+		if (h.sender->sent() != sent) {
+			h.active_at = monotonic_ms();
+		}
+		return status < 0 ? -1 : 0;
 	}
-	encrypt_buf buf = resp.pop<encrypt_buf>();
 
-	NS2 ns2 = decrypt<NS2>(buf, key);
-	if (ns1.nonce_1 != ns2.nonce_1) {
-		printf("Nonce mismatch\n");
-		return 1;
+	/**
+	 * A stream we were receiving has been written out, so tell them we got it
+	 */
+	void check_receive(size_t index) {
+		handshake &h = handshakes[index];
+		int status = h.receiver->status();
+		if (status == 0) {
+			return;
+		}
+		if (status < 0) {
+			finish(index, false);
+			return;
+		}
+
+		double seconds = h.receiver->elapsed();
+		printf("Received %llu bytes from %s:%d in %.3f s (%.2f MB/s)\n",
+		       static_cast<unsigned long long>(h.receiver->bytes()), inet_ntoa(h.peer.sin_addr),
+		       ntohs(h.peer.sin_port), seconds, h.receiver->bytes() / seconds / 1e6);
+
+		CharStream str;
+		str.push<U8>(DATA_ACK);
+		str.push<U64>(h.receiver->bytes());
+		h.writer.push(str);
+		if (h.writer.flush(h.sock) < 0) {
+			perror("send");
+			finish(index, false);
+			return;
+		}
+		end_stream(h);
+		idle(index);
 	}
-	if (!is_valid_timestamp(ns2.timestamp)) {
-		printf("Invalid timestamp on NS2, probable replay attack\n");
-		return 1;
+
+	/**
+	 * Another client connected to us and will be sending an NS3
+	 */
+	void accepted(int sock, const sockaddr_in &addr) {
+		set_nodelay(sock);
+		size_t index = allocate();
+		handshakes[index].peer = addr;
+		if (attach(index, sock) < 0) {
+			finish(index, false);
+			return;
+		}
+		set_state(index, HS_WAIT_NS3);
 	}
 
-	std::bitset<10> session_key = ns2.session_key;
-	printf("Got session key: %d\n", static_cast<int>(session_key.to_ullong()));
+	void handle_kdc_message(CharStream &cs) {
+		U8 cmd;
+		if (!pop_message<U8>(cs, cmd) || cmd != 2) {
+			printf("Did not get a NS2 response\n");
+			return;
+		}
+		NS2 ns2;
+		if (!pop_encrypted<NS2>(cs, key, ns2)) {
+			printf("Malformed NS2\n");
+			return;
+		}
 
-	//Now we gotta talk to b
-	int b_sock;
-	sockaddr_in b_addr{};
-	if (get_client_sock(inet_ntoa(ns2.id_b.sin_addr), ntohs(ns2.id_b.sin_port),
-	                    b_sock, b_addr) < 0) {
-		return -1;
+		auto range = awaiting_ns2.equal_range(ns2_key(ns2.id_b, ns2.nonce_1));
+		if (range.first == range.second) {
+			printf("Nonce mismatch\n");
+			return;
+		}
+		size_t index = range.first->second;
+		awaiting_ns2.erase(range.first);
+
+		if (!is_valid_timestamp(ns2.timestamp)) {
+			printf("Invalid timestamp on NS2, probable replay attack\n");
+			finish(index, false);
+			return;
+		}
+
+		printf("Got session key: %llu\n", static_cast<unsigned long long>(session_cipher::key_value(ns2.session_key)));
+		tickets.insert(handshakes[index].peer, ns2.session_key, ns2.encrypt_ns3, ns2.timestamp);
+		connect_b(index, ns2.session_key, ns2.encrypt_ns3);
 	}
 
-	//To cleanup the b socket when we're done with it
-	on_scope_exit b_sock_closer{[b_sock]() {
-		close(b_sock);
-	}};
+	/**
+	 * Move a handshake along with the message that just came in. Returns < 0 if it's failed
+	 * (including if the message is cut short), > 0 if it's already been released.
+	 */
+	int handle_peer_message(size_t index, CharStream &cs) {
+		handshake &h = handshakes[index];
+		U8 cmd;
+		if (!pop_message<U8>(cs, cmd)) {
+			printf("Empty message\n");
+			return -1;
+		}
 
-	{
-		CharStream str;
-		str.push<U8>(3);
-		str.push<encrypt_buf>(ns2.encrypt_ns3);
+		//A coming back for another handshake over the connection they used last time
+		if (h.state == HS_IDLE && cmd == 3) {
+			pool.remove(index);
+			h.state = HS_WAIT_NS3;
+		}
 
-		if (send_stream(b_sock, str) < 0) {
+		//A streaming data to us now the handshake's done
+		if (h.state == HS_IDLE && cmd == DATA_OPEN) {
+			pool.remove(index);
+			U64 iv, length, nonce;
+			if (!pop_message<U64>(cs, iv) || !pop_message<U64>(cs, length) || !pop_message<U64>(cs, nonce)) {
+				printf("Malformed stream header\n");
+				return -1;
+			}
+			h.receiver.reset(new data_receiver(output, h.session_key, iv, length, nonce, &cipher_pool));
+			set_state(index, HS_RECEIVING);
+			return watch(index, h.receiver->notify_fd());
+		}
+		//Only gets these once the receiver is ready() for them (see read_peer())
+		if (h.state == HS_RECEIVING) {
+			h.active_at = monotonic_ms();
+			if (cmd == DATA_CHUNK || cmd == DATA_REKEY) {
+				bool rekey = cmd == DATA_REKEY;
+				U64 nonce = 0;
+				if (rekey && !pop_message<U64>(cs, nonce)) {
+					printf("Malformed rekey\n");
+					return -1;
+				}
+				size_t length = cs.size();
+				if (!h.receiver->push(cs.consume(length), length, rekey, nonce)) {
+					printf("Stream chunk of %zu bytes is too big\n", length);
+					return -1;
+				}
+				return 0;
+			}
+			if (cmd == DATA_CLOSE) {
+				U64 total;
+				if (!pop_message<U64>(cs, total)) {
+					printf("Malformed end of stream\n");
+					return -1;
+				}
+				h.receiver->finish(total);
+				return 0;
+			}
+			printf("Unexpected message %d in a stream\n", cmd);
 			return -1;
 		}
-	}
+		if (h.state == HS_SENDING) {
+			U64 total;
+			if (cmd != DATA_ACK || !pop_message<U64>(cs, total)) {
+				printf("Did not get a stream ack\n");
+				return -1;
+			}
+			if (total != h.sender->bytes()) {
+				printf("They only got %llu of %llu bytes\n", static_cast<unsigned long long>(total),
+				       static_cast<unsigned long long>(h.sender->bytes()));
+				return -1;
+			}
+			double seconds = h.sender->elapsed();
+			printf("Sent %llu bytes to %s:%d in %.3f s (%.2f MB/s, %llu rekeys)\n", static_cast<unsigned long long>(total),
+			       inet_ntoa(h.peer.sin_addr), ntohs(h.peer.sin_port), seconds, total / seconds / 1e6,
+			       static_cast<unsigned long long>(h.sender->rekeys()));
+			end_stream(h);
+			send_finished(true);
+			if (h.sock < 0) {
+				//Acked before the kernel said it was done with it all, so the connection had to go
+				release(index);
+				return 1;
+			}
+			idle(index);
+			return 0;
+		}
+
+		if (h.state == HS_WAIT_NS4) {
+			NS4 ns4;
+			if (cmd != 4 || !pop_encrypted<NS4>(cs, h.session_key, ns4)) {
+				printf("Did not get a NS4 response\n");
+				return -1;
+			}
+			printf("Established connection, got NS4 nonce: %d\n", ns4.nonce_2);
+
+			NS5 ns5{};
+			ns5.f_nonce_2 = nonce_2_fn(ns4.nonce_2);
+			encrypted_packet<NS5> packet_ns5(5, ns5, h.session_key);
+			h.writer.push(packet_ns5.stream());
+			//Done as soon as it's sent
+			set_state(index, HS_SEND_NS5);
+			return 0;
+		}
+		if (h.state == HS_WAIT_NS3) {
+			NS3 ns3;
+			if (cmd != 3 || !pop_encrypted<NS3>(cs, key, ns3)) {
+				printf("Did not get a NS3 response\n");
+				return -1;
+			}
+			if (!is_valid_timestamp(ns3.timestamp)) {
+				printf("Invalid timestamp on NS3, probable replay attack\n");
+				return -1;
+			}
+			h.session_key = ns3.session_key;
+			printf("Got session key: %llu\n", static_cast<unsigned long long>(session_cipher::key_value(h.session_key)));
 
-	//Await NS4 response
-	CharStream resp2;
-	if (recv_stream(b_sock, resp2) < 0) {
+			//Better send an NS4
+			NS4 ns4{};
+			ns4.nonce_2 = static_cast<uint8_t>(rand_u64());
+			h.nonce = ns4.nonce_2;
+			printf("Send NS4 nonce: %d\n", ns4.nonce_2);
+			encrypted_packet<NS4> packet_ns4(4, ns4, h.session_key);
+			h.writer.push(packet_ns4.stream());
+			set_state(index, HS_WAIT_NS5);
+			return 0;
+		}
+		if (h.state == HS_WAIT_NS5) {
+			NS5 ns5;
+			if (cmd != 5 || !pop_encrypted<NS5>(cs, h.session_key, ns5)) {
+				printf("Did not get a NS5 response\n");
+				return -1;
+			}
+			if (ns5.f_nonce_2 != nonce_2_fn(h.nonce)) {
+				printf("f(nonce2) mismatch!\n");
+				return -1;
+			}
+			printf("Established connection, NS5 f(nonce2) match!\n");
+			//Straight back to idle rather than stopping here: A might have sent their next NS3
+			// right behind this, already sitting in the buffer
+			finish(index, true);
+			return 0;
+		}
+
+		printf("Unexpected message %d\n", cmd);
 		return -1;
 	}
 
-	if (resp2.pop<U8>() != 4) {
-		printf("Did not get a NS4 response\n");
-		return 1;
+	/**
+	 * Read everything on a socket and hand each whole message to handle(), until it runs dry or
+	 * handle() says to stop (returns nonzero, which this then returns). Stops early, leaving the
+	 * rest where it is (in the buffer or on the socket), whenever ready() says not to take any more
+	 * for now; calling this again once it is picks up from there. Returns < 0 if the socket closed
+	 * or broke.
+	 */
+	template<typename Handler, typename Ready>
+	int read_frames(int sock, frame_reader &reader, Handler handle, Ready ready) {
+		//The last read came up short, so the socket's empty
+		bool drained = false;
+		while (true) {
+			CharStream cs;
+			int status = 0;
+			while (ready() && (status = reader.next(cs)) > 0) {
+				int result = handle(cs);
+				if (result != 0) {
+					return result;
+				}
+			}
+			if (status < 0) {
+				printf("Bad frame\n");
+				return -1;
+			}
+			if (!ready()) {
+				return 0;
+			}
+			if (drained) {
+				break;
+			}
+
+			ssize_t nrecv = reader.fill(sock);
+			if (nrecv < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					break;
+				}
+				if (errno == ECONNRESET) {
+					//Same as them closing it, as far as we're concerned
+					return -1;
+				}
+				perror("recv");
+				return -1;
+			}
+			if (nrecv == 0) {
+				//They closed it
+				return -1;
+			}
+			drained = static_cast<size_t>(nrecv) < frame_reader::fill_size;
+		}
+		reader.release();
+		return 0;
 	}
-	encrypt_buf encrypt_ns4 = resp2.pop<encrypt_buf>();
-	NS4 ns4 = decrypt<NS4>(encrypt_ns4, session_key);
 
-	printf("Established connection, got NS4 nonce: %d\n", ns4.nonce_2);
+	template<typename Handler>
+	int read_frames(int sock, frame_reader &reader, Handler handle) {
+		return read_frames(sock, reader, handle, []() {
+			return true;
+		});
+	}
 
-	NS5 ns5{};
-	ns5.f_nonce_2 = nonce_2_fn(ns4.nonce_2);
+	/**
+	 * Read whatever a handshake's connection has for it. While it's receiving a stream, only as
+	 * much as the stream can take without waiting on the output; the rest waits until the
+	 * receiver's notify_fd() says there's room again. Returns < 0 if it's been dealt with (and so
+	 * the caller shouldn't go on with it).
+	 */
+	int read_peer(size_t index) {
+		handshake &h = handshakes[index];
+		int status = read_frames(h.sock, h.reader, [this, index](CharStream &cs) {
+			return handle_peer_message(index, cs);
+		}, [this, index]() {
+			handshake &current = handshakes[index];
+			return current.state != HS_RECEIVING || !current.receiver || current.receiver->ready();
+		});
+		if (status > 0) {
+			//The handler already dealt with it
+			return -1;
+		}
+		if (status < 0 && h.state == HS_IDLE) {
+			//Nothing lost, they just didn't want to keep it open
+			pool.remove(index);
+			release(index);
+			return -1;
+		}
+		if (status < 0 && h.state == HS_WAIT_NS2) {
+			//Connection from the pool closed while we wait on the KDC; we'll make a new one
+			detach(h);
+			h.reader = frame_reader{};
+			h.reused = false;
+			return -1;
+		}
+		if (status < 0) {
+			finish(index, false);
+			return -1;
+		}
+		return 0;
+	}
 
-	encrypt_buf encrypt_ns5 = encrypt<NS5>(ns5, session_key);
-	{
-		CharStream str;
-		str.push<U8>(5);
-		str.push<encrypt_buf>(encrypt_ns5);
+	/**
+	 * Something happened on a handshake's socket, or its stream has something for us
+	 */
+	void handle_peer_event(size_t index, int fd, int events) {
+		handshake &h = handshakes[index];
 
-		if (send_stream(b_sock, str) < 0) {
+		if (fd != h.sock) {
+			if (h.sender && pump_send(index) < 0) {
+				finish(index, false);
+			} else if (h.receiver) {
+				//Either it's all written out, or a chunk's free again and we can get back to reading
+				check_receive(index);
+				if (h.state == HS_RECEIVING && h.receiver && read_peer(index) == 0
+				    && !h.writer.empty() && h.writer.flush(h.sock) < 0) {
+					perror("send");
+					finish(index, false);
+				}
+			}
+			return;
+		}
+
+		if (h.state == HS_CONNECTING) {
+			if (!(events & (EVENT_WRITE | EVENT_CLOSE))) {
+				return;
+			}
+			int error = connect_error(h.sock);
+			if (error != 0) {
+				printf("connect: %s\n", strerror(error));
+				finish(index, false);
+				return;
+			}
+			set_state(index, HS_WAIT_NS4);
+		}
+
+		if ((events & EVENT_READ) && read_peer(index) < 0) {
+			return;
+		}
+		if (!h.writer.empty() && h.writer.flush(h.sock) < 0) {
+			perror("send");
+			finish(index, false);
+			return;
+		}
+		if (h.state == HS_SEND_NS5 && h.writer.empty()) {
+			finish(index, true);
+		} else if (h.state == HS_SENDING && pump_send(index) < 0) {
+			finish(index, false);
+		}
+	}
+
+	/**
+	 * Returns < 0 if we've lost the KDC
+	 */
+	int handle_kdc_event(int events) {
+		if (events & EVENT_READ) {
+			if (read_frames(kdc_sock, kdc_reader, [this](CharStream &cs) {
+				handle_kdc_message(cs);
+				return 0;
+			}) < 0) {
+				printf("Lost connection to the KDC\n");
+				return -1;
+			}
+		}
+		return flush_kdc();
+	}
+
+	int flush_kdc() {
+		if (!kdc_writer.empty() && kdc_writer.flush(kdc_sock) < 0) {
+			perror("send");
 			return -1;
 		}
+		return 0;
+	}
+
+	/**
+	 * Give up on anything that's been stuck too long. Returns how long (ms) until the next
+	 * deadline, or -1 if there's nothing to wait for.
+	 */
+	int expire() {
+		U64 now = monotonic_ms();
+		size_t idle_index;
+		while (pool.expire(now, idle_index)) {
+			release(idle_index);
+		}
+		int wait = pool.next_expiry(now);
+
+		while (!timeouts.empty()) {
+			timeout next = timeouts.top();
+			handshake &h = handshakes[next.index];
+			if (!h.active || h.step != next.step) {
+				//Moved on since this was set
+				timeouts.pop();
+				continue;
+			}
+			if (next.deadline > now) {
+				int until = static_cast<int>(next.deadline - now);
+				return wait < 0 || until < wait ? until : wait;
+			}
+			timeouts.pop();
+
+			//Streams only time out for going nowhere while it's up to the other end. Rather than a
+			// new timeout every time they get somewhere, the one they have is pushed back here.
+			if (h.state == HS_SENDING || h.state == HS_RECEIVING) {
+				bool waiting = h.sender ? h.sender->waiting_on_peer() : h.receiver && h.receiver->waiting_on_peer();
+				if (!waiting) {
+					h.active_at = now;
+				}
+				if (h.active_at + STREAM_IDLE_MS > now) {
+					timeouts.push(timeout{h.active_at + STREAM_IDLE_MS, next.index, next.step});
+					continue;
+				}
+				printf("Stream with %s:%d got nowhere for %d s\n", inet_ntoa(h.peer.sin_addr), ntohs(h.peer.sin_port),
+				       STREAM_IDLE_MS / 1000);
+				finish(next.index, false);
+				continue;
+			}
+
+			printf("Handshake with %s:%d timed out waiting for %s\n", inet_ntoa(h.peer.sin_addr),
+			       ntohs(h.peer.sin_port), handshake_state_name(h.state));
+			if (h.state == HS_WAIT_NS2) {
+				auto range = awaiting_ns2.equal_range(ns2_key(h.peer, h.nonce));
+				for (auto it = range.first; it != range.second; ++ it) {
+					if (it->second == next.index) {
+						awaiting_ns2.erase(it);
+						break;
+					}
+				}
+			}
+			finish(next.index, false);
+		}
+		return wait;
 	}
+};
 
-	//Encrypted communication happens here???
-	return 0;
+/**
+ * Parse "<ip>" and "<port>" into an ID
+ */
+bool parse_peer(const char *addr, const char *port, ID &peer) {
+	peer = ID{};
+	peer.sin_family = AF_INET;
+	peer.sin_port = htons(static_cast<uint16_t>(atoi(port)));
+	if (inet_pton(AF_INET, addr, &peer.sin_addr) != 1) {
+		printf("Bad address %s\n", addr);
+		return false;
+	}
+	return true;
 }
 
-int ns_receiver(int server_sock, std::bitset<10> key) {
-	socklen_t len = sizeof(sockaddr_in);
-	sockaddr_in a_addr{};
-	int a_sock = accept(server_sock, (sockaddr *)&a_addr, &len);
-	if (a_sock < 0) {
-		perror("accept");
-		return -1;
+/**
+ * Open a file to stream to someone, "-" meaning stdin
+ */
+int open_input(const char *path) {
+	if (strcmp(path, "-") == 0) {
+		return dup(fileno(stdin));
+	}
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror(path);
+	}
+	return fd;
+}
+
+/**
+ * Start a handshake for each whole "<ip> <port> [file]" line on stdin, and stream the file to them
+ * if there is one. Returns < 0 once there's nothing more coming.
+ */
+int read_commands(ns_client &state, std::string &pending) {
+	while (true) {
+		char buffer[4096];
+		ssize_t nread = read(fileno(stdin), buffer, sizeof(buffer));
+		if (nread < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			perror("read");
+			return -1;
+		}
+		if (nread == 0) {
+			return -1;
+		}
+		pending.append(buffer, static_cast<size_t>(nread));
+
+		size_t newline;
+		while ((newline = pending.find('\n')) != std::string::npos) {
+			std::string line = pending.substr(0, newline);
+			pending.erase(0, newline + 1);
+
+			char addr[128];
+			char port[16];
+			char path[1024];
+			int fields = sscanf(line.c_str(), "%127s %15s %1023s", addr, port, path);
+			ID peer;
+			if (fields >= 2 && parse_peer(addr, port, peer)) {
+				int send_fd = -1;
+				if (fields == 3 && (send_fd = open_input(path)) < 0) {
+					continue;
+				}
+				state.start(peer, send_fd);
+			}
+		}
+	}
+}
+
+int main(int argc, const char **argv) {
+	//Numbers first, then the send/recv options
+	int numbers = 1;
+	while (numbers < argc && strcmp(argv[numbers], "send") != 0 && strcmp(argv[numbers], "recv") != 0
+	       && strcmp(argv[numbers], "rekey") != 0) {
+		numbers ++;
 	}
+	//Start on our keypair for the group we expect the KDC to use while we're still connecting
+	const dh *expected_group = dh_group(numbers > 1 ? static_cast<unsigned>(atoi(argv[1])) : DEFAULT_DH_BITS);
+	//How long to reuse a peer's ticket for, 0 to always go through the KDC. They're no good past
+	// the timestamp window anyway.
+	int ticket_ttl = numbers > 2 ? atoi(argv[2]) : TIMESTAMP_WINDOW;
+	bool bad_args = numbers > 3;
 
-	//To clean up the socket when we're done with it
-	on_scope_exit a_sock_closer{[a_sock]() {
-		close(a_sock);
+	//send <ip> <port> [file]: stream the file (or stdin) to them and quit, instead of taking
+	// commands. recv <file>: write streams other clients send us there, instead of nowhere.
+	// rekey <bytes> [seconds]: switch keys in streams we send this often, 0 for no limit.
+	const char *send_addr = nullptr;
+	const char *send_port = nullptr;
+	const char *send_path = "-";
+	const char *recv_path = nullptr;
+	rekey_policy rekey{REKEY_BYTES, REKEY_MS};
+	for (int i = numbers; i < argc && !bad_args; ) {
+		if (strcmp(argv[i], "send") == 0 && i + 2 < argc) {
+			send_addr = argv[i + 1];
+			send_port = argv[i + 2];
+			i += 3;
+			if (i < argc && strcmp(argv[i], "recv") != 0 && strcmp(argv[i], "rekey") != 0) {
+				send_path = argv[i ++];
+			}
+		} else if (strcmp(argv[i], "recv") == 0 && i + 1 < argc) {
+			recv_path = argv[i + 1];
+			i += 2;
+		} else if (strcmp(argv[i], "rekey") == 0 && i + 1 < argc) {
+			rekey.bytes = strtoull(argv[i + 1], nullptr, 10);
+			i += 2;
+			if (i < argc && strcmp(argv[i], "send") != 0 && strcmp(argv[i], "recv") != 0) {
+				rekey.ms = static_cast<U64>(atof(argv[i ++]) * 1000);
+			}
+		} else {
+			bad_args = true;
+		}
+	}
+	if (expected_group == nullptr || ticket_ttl < 0 || bad_args) {
+		fprintf(stderr, "Usage: %s [16|64|1024|2048|3072] [ticket ttl] [send <ip> <port> [file]] [recv <file>] "
+		        "[rekey <bytes> [seconds]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	ID send_peer;
+	if (send_addr != nullptr && !parse_peer(send_addr, send_port, send_peer)) {
+		return EXIT_FAILURE;
+	}
+	int send_fd = -1;
+	if (send_addr != nullptr && (send_fd = open_input(send_path)) < 0) {
+		return EXIT_FAILURE;
+	}
+	int output = -1;
+	if (recv_path != nullptr) {
+		//Read as well as write so streams can be decrypted straight into a mapping of it
+		output = open(recv_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (output < 0) {
+			perror(recv_path);
+			return EXIT_FAILURE;
+		}
+	}
+	on_scope_exit output_closer{[output]() {
+		if (output >= 0) {
+			close(output);
+		}
 	}};
+	//The pipeline stages have their own threads, so this is just for splitting up big chunks on
+	// whatever cores are left
+	unsigned cores = std::thread::hardware_concurrency();
+	thread_pool cipher_pool(cores > 1 ? cores - 1 : 0);
 
-	CharStream str;
-	if (recv_stream(a_sock, str) < 0) {
-		return -1;
+	dh_pool keys(*expected_group, 1);
+	ticket_cache tickets(TICKET_CACHE_SIZE, static_cast<uint64_t>(ticket_ttl));
+
+	sockaddr_in server_addr{};
+	int server_sock;
+	if (get_server_sock(INADDR_ANY, 0, server_sock, server_addr) < 0) {
+		return EXIT_FAILURE;
 	}
 
-	U8 cmd = str.pop<U8>();
-	if (cmd != 3) {
-		printf("Did not get a NS3 response\n");
-		return 1;
+	on_scope_exit server_sock_closer{[server_sock]() {
+		close(server_sock);
+	}};
+
+	cipher_key key;
+
+	//Send that off to the key server
+	int client_sock;
+	sockaddr_in client_addr{};
+	if (get_client_sock(KDC_ADDR, KDC_PORT, client_sock, client_addr) < 0) {
+		return EXIT_FAILURE;
 	}
 
-	encrypt_buf encrypt_ns3 = str.pop<encrypt_buf>();
-	NS3 ns3 = decrypt<NS3>(encrypt_ns3, key);
-	if (!is_valid_timestamp(ns3.timestamp)) {
-		printf("Invalid timestamp on NS3, probable replay attack\n");
-		return 1;
+	on_scope_exit client_sock_closer{[client_sock]() {
+		close(client_sock);
+	}};
+	//Anything the KDC sends that we haven't got to yet
+	frame_reader client_reader;
+
+	//Register ourselves immediately
+	const dh *group = nullptr;
+	bignum server_public;
+	{
+		CharStream resp;
+		if (recv_stream(client_sock, client_reader, resp) < 0) {
+			return EXIT_FAILURE;
+		}
+		if (resp.pop<U8>() != 0) {
+			printf("Unknown DH command\n");
+			return EXIT_FAILURE;
+		}
+		//Get server's group and key
+		group = dh_group(resp.pop<U16>());
+		if (group == nullptr) {
+			printf("KDC uses an unsupported DH group\n");
+			return EXIT_FAILURE;
+		}
+		std::vector<U8> pub_bytes = resp.pop<std::vector<U8>>();
+		server_public = dh_decode_public(*group, pub_bytes);
+		if (pub_bytes.size() != group->bytes() || !dh_valid_public(*group, server_public)) {
+			printf("KDC sent a bad public key\n");
+			return EXIT_FAILURE;
+		}
 	}
+	//Generate own dh key
+	dh_key client_key = group == expected_group ? keys.take() : dh_generate(*group);
 
-	std::bitset<10> session_key = ns3.session_key;
+	//k_AB = yA ^ xB mod q
+	key = session_cipher::key_from_secret(dh_secret_bits(dh_shared(*group, server_public, client_key.x)));
 
-	printf("Got session key: %d\n", static_cast<int>(session_key.to_ullong()));
+	//Tell server our key
+	{
+		CharStream str;
+		str.push<U8>(0); //Register
+		str.push<ID>(server_addr);
+		str.push<std::vector<U8>>(dh_encode_public(*group, client_key.y));
+		if (send_stream(client_sock, str) < 0) {
+			return EXIT_FAILURE;
+		}
+	}
 
-	//Better send an NS4
-	NS4 ns4{};
-	ns4.nonce_2 = static_cast<uint8_t>(rand_u64());
-	printf("Send NS4 nonce: %d\n", ns4.nonce_2);
-	encrypt_buf encrypt_ns4 = encrypt<NS4>(ns4, session_key);
+	printf("Registered with KDC (%u-bit group), their pubkey ...%016llx our pubkey ...%016llx\n", group->bits,
+	       static_cast<unsigned long long>(server_public[0]), static_cast<unsigned long long>(client_key.y[0]));
 
-	CharStream resp;
-	resp.push<U8>(4);
-	resp.push<encrypt_buf>(encrypt_ns4);
-	if (send_stream(a_sock, resp) < 0) {
-		return -1;
+	//Everything from here on is non-blocking, driven by one event loop
+	raise_fd_limit();
+	epoll_loop loop;
+	if (!loop.valid() || set_nonblocking(server_sock) < 0 || set_nonblocking(client_sock) < 0
+	    || loop.add(server_sock) < 0 || loop.add(client_sock) < 0) {
+		return EXIT_FAILURE;
 	}
+	ns_client state(loop, server_addr, key, tickets, output, cipher_pool, rekey, client_sock,
+	                std::move(client_reader));
 
-	//Expecting a NS5
-	CharStream str2;
-	if (recv_stream(a_sock, str2) < 0) {
-		return -1;
+	if (send_fd >= 0) {
+		state.start(send_peer, send_fd);
 	}
 
-	cmd = str2.pop<U8>();
-	if (cmd != 5) {
-		printf("Did not get a NS5 response\n");
-		return 1;
+	//Commands come in on stdin. Pipes and terminals can be waited on along with everything else;
+	// anything else (a file, /dev/null) can just be read all at once.
+	int stdin_fd = fileno(stdin);
+	int stdin_flags = fcntl(stdin_fd, F_GETFL, 0);
+	on_scope_exit stdin_restorer{[stdin_fd, stdin_flags]() {
+		fcntl(stdin_fd, F_SETFL, stdin_flags);
+	}};
+	std::string pending;
+	struct stat stdin_stat{};
+	fstat(stdin_fd, &stdin_stat);
+	if (send_addr != nullptr) {
+		//stdin is either what we're sending or not ours to read
+	} else if (S_ISFIFO(stdin_stat.st_mode) || S_ISSOCK(stdin_stat.st_mode) || isatty(stdin_fd)) {
+		if (set_nonblocking(stdin_fd) < 0 || loop.add(stdin_fd) < 0) {
+			return EXIT_FAILURE;
+		}
+	} else {
+		read_commands(state, pending);
 	}
 
-	encrypt_buf encrypt_ns5 = str2.pop<encrypt_buf>();
-	NS5 ns5 = decrypt<NS5>(encrypt_ns5, session_key);
+	bool running = true;
+	auto handle_event = [&](int sock, int events) {
+		if (sock == stdin_fd) {
+			if (read_commands(state, pending) < 0) {
+				//Out of commands, but other clients can still start handshakes with us
+				loop.remove(stdin_fd);
+			}
+		} else if (sock == server_sock) {
+			//Other clients starting handshakes, take all of them since we won't hear about these again
+			while (true) {
+				sockaddr_in addr{};
+				socklen_t len = sizeof(sockaddr_in);
+				int a_sock = accept4(server_sock, (sockaddr *)&addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				if (a_sock < 0) {
+					if (errno == EINTR || errno == ECONNABORTED) {
+						continue;
+					}
+					if (errno != EAGAIN && errno != EWOULDBLOCK) {
+						perror("accept");
+					}
+					break;
+				}
+				state.accepted(a_sock, addr);
+			}
+		} else if (sock == client_sock) {
+			if (state.handle_kdc_event(events) < 0) {
+				running = false;
+			}
+		} else if (static_cast<size_t>(sock) < state.by_sock.size() && state.by_sock[sock] != 0) {
+			state.handle_peer_event(state.by_sock[sock] - 1, sock, events);
+		}
+	};
 
-	if (ns5.f_nonce_2 != nonce_2_fn(ns4.nonce_2)) {
-		printf("f(nonce2) mismatch!\n");
-		return 1;
+	//Sending just the one stream, so stop once it's done
+	while (running && (send_addr == nullptr || state.pending_sends > 0)) {
+		if (loop.wait(handle_event, state.expire()) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			break;
+		}
+		//Every NS1 that came up while handling those, in one go
+		if (state.flush_kdc() < 0) {
+			break;
+		}
 	}
-	printf("Established connection, NS5 f(nonce2) match!\n");
 
-	//Encrypted communication happens here???
-	return 0;
+	return state.failed_sends > 0 || state.pending_sends > 0 ? EXIT_FAILURE : 0;
 }
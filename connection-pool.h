@@ -0,0 +1,121 @@
+//
+// Created by Glenn Smith on 10/11/18.
+//
+
+#ifndef CRYPTO2_CONNECTION_POOL_H
+#define CRYPTO2_CONNECTION_POOL_H
+
+#include <list>
+#include <stdint.h>
+#include <unordered_map>
+#include "charStream.h"
+
+/**
+ * Connections to other clients that are open but not doing anything, by who's on the other end,
+ * so the next handshake with them can skip setting up a new one. Only keeps so many, closing the
+ * least recently used first, and none of them for longer than the idle timeout. Only tracks
+ * connections by whatever handle the owner gives it; closing them is up to the owner.
+ */
+class connection_pool {
+	struct entry {
+		U64 peer;
+		size_t connection;
+		U64 idle_since;
+	};
+
+	size_t mCapacity;
+	U64 mIdleTimeout;
+	//Most recently parked first, so the back is both the least recently used and the longest idle
+	std::list<entry> mIdle;
+	std::unordered_multimap<U64, std::list<entry>::iterator> mByPeer;
+	std::unordered_map<size_t, std::list<entry>::iterator> mByConnection;
+
+	void erase(std::list<entry>::iterator it) {
+		auto range = mByPeer.equal_range(it->peer);
+		for (auto peer = range.first; peer != range.second; ++ peer) {
+			if (peer->second == it) {
+				mByPeer.erase(peer);
+				break;
+			}
+		}
+		mByConnection.erase(it->connection);
+		mIdle.erase(it);
+	}
+
+public:
+	/**
+	 * idleTimeout is in ms
+	 */
+	connection_pool(size_t capacity, U64 idleTimeout) : mCapacity(capacity), mIdleTimeout(idleTimeout) {}
+
+	size_t size() const {
+		return mIdle.size();
+	}
+
+	/**
+	 * Park an idle connection. If that's one too many, the least recently used one comes back out
+	 * through evicted (and this returns true) for closing.
+	 */
+	bool put(U64 peer, size_t connection, U64 now, size_t &evicted) {
+		mIdle.push_front(entry{peer, connection, now});
+		mByPeer.emplace(peer, mIdle.begin());
+		mByConnection[connection] = mIdle.begin();
+
+		if (mIdle.size() > mCapacity) {
+			evicted = mIdle.back().connection;
+			erase(std::prev(mIdle.end()));
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * Take an idle connection to peer out of the pool for using, if there is one
+	 */
+	bool take(U64 peer, size_t &connection) {
+		auto found = mByPeer.find(peer);
+		if (found == mByPeer.end()) {
+			return false;
+		}
+		connection = found->second->connection;
+		erase(found->second);
+		return true;
+	}
+
+	/**
+	 * Forget a connection, eg. because the other side closed it. Returns false if it wasn't here.
+	 */
+	bool remove(size_t connection) {
+		auto found = mByConnection.find(connection);
+		if (found == mByConnection.end()) {
+			return false;
+		}
+		erase(found->second);
+		return true;
+	}
+
+	/**
+	 * Take out one connection that's been idle too long, if there is one
+	 */
+	bool expire(U64 now, size_t &connection) {
+		if (mIdle.empty() || now < mIdle.back().idle_since + mIdleTimeout) {
+			return false;
+		}
+		connection = mIdle.back().connection;
+		erase(std::prev(mIdle.end()));
+		return true;
+	}
+
+	/**
+	 * How long (ms) until the next connection times out, or -1 if there aren't any
+	 */
+	int next_expiry(U64 now) const {
+		if (mIdle.empty()) {
+			return -1;
+		}
+		U64 deadline = mIdle.back().idle_since + mIdleTimeout;
+		return deadline > now ? static_cast<int>(deadline - now) : 0;
+	}
+};
+
+#endif //CRYPTO2_CONNECTION_POOL_H
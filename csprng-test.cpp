@@ -0,0 +1,117 @@
+//
+// Created by Glenn Smith on 10/11/18.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "csprng.h"
+
+/**
+ * Known answers for the ChaCha20 block function the random generator runs on (csprng.h), from RFC
+ * 8439: the block function example (2.3.2), the encryption example (2.4.2) with its keystream
+ * made a block at a time, and the first two all-zero test vectors (A.1), which are what the
+ * generator's all-zero nonce goes through.
+ */
+
+size_t mismatches = 0;
+
+//Counts it if the output isn't what the RFC says it should be
+void check(const char *name, const uint8_t *output, const uint8_t *expected, size_t length) {
+	for (size_t i = 0; i < length; i ++) {
+		if (output[i] != expected[i]) {
+			fprintf(stderr, "%s: byte %zu gave %02x, expected %02x\n", name, i, output[i], expected[i]);
+			mismatches ++;
+			return;
+		}
+	}
+}
+
+//Keys and nonces are given as bytes, which go into the state as little endian words
+template<size_t words>
+void load_words(const uint8_t *bytes, uint32_t (&out)[words]) {
+	for (size_t i = 0; i < words; i ++) {
+		out[i] = static_cast<uint32_t>(bytes[i * 4]) | static_cast<uint32_t>(bytes[i * 4 + 1]) << 8 |
+		         static_cast<uint32_t>(bytes[i * 4 + 2]) << 16 | static_cast<uint32_t>(bytes[i * 4 + 3]) << 24;
+	}
+}
+
+int main() {
+	uint8_t key_bytes[32];
+	for (size_t i = 0; i < 32; i ++) {
+		key_bytes[i] = static_cast<uint8_t>(i);
+	}
+	uint32_t key[8];
+	load_words(key_bytes, key);
+
+	//2.3.2
+	{
+		const uint8_t nonce_bytes[12] = {0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x4a, 0x00, 0x00, 0x00, 0x00};
+		const uint8_t expected[64] = {
+			0x10, 0xf1, 0xe7, 0xe4, 0xd1, 0x3b, 0x59, 0x15, 0x50, 0x0f, 0xdd, 0x1f, 0xa3, 0x20, 0x71, 0xc4,
+			0xc7, 0xd1, 0xf4, 0xc7, 0x33, 0xc0, 0x68, 0x03, 0x04, 0x22, 0xaa, 0x9a, 0xc3, 0xd4, 0x6c, 0x4e,
+			0xd2, 0x82, 0x64, 0x46, 0x07, 0x9f, 0xaa, 0x09, 0x14, 0xc2, 0xd7, 0x05, 0xd9, 0x8b, 0x02, 0xa2,
+			0xb5, 0x12, 0x9c, 0xd1, 0xde, 0x16, 0x4e, 0xb9, 0xcb, 0xd0, 0x83, 0xe8, 0xa2, 0x50, 0x3c, 0x4e,
+		};
+		uint32_t nonce[3];
+		load_words(nonce_bytes, nonce);
+		uint8_t output[64];
+		chacha_random::block(key, 1, nonce, output);
+		check("2.3.2 block function", output, expected, 64);
+	}
+
+	//2.4.2, keystream starts at block 1
+	{
+		const uint8_t nonce_bytes[12] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x4a, 0x00, 0x00, 0x00, 0x00};
+		const char plaintext[] = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for "
+		                         "the future, sunscreen would be it.";
+		const uint8_t expected[114] = {
+			0x6e, 0x2e, 0x35, 0x9a, 0x25, 0x68, 0xf9, 0x80, 0x41, 0xba, 0x07, 0x28, 0xdd, 0x0d, 0x69, 0x81,
+			0xe9, 0x7e, 0x7a, 0xec, 0x1d, 0x43, 0x60, 0xc2, 0x0a, 0x27, 0xaf, 0xcc, 0xfd, 0x9f, 0xae, 0x0b,
+			0xf9, 0x1b, 0x65, 0xc5, 0x52, 0x47, 0x33, 0xab, 0x8f, 0x59, 0x3d, 0xab, 0xcd, 0x62, 0xb3, 0x57,
+			0x16, 0x39, 0xd6, 0x24, 0xe6, 0x51, 0x52, 0xab, 0x8f, 0x53, 0x0c, 0x35, 0x9f, 0x08, 0x61, 0xd8,
+			0x07, 0xca, 0x0d, 0xbf, 0x50, 0x0d, 0x6a, 0x61, 0x56, 0xa3, 0x8e, 0x08, 0x8a, 0x22, 0xb6, 0x5e,
+			0x52, 0xbc, 0x51, 0x4d, 0x16, 0xcc, 0xf8, 0x06, 0x81, 0x8c, 0xe9, 0x1a, 0xb7, 0x79, 0x37, 0x36,
+			0x5a, 0xf9, 0x0b, 0xbf, 0x74, 0xa3, 0x5b, 0xe6, 0xb4, 0x0b, 0x8e, 0xed, 0xf2, 0x78, 0x5e, 0x42,
+			0x87, 0x4d,
+		};
+		uint32_t nonce[3];
+		load_words(nonce_bytes, nonce);
+		uint8_t output[114];
+		for (size_t offset = 0; offset < sizeof(output); offset += 64) {
+			uint8_t keystream[64];
+			chacha_random::block(key, static_cast<uint32_t>(1 + offset / 64), nonce, keystream);
+			for (size_t i = offset; i < sizeof(output) && i < offset + 64; i ++) {
+				output[i] = static_cast<uint8_t>(plaintext[i]) ^ keystream[i - offset];
+			}
+		}
+		check("2.4.2 encryption", output, expected, sizeof(output));
+	}
+
+	//A.1 #1 and #2: all-zero key and nonce, blocks 0 and 1
+	{
+		const uint32_t zero_key[8] = {};
+		const uint32_t zero_nonce[3] = {};
+		const uint8_t expected[2][64] = {
+			{
+				0x76, 0xb8, 0xe0, 0xad, 0xa0, 0xf1, 0x3d, 0x90, 0x40, 0x5d, 0x6a, 0xe5, 0x53, 0x86, 0xbd, 0x28,
+				0xbd, 0xd2, 0x19, 0xb8, 0xa0, 0x8d, 0xed, 0x1a, 0xa8, 0x36, 0xef, 0xcc, 0x8b, 0x77, 0x0d, 0xc7,
+				0xda, 0x41, 0x59, 0x7c, 0x51, 0x57, 0x48, 0x8d, 0x77, 0x24, 0xe0, 0x3f, 0xb8, 0xd8, 0x4a, 0x37,
+				0x6a, 0x43, 0xb8, 0xf4, 0x15, 0x18, 0xa1, 0x1c, 0xc3, 0x87, 0xb6, 0x69, 0xb2, 0xee, 0x65, 0x86,
+			}, {
+				0x9f, 0x07, 0xe7, 0xbe, 0x55, 0x51, 0x38, 0x7a, 0x98, 0xba, 0x97, 0x7c, 0x73, 0x2d, 0x08, 0x0d,
+				0xcb, 0x0f, 0x29, 0xa0, 0x48, 0xe3, 0x65, 0x69, 0x12, 0xc6, 0x53, 0x3e, 0x32, 0xee, 0x7a, 0xed,
+				0x29, 0xb7, 0x21, 0x76, 0x9c, 0xe6, 0x4e, 0x43, 0xd5, 0x71, 0x33, 0xb0, 0x74, 0xd8, 0x39, 0xd5,
+				0x31, 0xed, 0x1f, 0x28, 0x51, 0x0a, 0xfb, 0x45, 0xac, 0xe1, 0x0a, 0x1f, 0x4b, 0x79, 0x4d, 0x6f,
+			},
+		};
+		uint8_t output[64];
+		chacha_random::block(zero_key, 0, zero_nonce, output);
+		check("A.1 #1", output, expected[0], 64);
+		chacha_random::block(zero_key, 1, zero_nonce, output);
+		check("A.1 #2", output, expected[1], 64);
+	}
+
+	printf("Checked 4 RFC 8439 ChaCha20 vectors: %zu mismatches\n", mismatches);
+	return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,141 @@
+//
+// Created by Glenn Smith on 10/11/18.
+//
+
+#ifndef CRYPTO2_CSPRNG_H
+#define CRYPTO2_CSPRNG_H
+
+#include <random>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * ChaCha20 as a random number generator: the key is the state, and each refill runs the block
+ * function over a buffer's worth of counters, takes the first 32 bytes as the next key and hands
+ * out the rest. Since the old key is gone after every refill (and bytes are wiped as they're handed
+ * out), getting hold of the state later doesn't give away anything it already produced. Seeded
+ * from the OS once, and mixes in fresh OS randomness every so often after that. Not thread safe,
+ * use thread_random() to get one per thread.
+ */
+class chacha_random {
+	static const size_t block_size = 64;
+	static const size_t buffer_blocks = 16;
+	//Mix in new OS randomness after this many refills (about 1MB)
+	static const size_t reseed_interval = 1024;
+
+	uint32_t mKey[8];
+	uint8_t mBuffer[block_size * buffer_blocks];
+	//Everything in the buffer before this has been used
+	size_t mUsed;
+	size_t mRefills;
+
+	static uint32_t rotate(uint32_t value, int bits) {
+		return (value << bits) | (value >> (32 - bits));
+	}
+
+	static void quarter_round(uint32_t *x, int a, int b, int c, int d) {
+		x[a] += x[b]; x[d] = rotate(x[d] ^ x[a], 16);
+		x[c] += x[d]; x[b] = rotate(x[b] ^ x[c], 12);
+		x[a] += x[b]; x[d] = rotate(x[d] ^ x[a], 8);
+		x[c] += x[d]; x[b] = rotate(x[b] ^ x[c], 7);
+	}
+
+	void mix_os_randomness() {
+		std::random_device rd;
+		for (uint32_t &word : mKey) {
+			word ^= rd();
+		}
+	}
+
+	void refill() {
+		if (mRefills ++ % reseed_interval == 0) {
+			mix_os_randomness();
+		}
+
+		const uint32_t nonce[3] = {0, 0, 0};
+		for (uint32_t counter = 0; counter < buffer_blocks; counter ++) {
+			block(mKey, counter, nonce, mBuffer + counter * block_size);
+		}
+
+		//Next key comes off the front, and is never handed out
+		memcpy(mKey, mBuffer, sizeof(mKey));
+		memset(mBuffer, 0, sizeof(mKey));
+		mUsed = sizeof(mKey);
+	}
+
+public:
+	/**
+	 * The ChaCha20 block function (RFC 8439 2.3): 64 bytes of keystream for one key, block
+	 * counter and nonce. The generator always uses an all-zero nonce.
+	 */
+	static void block(const uint32_t (&key)[8], uint32_t counter, const uint32_t (&nonce)[3], uint8_t *out) {
+		//"expand 32-byte k", the key, then the counter and the nonce
+		uint32_t input[16] = {
+			0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+			key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+			counter, nonce[0], nonce[1], nonce[2]
+		};
+		uint32_t x[16];
+		memcpy(x, input, sizeof(x));
+		for (int i = 0; i < 10; i ++) {
+			quarter_round(x, 0, 4, 8, 12);
+			quarter_round(x, 1, 5, 9, 13);
+			quarter_round(x, 2, 6, 10, 14);
+			quarter_round(x, 3, 7, 11, 15);
+			quarter_round(x, 0, 5, 10, 15);
+			quarter_round(x, 1, 6, 11, 12);
+			quarter_round(x, 2, 7, 8, 13);
+			quarter_round(x, 3, 4, 9, 14);
+		}
+		for (int i = 0; i < 16; i ++) {
+			uint32_t word = x[i] + input[i];
+			out[i * 4 + 0] = static_cast<uint8_t>(word);
+			out[i * 4 + 1] = static_cast<uint8_t>(word >> 8);
+			out[i * 4 + 2] = static_cast<uint8_t>(word >> 16);
+			out[i * 4 + 3] = static_cast<uint8_t>(word >> 24);
+		}
+	}
+
+	chacha_random() : mKey{}, mUsed(sizeof(mBuffer)), mRefills(0) {}
+
+	chacha_random(const chacha_random &) = delete;
+	chacha_random &operator=(const chacha_random &) = delete;
+
+	/**
+	 * Fill out with length random bytes
+	 */
+	void fill(void *out, size_t length) {
+		uint8_t *bytes = static_cast<uint8_t *>(out);
+		while (length > 0) {
+			if (mUsed == sizeof(mBuffer)) {
+				refill();
+			}
+			size_t chunk = sizeof(mBuffer) - mUsed;
+			if (chunk > length) {
+				chunk = length;
+			}
+			memcpy(bytes, mBuffer + mUsed, chunk);
+			memset(mBuffer + mUsed, 0, chunk);
+			mUsed += chunk;
+			bytes += chunk;
+			length -= chunk;
+		}
+	}
+
+	uint64_t next_u64() {
+		uint64_t value;
+		fill(&value, sizeof(value));
+		return value;
+	}
+};
+
+/**
+ * This thread's generator, seeded the first time the thread asks for it
+ */
+chacha_random &thread_random() {
+	thread_local chacha_random generator;
+	return generator;
+}
+
+#endif //CRYPTO2_CSPRNG_H
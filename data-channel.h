@@ -0,0 +1,1087 @@
+//
+// Created by Glenn Smith on 10/11/18.
+//
+
+#ifndef CRYPTO2_DATA_CHANNEL_H
+#define CRYPTO2_DATA_CHANNEL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <poll.h>
+#include <set>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "charStream.h"
+#include "cipher-modes.h"
+#include "net.h"
+
+//Messages on a connection once its handshake is done, after NS1-NS5. Nothing in them is
+// authenticated, same as the rest of the protocol, they're only kept secret.
+//<6><64-bit iv><64-bit length><64-bit nonce>: a stream is starting, in CTR mode from this iv under
+// the session key. The length is DATA_UNKNOWN_LENGTH if the sender can't tell (eg. it's reading a
+// pipe). The nonce is for the stream's first rekey.
+#define DATA_OPEN 6
+//<7><encrypted bytes>: the next piece of it
+#define DATA_CHUNK 7
+//<8><64-bit total length>: that's all of it
+#define DATA_CLOSE 8
+//<9><64-bit total length>: (the other way) got all of it
+#define DATA_ACK 9
+//<10><64-bit nonce><encrypted bytes>: the next piece of it, but switching keys. This piece and
+// everything after it are under next_session_key() of the last key and the last nonce announced
+// (in the DATA_OPEN or the last DATA_REKEY), in CTR mode from that nonce. This nonce is for the
+// rekey after, so both ends always know the next key well before they need it.
+#define DATA_REKEY 10
+
+//Most that goes in one DATA_CHUNK, and how many of them each end has on their way through at once
+#define DATA_CHUNK_SIZE (256 * 1024)
+#define DATA_CHUNKS 8
+
+//Frame header, message number and a DATA_REKEY's nonce, in front of each chunk's data. Frames
+// without a nonce start that much further in.
+#define DATA_NONCE_SIZE 8
+#define DATA_HEADER_SIZE (FRAME_HEADER_SIZE + 1 + DATA_NONCE_SIZE)
+
+#define DATA_UNKNOWN_LENGTH UINT64_MAX
+
+/**
+ * Blocking queue between two stages of a pipeline. Once it's closed, pop() hands out whatever's
+ * left and then says there's nothing more.
+ */
+template<typename T>
+class work_queue {
+	std::deque<T> mItems;
+	std::mutex mMutex;
+	std::condition_variable mReady;
+	bool mClosed;
+
+public:
+	work_queue() : mClosed(false) {}
+
+	void push(T item) {
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mItems.push_back(std::move(item));
+		}
+		mReady.notify_one();
+	}
+
+	/**
+	 * Wait for the next item. Returns false once it's closed and empty.
+	 */
+	bool pop(T &item) {
+		std::unique_lock<std::mutex> lock(mMutex);
+		mReady.wait(lock, [this]() {
+			return mClosed || !mItems.empty();
+		});
+		if (mItems.empty()) {
+			return false;
+		}
+		item = std::move(mItems.front());
+		mItems.pop_front();
+		return true;
+	}
+
+	/**
+	 * Next item if there is one right now, without waiting
+	 */
+	bool try_pop(T &item) {
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (mItems.empty()) {
+			return false;
+		}
+		item = std::move(mItems.front());
+		mItems.pop_front();
+		return true;
+	}
+
+	void close() {
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mClosed = true;
+		}
+		mReady.notify_all();
+	}
+};
+
+/**
+ * One piece of a stream on its way through a pipeline. Queues pass around indices into a fixed
+ * set of these, so nothing gets allocated or copied between stages.
+ */
+struct data_chunk {
+	//Room for a frame header in front of the data, so a whole frame can go out in one send()
+	std::vector<U8> bytes;
+	//Bytes of data after the header
+	size_t length;
+	//End of the stream rather than more data
+	bool last;
+	//Switches to the next key before its data, announcing nonce for the rekey after
+	bool rekey;
+	U64 nonce;
+	//Sender: where the frame starts in bytes, since only a DATA_REKEY needs the whole header
+	size_t start;
+	//Sender: some of it went out with MSG_ZEROCOPY, so it can't be touched until the kernel says
+	// it's done with zerocopy_id
+	bool pinned;
+	U32 zerocopy_id;
+};
+
+/**
+ * A window onto part of a file mapped into memory, moved along as a stream works its way through
+ * the file, so only a window's worth is ever mapped however big the file is
+ */
+class file_window {
+	int mFd;
+	bool mWritable;
+	U8 *mMap;
+	U64 mStart;
+	size_t mLength;
+
+	static const size_t window_size = 8 * 1024 * 1024;
+
+	void unmap() {
+		if (mMap != nullptr) {
+			munmap(mMap, mLength);
+			mMap = nullptr;
+		}
+	}
+
+public:
+	file_window(int fd, bool writable) : mFd(fd), mWritable(writable), mMap(nullptr), mStart(0), mLength(0) {}
+
+	~file_window() {
+		unmap();
+	}
+
+	file_window(const file_window &) = delete;
+	file_window &operator=(const file_window &) = delete;
+
+	/**
+	 * Get at length bytes from offset in the file, which can't go past end, mapping a new window
+	 * if they aren't in this one. Returns nullptr if it can't be mapped.
+	 */
+	U8 *at(U64 offset, size_t length, U64 end) {
+		if (mMap == nullptr || offset < mStart || offset + length > mStart + mLength) {
+			unmap();
+			U64 page = static_cast<U64>(sysconf(_SC_PAGESIZE));
+			mStart = offset / page * page;
+			mLength = window_size;
+			if (offset + length - mStart > mLength) {
+				mLength = offset + length - mStart;
+			}
+			if (mStart + mLength > end) {
+				mLength = end - mStart;
+			}
+			void *map = mmap(nullptr, mLength, mWritable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, mFd,
+			                 static_cast<off_t>(mStart));
+			if (map == MAP_FAILED) {
+				perror("mmap");
+				return nullptr;
+			}
+			mMap = static_cast<U8 *>(map);
+			madvise(mMap, mLength, MADV_SEQUENTIAL);
+		}
+		return mMap + (offset - mStart);
+	}
+};
+
+/**
+ * When a stream switches keys: after this many bytes or ms under one key, whichever comes first.
+ * 0 means no limit, so both 0 never rekeys.
+ */
+struct rekey_policy {
+	U64 bytes;
+	U64 ms;
+};
+
+/**
+ * The key a stream switches to from key at a rekey: the nonce encrypted under key, made into a
+ * key the same way a Diffie-Hellman secret would be. Both ends can work it out from the nonce on
+ * the wire and the key they already share, so rekeying needs no round trip to the KDC.
+ */
+cipher_key next_session_key(const cipher_key &key, U64 nonce) {
+	//8 bytes is a whole number of blocks for either cipher
+	U64 block = wireOrder<U64>(nonce);
+	session_cipher::encrypt(reinterpret_cast<U8 *>(&block), sizeof(block), key);
+	return session_cipher::key_from_secret(wireOrder<U64>(block));
+}
+
+/**
+ * The keys a stream goes through. The next one's cipher (codebook and pad, for the toy DES) is set
+ * up on a thread of its own while the current one is in use, so switching over at a rekey is just
+ * swapping it in. Only the thread doing the encrypting (or decrypting) should use one.
+ */
+class stream_keys {
+	cipher_key mKey;
+	std::unique_ptr<session_ctr> mCipher;
+	thread_pool *mPool;
+
+	cipher_key mNextKey;
+	std::unique_ptr<session_ctr> mNextCipher;
+	std::atomic<bool> mNextReady;
+	std::thread mPreparer;
+
+	void prepare(U64 nonce) {
+		mNextKey = next_session_key(mKey, nonce);
+		mNextReady = false;
+		mPreparer = std::thread([this, nonce]() {
+			mNextCipher.reset(new session_ctr(mNextKey, nonce, mPool));
+			mNextReady = true;
+		});
+	}
+
+public:
+	/**
+	 * Starts under key from iv, and gets going on the key for nonce, the first rekey's
+	 */
+	stream_keys(const cipher_key &key, U64 iv, U64 nonce, thread_pool *pool) : mKey(key),
+		mCipher(new session_ctr(key, iv, pool)), mPool(pool), mNextReady(false) {
+		prepare(nonce);
+	}
+
+	~stream_keys() {
+		mPreparer.join();
+	}
+
+	stream_keys(const stream_keys &) = delete;
+	stream_keys &operator=(const stream_keys &) = delete;
+
+	session_ctr &cipher() {
+		return *mCipher;
+	}
+
+	/**
+	 * If the next key could be switched to without waiting
+	 */
+	bool next_ready() const {
+		return mNextReady;
+	}
+
+	/**
+	 * Switch to the next key (waiting for it if it's not ready yet), and get going on the one after
+	 * that, for nonce
+	 */
+	void advance(U64 nonce) {
+		mPreparer.join();
+		mKey = mNextKey;
+		mCipher = std::move(mNextCipher);
+		prepare(nonce);
+	}
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * Write all of a buffer, however many goes it takes. Returns < 0 on error (with errno set).
+ */
+int write_all(int fd, const U8 *data, size_t length) {
+	while (length > 0) {
+		ssize_t nwrite = write(fd, data, length);
+		if (nwrite < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		data += nwrite;
+		length -= nwrite;
+	}
+	return 0;
+}
+
+/**
+ * Streams everything from a file descriptor to the other end of a connection, encrypted with the
+ * session key. The stages run at the same time so none of them waits on the others: a thread
+ * reading the input, a thread encrypting what's been read, and the event loop sending what's been
+ * encrypted straight out of the chunk it was encrypted in. The same few chunks go round and round,
+ * so if the network can't keep up, reading waits instead of memory piling up.
+ *
+ * Regular files skip the reading: they're mapped a window at a time and encrypted straight out of
+ * the mapping into the chunks. Where the kernel supports it, chunks go out with MSG_ZEROCOPY, so
+ * the only copy of the data after it's been read off disk is the encryption's, and a chunk goes
+ * back round once the kernel says it's done with it.
+ *
+ * Long streams switch keys as they go, per the rekey_policy: the encryptor marks the first chunk
+ * under the new key as a DATA_REKEY, so the switch is exactly at a frame and nothing stops for it.
+ */
+class data_sender {
+	int mInput;
+	U64 mIv;
+	U64 mNonce;
+	//Mapping regular files rather than reading them, from where the input was up to
+	bool mMapped;
+	U64 mStartOffset;
+	U64 mLength;
+
+	//Only touched by the encryptor
+	stream_keys mKeys;
+	rekey_policy mRekey;
+	U64 mKeyBytes;
+	std::chrono::steady_clock::time_point mKeyStart;
+	std::atomic<U64> mRekeys;
+
+	std::vector<data_chunk> mChunks;
+	work_queue<size_t> mFree;
+	work_queue<size_t> mRead;
+	work_queue<size_t> mEncrypted;
+	//Tells the event loop there's something encrypted to send
+	int mNotify;
+	//Tells the reader to give up waiting on the input
+	int mStop;
+
+	//Only touched by the reader (or for mapped files, the encryptor) until it's queued the end
+	U64 mTotal;
+	std::atomic<bool> mFailed;
+
+	//The chunk going out right now (only the event loop touches these)
+	bool mSending;
+	size_t mCurrent;
+	size_t mOffset;
+	//Bytes that have gone out on the socket, and whether that's the whole stream
+	U64 mSent;
+	bool mDone;
+
+	//MSG_ZEROCOPY: the kernel numbers every send() that uses it, and says which ones it's done
+	// with on the socket's error queue. Every id below mZeroCopyDone is done, plus any in mZeroCopyAhead.
+	bool mZeroCopy;
+	U32 mZeroCopyNext;
+	U32 mZeroCopyDone;
+	std::set<U32> mZeroCopyAhead;
+	//Chunks that have gone out but are waiting on the kernel, oldest (lowest id) first
+	std::deque<size_t> mPinned;
+	//Not worth the bookkeeping for sends smaller than this
+	static const size_t zerocopy_threshold = 16 * 1024;
+
+	std::chrono::steady_clock::time_point mStart;
+	std::thread mReader;
+	std::thread mEncryptor;
+
+	/**
+	 * Read whatever the input has, up to a chunk's worth. Waits along with mStop so a pipe that
+	 * never says anything can't hold up shutting down. Returns what read() did, or -2 if stopped.
+	 */
+	ssize_t read_some(data_chunk &chunk) {
+		while (true) {
+			pollfd fds[2] = {{mInput, POLLIN, 0}, {mStop, POLLIN, 0}};
+			if (poll(fds, 2, -1) < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return -1;
+			}
+			if (fds[1].revents != 0) {
+				return -2;
+			}
+			ssize_t nread = read(mInput, chunk.bytes.data() + DATA_HEADER_SIZE, DATA_CHUNK_SIZE);
+			if (nread < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+				continue;
+			}
+			return nread;
+		}
+	}
+
+	void read_input() {
+		size_t index;
+		while (mFree.pop(index)) {
+			data_chunk &chunk = mChunks[index];
+			ssize_t nread = read_some(chunk);
+			if (nread == -2) {
+				return;
+			}
+			if (nread > 0) {
+				chunk.length = static_cast<size_t>(nread);
+				chunk.last = false;
+				mTotal += chunk.length;
+				mRead.push(index);
+				continue;
+			}
+			if (nread < 0) {
+				perror("read");
+				mFailed = true;
+			}
+			chunk.length = 0;
+			chunk.last = true;
+			mRead.push(index);
+			return;
+		}
+	}
+
+	bool rekey_due() const {
+		return (mRekey.bytes > 0 && mKeyBytes >= mRekey.bytes)
+		    || (mRekey.ms > 0 && seconds_since(mKeyStart) * 1000 >= mRekey.ms);
+	}
+
+	/**
+	 * Encrypt a chunk's worth of data into it, switching keys first if it's time to. If the next
+	 * key isn't ready yet it stays on this one and tries again next chunk, rather than waiting.
+	 */
+	void encrypt(const U8 *source, data_chunk &chunk) {
+		chunk.rekey = rekey_due() && mKeys.next_ready();
+		if (chunk.rekey) {
+			chunk.nonce = rand_u64();
+			mKeys.advance(chunk.nonce);
+			mKeyBytes = 0;
+			mKeyStart = std::chrono::steady_clock::now();
+			mRekeys ++;
+		}
+		mKeys.cipher().update(source, chunk.bytes.data() + DATA_HEADER_SIZE, chunk.length);
+		mKeyBytes += chunk.length;
+	}
+
+	/**
+	 * Put the frame header on an encrypted chunk (or fill in the end of the stream) and hand it
+	 * to the event loop
+	 */
+	void seal(size_t index) {
+		data_chunk &chunk = mChunks[index];
+		U8 cmd = chunk.rekey ? DATA_REKEY : DATA_CHUNK;
+		if (chunk.last) {
+			cmd = DATA_CLOSE;
+			chunk.rekey = false;
+			U64 total = wireOrder<U64>(mTotal);
+			memcpy(chunk.bytes.data() + DATA_HEADER_SIZE, &total, sizeof(total));
+			chunk.length = sizeof(total);
+		}
+		chunk.start = 0;
+		if (chunk.rekey) {
+			U64 nonce = wireOrder<U64>(chunk.nonce);
+			memcpy(chunk.bytes.data() + FRAME_HEADER_SIZE + 1, &nonce, sizeof(nonce));
+		} else {
+			chunk.start = DATA_NONCE_SIZE;
+		}
+		U8 *frame = chunk.bytes.data() + chunk.start;
+		U32 length = wireOrder<U32>(static_cast<U32>(DATA_HEADER_SIZE - chunk.start - FRAME_HEADER_SIZE + chunk.length));
+		memcpy(frame, &length, sizeof(length));
+		frame[FRAME_HEADER_SIZE] = cmd;
+
+		mEncrypted.push(index);
+		U64 one = 1;
+		if (write(mNotify, &one, sizeof(one)) < 0) {
+			perror("eventfd");
+		}
+	}
+
+	void encrypt_chunks() {
+		size_t index;
+		while (mRead.pop(index)) {
+			data_chunk &chunk = mChunks[index];
+			bool last = chunk.last;
+			if (!last) {
+				encrypt(chunk.bytes.data() + DATA_HEADER_SIZE, chunk);
+			}
+			seal(index);
+			if (last) {
+				return;
+			}
+		}
+	}
+
+	/**
+	 * Reading and encrypting in one go for a mapped file, since there's no read() to wait on
+	 */
+	void encrypt_mapped() {
+		file_window window(mInput, false);
+		size_t index;
+		while (mFree.pop(index)) {
+			data_chunk &chunk = mChunks[index];
+			U64 offset = mStartOffset + mTotal;
+			size_t length = mLength - mTotal < DATA_CHUNK_SIZE ? static_cast<size_t>(mLength - mTotal) : DATA_CHUNK_SIZE;
+			const U8 *source = length > 0 ? window.at(offset, length, mStartOffset + mLength) : nullptr;
+			if (source == nullptr) {
+				mFailed = length > 0;
+				chunk.length = 0;
+				chunk.last = true;
+				seal(index);
+				return;
+			}
+			chunk.length = length;
+			chunk.last = false;
+			encrypt(source, chunk);
+			mTotal += length;
+			seal(index);
+		}
+	}
+
+	bool zerocopy_done(U32 id) const {
+		return static_cast<int32_t>(id - mZeroCopyDone) < 0;
+	}
+
+	/**
+	 * Pick up whatever the kernel has said it's done with, and put the chunks it was holding on to
+	 * back in the pipeline
+	 */
+	void reap_zerocopy(int sock) {
+		while (true) {
+			char control[256];
+			msghdr msg{};
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			if (recvmsg(sock, &msg, MSG_ERRQUEUE) < 0) {
+				break;
+			}
+			for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+				if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+				    && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+					continue;
+				}
+				sock_extended_err err;
+				memcpy(&err, CMSG_DATA(cm), sizeof(err));
+				if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+					continue;
+				}
+				//It had to copy anyway (eg. over loopback), so all this is doing is costing us
+				if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+					mZeroCopy = false;
+				}
+				//Ids from ee_info to ee_data are done, and they nearly always come in order
+				if (err.ee_info == mZeroCopyDone) {
+					mZeroCopyDone = err.ee_data + 1;
+				} else {
+					for (U32 id = err.ee_info; id != err.ee_data + 1; id ++) {
+						mZeroCopyAhead.insert(id);
+					}
+				}
+			}
+		}
+		while (!mZeroCopyAhead.empty() && mZeroCopyAhead.erase(mZeroCopyDone) > 0) {
+			mZeroCopyDone ++;
+		}
+		while (!mPinned.empty() && zerocopy_done(mChunks[mPinned.front()].zerocopy_id)) {
+			mChunks[mPinned.front()].pinned = false;
+			mFree.push(mPinned.front());
+			mPinned.pop_front();
+		}
+	}
+
+public:
+	/**
+	 * Takes over input (and closes it once it's done). The cipher can split chunks over pool.
+	 */
+	data_sender(int input, const cipher_key &key, const rekey_policy &rekey, thread_pool *pool = nullptr) :
+		mInput(input), mIv(rand_u64()), mNonce(rand_u64()), mMapped(false), mStartOffset(0),
+		mLength(DATA_UNKNOWN_LENGTH), mKeys(key, mIv, mNonce, pool), mRekey(rekey), mKeyBytes(0),
+		mKeyStart(std::chrono::steady_clock::now()), mRekeys(0), mChunks(DATA_CHUNKS),
+		mNotify(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), mStop(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), mTotal(0),
+		mFailed(false), mSending(false), mCurrent(0), mOffset(0), mSent(0), mDone(false), mZeroCopy(false),
+		mZeroCopyNext(0), mZeroCopyDone(0), mStart(std::chrono::steady_clock::now()) {
+		struct stat info{};
+		off_t position = lseek(mInput, 0, SEEK_CUR);
+		if (fstat(mInput, &info) == 0 && S_ISREG(info.st_mode) && position >= 0 && info.st_size >= position) {
+			mMapped = true;
+			mStartOffset = static_cast<U64>(position);
+			mLength = static_cast<U64>(info.st_size - position);
+		}
+
+		for (size_t i = 0; i < mChunks.size(); i ++) {
+			mChunks[i].bytes.resize(DATA_HEADER_SIZE + DATA_CHUNK_SIZE);
+			mFree.push(i);
+		}
+		if (mMapped) {
+			mEncryptor = std::thread([this]() {
+				encrypt_mapped();
+			});
+		} else {
+			mReader = std::thread([this]() {
+				read_input();
+			});
+			mEncryptor = std::thread([this]() {
+				encrypt_chunks();
+			});
+		}
+	}
+
+	/**
+	 * Chunks the kernel may still be sending from (see pinned()) go with it, so if there are any,
+	 * the socket has to be aborted first.
+	 */
+	~data_sender() {
+		U64 one = 1;
+		if (write(mStop, &one, sizeof(one)) < 0) {
+			perror("eventfd");
+		}
+		mFree.close();
+		mRead.close();
+		mEncrypted.close();
+		if (mReader.joinable()) {
+			mReader.join();
+		}
+		mEncryptor.join();
+		close(mInput);
+		close(mNotify);
+		close(mStop);
+	}
+
+	data_sender(const data_sender &) = delete;
+	data_sender &operator=(const data_sender &) = delete;
+
+	/**
+	 * Where the stream's keystream starts, for the DATA_OPEN
+	 */
+	U64 iv() const {
+		return mIv;
+	}
+
+	/**
+	 * What the first rekey will use, for the DATA_OPEN
+	 */
+	U64 nonce() const {
+		return mNonce;
+	}
+
+	/**
+	 * How much there is to send, for the DATA_OPEN, or DATA_UNKNOWN_LENGTH if the input isn't a file
+	 */
+	U64 length() const {
+		return mLength;
+	}
+
+	/**
+	 * Readable whenever there's more to send, for the event loop to watch
+	 */
+	int notify_fd() const {
+		return mNotify;
+	}
+
+	/**
+	 * Send chunks over sock with MSG_ZEROCOPY if the kernel can. Completions come back on its error
+	 * queue, which makes the socket report an error event; pump() takes care of them. The kernel
+	 * numbers zerocopy sends for the life of the socket, so if earlier streams went over it this
+	 * needs where they left off (from zerocopy_ids()), otherwise 0 and 0.
+	 */
+	void use_zerocopy(int sock, U32 next, U32 done) {
+		mZeroCopyNext = next;
+		mZeroCopyDone = done;
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+		int value = 1;
+		mZeroCopy = setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &value, sizeof(value)) == 0;
+#endif
+	}
+
+	/**
+	 * Where the zerocopy count on sock is up to, for the next stream over it (see use_zerocopy()).
+	 * Reaps first, so whatever completions are waiting are off the error queue.
+	 */
+	void zerocopy_ids(int sock, U32 &next, U32 &done) {
+		reap_zerocopy(sock);
+		next = mZeroCopyNext;
+		done = mZeroCopyDone;
+	}
+
+	/**
+	 * Everything read from the input, once the stream's all out
+	 */
+	U64 bytes() const {
+		return mTotal;
+	}
+
+	/**
+	 * Everything that's gone out on the socket so far, frame headers included, to tell whether
+	 * pump() is getting anywhere
+	 */
+	U64 sent() const {
+		return mSent;
+	}
+
+	/**
+	 * Whether it's the other end holding things up: the socket won't take what's ready to go, the
+	 * kernel is holding on to chunks until they're acked, or it's all out and waiting for the
+	 * DATA_ACK. Otherwise it's waiting on the input.
+	 */
+	bool waiting_on_peer() const {
+		return mSending || !mPinned.empty() || mDone;
+	}
+
+	/**
+	 * Whether any chunk went out with MSG_ZEROCOPY and the kernel hasn't said it's done with it yet
+	 * (reaping what it has said first, see zerocopy_ids()). Those still belong to the socket: they
+	 * can be sent, or sent again, right up until it lets go of them.
+	 */
+	bool pinned() const {
+		for (const data_chunk &chunk : mChunks) {
+			if (chunk.pinned) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * How many times it's switched keys so far
+	 */
+	U64 rekeys() const {
+		return mRekeys;
+	}
+
+	double elapsed() const {
+		return seconds_since(mStart);
+	}
+
+	/**
+	 * Send whatever's been encrypted, as far as the socket will take it. Call this whenever the
+	 * socket is writable or notify_fd() is readable. Returns 1 once the whole stream is out (end
+	 * included), 0 if there's more to come, < 0 if the socket broke or the input couldn't be read.
+	 */
+	int pump(int sock) {
+		if (!mPinned.empty()) {
+			reap_zerocopy(sock);
+		}
+		while (true) {
+			if (!mSending) {
+				//Clear the notification before looking, so anything queued after this wakes us again
+				U64 count;
+				if (read(mNotify, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+					return -1;
+				}
+				if (!mEncrypted.try_pop(mCurrent)) {
+					return 0;
+				}
+				mSending = true;
+				mOffset = 0;
+			}
+
+			data_chunk &chunk = mChunks[mCurrent];
+			if (chunk.last && mFailed) {
+				return -1;
+			}
+			size_t size = DATA_HEADER_SIZE - chunk.start + chunk.length;
+			while (mOffset < size) {
+				int flags = MSG_NOSIGNAL;
+#ifdef MSG_ZEROCOPY
+				bool zerocopy = mZeroCopy && size - mOffset >= zerocopy_threshold;
+				if (zerocopy) {
+					flags |= MSG_ZEROCOPY;
+				}
+#else
+				bool zerocopy = false;
+#endif
+				ssize_t nsend = send(sock, chunk.bytes.data() + chunk.start + mOffset, size - mOffset, flags);
+				if (nsend < 0) {
+					if (errno == EINTR) {
+						continue;
+					}
+					if (errno == EAGAIN || errno == EWOULDBLOCK) {
+						return 0;
+					}
+					if (errno == ENOBUFS && zerocopy) {
+						//Over the limit on memory pinned for zerocopy, so this one gets copied
+						mZeroCopy = false;
+						continue;
+					}
+					return -1;
+				}
+				if (zerocopy) {
+					chunk.pinned = true;
+					chunk.zerocopy_id = mZeroCopyNext ++;
+				}
+				mOffset += nsend;
+				mSent += nsend;
+			}
+			mSending = false;
+			if (chunk.last) {
+				mDone = true;
+				return 1;
+			}
+			if (chunk.pinned) {
+				mPinned.push_back(mCurrent);
+			} else {
+				mFree.push(mCurrent);
+			}
+		}
+	}
+};
+
+/**
+ * The other end of a data_sender. The event loop hands over chunks as it reads them off the
+ * connection, and a thread decrypting them and another writing them out take it from there, so
+ * the next chunk is coming in off the network while the last ones are being decrypted and
+ * written. Output goes to a file descriptor, or nowhere if that's -1 (to just measure the link).
+ *
+ * If the output is a regular file and the sender said how long the stream is, the file is
+ * extended to fit it up front and the chunks are decrypted straight into a mapping of it, a
+ * window at a time, so there's no write() copy either.
+ *
+ * The decryptor switches keys at each DATA_REKEY, having already set up the key it switches to
+ * from the nonce the sender announced one rekey earlier.
+ *
+ * The event loop never waits on it: if the output has fallen so far behind that every chunk is
+ * queued up for it, ready() says so and the loop stops reading the connection until a chunk comes
+ * back round, which notify_fd() says.
+ */
+class data_receiver {
+	int mOutput;
+	//Decrypting into the output mapped from here, for mLength bytes
+	bool mMapped;
+	U64 mStartOffset;
+	U64 mLength;
+	//Set by the decryptor if a chunk couldn't go where it should
+	std::atomic<bool> mFailed;
+	//Only touched by the decryptor
+	stream_keys mKeys;
+	std::vector<data_chunk> mChunks;
+	work_queue<size_t> mFree;
+	work_queue<size_t> mReceived;
+	work_queue<size_t> mDecrypted;
+	//Tells the event loop the stream has been written out (or couldn't be), or that a chunk came
+	// back while it was waiting for one
+	int mNotify;
+	std::atomic<bool> mWaiting;
+
+	//Only touched by the event loop
+	U64 mBytes;
+	//Free chunk set aside by ready() for the next push() or finish(), or mChunks.size() if none
+	size_t mReserved;
+	//ready() last said no, so the connection isn't being read
+	bool mPaused;
+	bool mFinished;
+	//Set by the event loop before queueing the end of the stream
+	U64 mExpected;
+	//Only touched by the writer: how much of the stream has made it to the output
+	U64 mWritten;
+	//0 while going, 1 once it's all written and matches what they said they sent, -1 if not
+	std::atomic<int> mStatus;
+
+	std::chrono::steady_clock::time_point mStart;
+	std::thread mDecryptor;
+	std::thread mWriter;
+
+	void decrypt_chunks() {
+		file_window window(mOutput, true);
+		U64 offset = 0;
+		size_t index;
+		while (mReceived.pop(index)) {
+			data_chunk &chunk = mChunks[index];
+			bool last = chunk.last;
+			if (!last && chunk.rekey) {
+				mKeys.advance(chunk.nonce);
+			}
+			if (!last && mMapped) {
+				U8 *destination = nullptr;
+				if (offset + chunk.length <= mLength) {
+					destination = window.at(mStartOffset + offset, chunk.length, mStartOffset + mLength);
+				} else {
+					printf("Stream is longer than they said it would be\n");
+				}
+				if (destination != nullptr) {
+					mKeys.cipher().update(chunk.bytes.data(), destination, chunk.length);
+				} else {
+					mFailed = true;
+				}
+				offset += chunk.length;
+			} else if (!last) {
+				mKeys.cipher().update(chunk.bytes.data(), chunk.bytes.data(), chunk.length);
+			}
+			mDecrypted.push(index);
+			if (last) {
+				return;
+			}
+		}
+	}
+
+	void notify() {
+		U64 one = 1;
+		if (write(mNotify, &one, sizeof(one)) < 0) {
+			perror("eventfd");
+		}
+	}
+
+	void write_output() {
+		U64 written = 0;
+		bool failed = false;
+		size_t index;
+		while (mDecrypted.pop(index)) {
+			data_chunk &chunk = mChunks[index];
+			if (chunk.last) {
+				bool complete = written == mExpected && (!mMapped || written == mLength);
+				mStatus = !failed && !mFailed && complete ? 1 : -1;
+				notify();
+				return;
+			}
+			//Keep taking chunks after a failed write, or the event loop would be stuck waiting
+			// for them to come back
+			if (!failed && !mMapped && mOutput >= 0 && write_all(mOutput, chunk.bytes.data(), chunk.length) < 0) {
+				perror("write");
+				failed = true;
+			}
+			written += chunk.length;
+			mWritten = written;
+			mFree.push(index);
+			if (mWaiting.exchange(false)) {
+				notify();
+			}
+		}
+	}
+
+public:
+	/**
+	 * output isn't ours, it's left open (positioned after the stream). iv, length and nonce are
+	 * what the sender said in the DATA_OPEN. The file is only extended to the length up front if
+	 * there's room for it on the disk; otherwise it grows as the stream comes in.
+	 */
+	data_receiver(int output, const cipher_key &key, U64 iv, U64 length, U64 nonce, thread_pool *pool = nullptr) :
+		mOutput(output), mMapped(false), mStartOffset(0), mLength(0), mFailed(false), mKeys(key, iv, nonce, pool),
+		mChunks(DATA_CHUNKS),
+		mNotify(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), mWaiting(false), mBytes(0), mReserved(DATA_CHUNKS),
+		mPaused(false), mFinished(false), mExpected(0), mWritten(0), mStatus(0),
+		mStart(std::chrono::steady_clock::now()) {
+		struct stat info{};
+		struct statvfs disk{};
+		off_t position = output >= 0 ? lseek(output, 0, SEEK_CUR) : -1;
+		//Mapping it for writing needs it open for reading too. The length is only their word for
+		// it, so don't let it take more of the disk than there is.
+		if (length != DATA_UNKNOWN_LENGTH && length > 0 && position >= 0 && fstat(output, &info) == 0
+		    && S_ISREG(info.st_mode) && (fcntl(output, F_GETFL) & O_ACCMODE) == O_RDWR && fstatvfs(output, &disk) == 0
+		    && length <= static_cast<U64>(disk.f_bavail) * disk.f_frsize) {
+			//Actually reserve the space if the filesystem can, otherwise just make the file big enough
+			off_t end = position + static_cast<off_t>(length);
+			if (fallocate(output, 0, position, static_cast<off_t>(length)) == 0 || ftruncate(output, end) == 0) {
+				mMapped = true;
+				mStartOffset = static_cast<U64>(position);
+				mLength = length;
+				lseek(output, end, SEEK_SET);
+			}
+		}
+
+		for (size_t i = 0; i < mChunks.size(); i ++) {
+			mChunks[i].bytes.resize(DATA_CHUNK_SIZE);
+			mFree.push(i);
+		}
+		mDecryptor = std::thread([this]() {
+			decrypt_chunks();
+		});
+		mWriter = std::thread([this]() {
+			write_output();
+		});
+	}
+
+	~data_receiver() {
+		mFree.close();
+		mReceived.close();
+		mDecrypted.close();
+		mDecryptor.join();
+		mWriter.join();
+		close(mNotify);
+		//Didn't make it, so don't leave the file at the size they said it would be
+		if (mMapped && mStatus != 1) {
+			off_t end = static_cast<off_t>(mStartOffset + mWritten);
+			if (ftruncate(mOutput, end) < 0) {
+				perror("ftruncate");
+			}
+			lseek(mOutput, end, SEEK_SET);
+		}
+	}
+
+	data_receiver(const data_receiver &) = delete;
+	data_receiver &operator=(const data_receiver &) = delete;
+
+	/**
+	 * Readable once the stream's been written out, or there's a chunk free again after ready()
+	 * said there wasn't, for the event loop to watch
+	 */
+	int notify_fd() const {
+		return mNotify;
+	}
+
+	U64 bytes() const {
+		return mBytes;
+	}
+
+	double elapsed() const {
+		return seconds_since(mStart);
+	}
+
+	/**
+	 * Whether there's a chunk free for the next message, without waiting. If there isn't, stop
+	 * handing it messages until notify_fd() is readable.
+	 */
+	bool ready() {
+		if (mReserved == mChunks.size() && !mFree.try_pop(mReserved)) {
+			//Say we're waiting before looking again, so a chunk coming back in between can't be missed
+			mWaiting = true;
+			if (!mFree.try_pop(mReserved)) {
+				mReserved = mChunks.size();
+				mPaused = true;
+				return false;
+			}
+		}
+		mPaused = false;
+		return true;
+	}
+
+	/**
+	 * Whether it's the other end holding things up, rather than the output (or it's done)
+	 */
+	bool waiting_on_peer() const {
+		return !mPaused && !mFinished;
+	}
+
+	/**
+	 * The next DATA_CHUNK (or DATA_REKEY, with its nonce), straight off the wire. Only once ready()
+	 * says so. Returns false if it's more than a chunk, which no sender would send.
+	 */
+	bool push(const U8 *data, size_t length, bool rekey = false, U64 nonce = 0) {
+		if (length > DATA_CHUNK_SIZE || !ready()) {
+			return false;
+		}
+		size_t index = mReserved;
+		mReserved = mChunks.size();
+		data_chunk &chunk = mChunks[index];
+		memcpy(chunk.bytes.data(), data, length);
+		chunk.length = length;
+		chunk.last = false;
+		chunk.rekey = rekey;
+		chunk.nonce = nonce;
+		mBytes += length;
+		mReceived.push(index);
+		return true;
+	}
+
+	/**
+	 * The DATA_CLOSE: that's the whole stream, which they say was total bytes. Only once ready()
+	 * says so.
+	 */
+	bool finish(U64 total) {
+		if (!ready()) {
+			return false;
+		}
+		size_t index = mReserved;
+		mReserved = mChunks.size();
+		mFinished = true;
+		mExpected = total;
+		mChunks[index].length = 0;
+		mChunks[index].last = true;
+		mReceived.push(index);
+		return true;
+	}
+
+	/**
+	 * Call when notify_fd() is readable. Returns 1 once everything's been written out and it
+	 * adds up, < 0 if it doesn't or couldn't be written, 0 if it's not done yet.
+	 */
+	int status() {
+		U64 count;
+		if (read(mNotify, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+			return -1;
+		}
+		return mStatus;
+	}
+};
+
+#endif //CRYPTO2_DATA_CHANNEL_H
@@ -0,0 +1,87 @@
+//
+// Created by Glenn Smith on 10/11/18.
+//
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include "des.h"
+#include "des-reference.h"
+
+/**
+ * The toy DES's pieces as mask-and-shift networks (des.h) against the bitset versions they
+ * replaced (des-reference.h): ns per call of a permutation, F_fn, the key schedule and a whole
+ * one-byte encryption with its key schedule (what every byte cost before the codebooks).
+ * des_networks_test checks they agree.
+ *
+ * Usage: des_networks_bench
+ */
+
+//Keep going for at least this long (seconds) per measurement
+#define BENCH_MIN_SECONDS 0.25
+
+//Everything's results go in here so none of it gets optimized away
+volatile uint64_t sink;
+
+/**
+ * ns per call of run(i), with i counting up so the inputs change from call to call
+ */
+template<typename Run>
+double measure(Run run) {
+	auto start = std::chrono::steady_clock::now();
+	uint64_t total = 0;
+	uint64_t calls = 0;
+	double seconds = 0;
+	do {
+		//Only look at the clock every so often so it doesn't swamp what's being timed
+		for (uint64_t i = 0; i < 4096; i ++) {
+			total += run(calls + i);
+		}
+		calls += 4096;
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	} while (seconds < BENCH_MIN_SECONDS);
+	sink = total;
+	return seconds / calls * 1e9;
+}
+
+template<typename Bitset, typename Network>
+void row(const char *name, Bitset bitset, Network network) {
+	double bitset_ns = measure(bitset);
+	double network_ns = measure(network);
+	printf("%-24s %12.2f %12.2f %9.1fx\n", name, bitset_ns, network_ns, bitset_ns / network_ns);
+}
+
+int main() {
+	printf("%-24s %12s %12s %10s\n", "ns per call", "bitset", "network", "speedup");
+
+	row("P10", [](uint64_t i) {
+		return bitset_permute(std::bitset<10>(i), {{3, 5, 2, 7, 4, 10, 1, 9, 8, 6}}).to_ullong();
+	}, [](uint64_t i) {
+		return permute<P10>(i & 0x3FF);
+	});
+	row("IP", [](uint64_t i) {
+		return bitset_permute(std::bitset<8>(i), {{2, 6, 3, 1, 4, 8, 5, 7}}).to_ullong();
+	}, [](uint64_t i) {
+		return permute<initial_permutation>(i & 0xFF);
+	});
+	row("F_fn", [](uint64_t i) {
+		return bitset_F_fn(std::bitset<4>(i), std::bitset<8>(i >> 4)).to_ullong();
+	}, [](uint64_t i) {
+		return F_fn(i & 0xF, (i >> 4) & 0xFF);
+	});
+	row("generate_key", [](uint64_t i) {
+		std::bitset<8> K1, K2;
+		bitset_generate_key(std::bitset<10>(i), K1, K2);
+		return K1.to_ullong() ^ K2.to_ullong();
+	}, [](uint64_t i) {
+		uint64_t K1, K2;
+		generate_key(i & 0x3FF, K1, K2);
+		return K1 ^ K2;
+	});
+	row("des_encrypt (one byte)", [](uint64_t i) {
+		return bitset_des_encrypt(std::bitset<8>(i), std::bitset<10>(i >> 8)).to_ullong();
+	}, [](uint64_t i) {
+		return des_encrypt(std::bitset<8>(i), std::bitset<10>(i >> 8)).to_ullong();
+	});
+	return EXIT_SUCCESS;
+}
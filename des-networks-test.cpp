@@ -0,0 +1,87 @@
+//
+// Created by Glenn Smith on 10/11/18.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "des.h"
+#include "des-reference.h"
+
+/**
+ * Checks the mask-and-shift networks in des.h against the bitset toy DES they replaced
+ * (des-reference.h), over every input each piece can take: each permutation, split, combine and
+ * left_shift, F_fn for every input and subkey, the subkeys for every key, and then the whole
+ * cipher both ways for every key and byte.
+ */
+
+size_t mismatches = 0;
+
+//Counts it if the network and the reference disagree
+void check(const char *name, uint64_t input, uint64_t network, unsigned long long reference) {
+	if (network != reference) {
+		if (mismatches < 10) {
+			fprintf(stderr, "%s(%llu) gave %llu, expected %llu\n", name, static_cast<unsigned long long>(input),
+			        static_cast<unsigned long long>(network), reference);
+		}
+		mismatches ++;
+	}
+}
+
+/**
+ * Every input through one permutation both ways
+ */
+template<typename perm>
+void check_permutation(const char *name, const std::array<int, perm::output_size> &locations) {
+	for (uint64_t input = 0; input < (uint64_t(1) << perm::input_size); input ++) {
+		std::bitset<perm::input_size> bits(input);
+		check(name, input, permute<perm>(input), bitset_permute(bits, locations).to_ullong());
+	}
+}
+
+int main() {
+	//Same tables as the reference has inline
+	check_permutation<initial_permutation>("IP", {{2, 6, 3, 1, 4, 8, 5, 7}});
+	check_permutation<inverse_initial_permutation>("IP^-1", {{4, 1, 3, 5, 7, 2, 8, 6}});
+	check_permutation<F_expansion>("E/P", {{4, 1, 2, 3, 2, 3, 4, 1}});
+	check_permutation<P4>("P4", {{2, 4, 3, 1}});
+	check_permutation<P10>("P10", {{3, 5, 2, 7, 4, 10, 1, 9, 8, 6}});
+	check_permutation<P8>("P8", {{6, 3, 7, 4, 8, 5, 10, 9}});
+
+	for (uint64_t input = 0; input < 1024; input ++) {
+		uint64_t low, high;
+		split<10>(input, low, high);
+		std::bitset<5> bits_low, bits_high;
+		bitset_split(std::bitset<10>(input), bits_low, bits_high);
+		check("split low", input, low, bits_low.to_ullong());
+		check("split high", input, high, bits_high.to_ullong());
+		check("combine", input, combine<5>(low, high), bitset_combine(bits_low, bits_high).to_ullong());
+		check("left_shift", input, left_shift<5>(low), bitset_left_shift(bits_low).to_ullong());
+	}
+
+	for (uint64_t input = 0; input < 16; input ++) {
+		for (uint64_t key = 0; key < 256; key ++) {
+			check("F_fn", input << 8 | key, F_fn(input, key),
+			      bitset_F_fn(std::bitset<4>(input), std::bitset<8>(key)).to_ullong());
+		}
+	}
+
+	for (uint64_t key = 0; key < 1024; key ++) {
+		uint64_t K1, K2;
+		generate_key(key, K1, K2);
+		std::bitset<8> bits_K1, bits_K2;
+		bitset_generate_key(std::bitset<10>(key), bits_K1, bits_K2);
+		check("K1", key, K1, bits_K1.to_ullong());
+		check("K2", key, K2, bits_K2.to_ullong());
+
+		for (uint64_t byte = 0; byte < 256; byte ++) {
+			std::bitset<8> block(byte);
+			check("des_encrypt", key << 8 | byte, des_encrypt(block, std::bitset<10>(key)).to_ullong(),
+			      bitset_des_encrypt(block, std::bitset<10>(key)).to_ullong());
+			check("des_decrypt", key << 8 | byte, des_decrypt(block, std::bitset<10>(key)).to_ullong(),
+			      bitset_des_decrypt(block, std::bitset<10>(key)).to_ullong());
+		}
+	}
+
+	printf("Checked the networks against the bitset DES: %zu mismatches\n", mismatches);
+	return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,104 @@
+//
+// Created by Glenn Smith on 10/11/18.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "des.h"
+
+/**
+ * Checks every way of running the toy DES over a buffer against des_encrypt and des_decrypt, for
+ * every key and every byte: the codebook's plain lookup tables, each vector kernel the CPU has,
+ * and the dispatching buffer functions (with a length that leaves a tail for the lookups).
+ */
+
+struct kernel_case {
+	const char *name;
+	des_nibble_kernel kernel;
+};
+
+//Counts every byte of output that isn't what the reference says it should be
+size_t check(const char *name, unsigned key, const uint8_t *output, const uint8_t *expected, size_t length) {
+	size_t mismatches = 0;
+	for (size_t i = 0; i < length; i ++) {
+		if (output[i] != expected[i]) {
+			if (mismatches == 0) {
+				fprintf(stderr, "%s: key %u byte %zu gave %02x, expected %02x\n", name, key, i, output[i], expected[i]);
+			}
+			mismatches ++;
+		}
+	}
+	return mismatches;
+}
+
+int main() {
+	std::vector<kernel_case> kernels;
+#ifdef CRYPTO2_DES_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3")) {
+		kernels.push_back(kernel_case{"ssse3", des_nibble_transform_ssse3});
+	} else {
+		printf("No SSSE3 on this CPU, skipping that kernel\n");
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		kernels.push_back(kernel_case{"avx2", des_nibble_transform_avx2});
+	} else {
+		printf("No AVX2 on this CPU, skipping that kernel\n");
+	}
+#endif
+
+	uint8_t plaintext[256];
+	for (size_t i = 0; i < 256; i ++) {
+		plaintext[i] = static_cast<uint8_t>(i);
+	}
+
+	size_t mismatches = 0;
+	for (unsigned key = 0; key < 1024; key ++) {
+		std::bitset<10> bits(key);
+		const des_codebook &codebook = get_codebook(bits);
+
+		//Reference: plaintext i encrypts to ciphertext[i], ciphertext i decrypts to decrypted[i]
+		uint8_t ciphertext[256], decrypted[256];
+		for (size_t i = 0; i < 256; i ++) {
+			ciphertext[i] = static_cast<uint8_t>(des_encrypt(std::bitset<8>{i}, bits).to_ulong());
+			decrypted[i] = static_cast<uint8_t>(des_decrypt(std::bitset<8>{i}, bits).to_ulong());
+		}
+
+		uint8_t output[256];
+		for (size_t i = 0; i < 256; i ++) {
+			output[i] = codebook.encrypt(plaintext[i]);
+		}
+		mismatches += check("scalar encrypt", key, output, ciphertext, 256);
+		for (size_t i = 0; i < 256; i ++) {
+			output[i] = codebook.decrypt(plaintext[i]);
+		}
+		mismatches += check("scalar decrypt", key, output, decrypted, 256);
+
+		for (const kernel_case &kernel : kernels) {
+			//256 is a whole number of registers for both, so the kernel has to do all of it
+			memset(output, 0, sizeof(output));
+			if (kernel.kernel(codebook.encrypt_tables, plaintext, output, 256) != 256) {
+				fprintf(stderr, "%s: didn't process the whole buffer\n", kernel.name);
+				mismatches ++;
+			}
+			mismatches += check(kernel.name, key, output, ciphertext, 256);
+
+			memset(output, 0, sizeof(output));
+			if (kernel.kernel(codebook.decrypt_tables, plaintext, output, 256) != 256) {
+				fprintf(stderr, "%s: didn't process the whole buffer\n", kernel.name);
+				mismatches ++;
+			}
+			mismatches += check(kernel.name, key, output, decrypted, 256);
+		}
+
+		//Whatever the CPU picks, plus a tail
+		codebook.encrypt(plaintext, output, 255);
+		mismatches += check("dispatched encrypt", key, output, ciphertext, 255);
+		codebook.decrypt(plaintext, output, 255);
+		mismatches += check("dispatched decrypt", key, output, decrypted, 255);
+	}
+
+	printf("Checked 1024 keys x 256 bytes (scalar + %zu kernels): %zu mismatches\n", kernels.size(), mismatches);
+	return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
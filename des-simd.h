@@ -0,0 +1,135 @@
+//
+// Created by Glenn Smith on 10/10/18.
+//
+
+#ifndef CRYPTO2_DES_SIMD_H
+#define CRYPTO2_DES_SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CRYPTO2_DES_X86 1
+#include <immintrin.h>
+#endif
+
+/**
+ * Nibble lookup tables describing the toy DES for one key in one direction. Every step of the
+ * cipher only ever looks at 4 bits at a time (IP and IP^-1 are linear so they split over the two
+ * input nibbles, and F only reads the right half), so a whole block is eight 16-entry lookups.
+ * 16-entry tables are exactly what pshufb does, so a vector register does 16 or 32 blocks at once.
+ */
+struct des_nibble_tables {
+	//IP split by which input nibble the bits come from and which output half they land in
+	uint8_t ip_low_to_left[16];
+	uint8_t ip_high_to_left[16];
+	uint8_t ip_low_to_right[16];
+	uint8_t ip_high_to_right[16];
+	//F for the first and second Feistel rounds (K1 then K2 encrypting, K2 then K1 decrypting)
+	uint8_t f_first[16];
+	uint8_t f_second[16];
+	//IP^-1 split by which input half the bits come from
+	uint8_t fp_left[16];
+	uint8_t fp_right[16];
+};
+
+#ifdef CRYPTO2_DES_X86
+
+/**
+ * SSSE3 kernel, 16 blocks per iteration. Returns how many bytes were processed, the caller is
+ * responsible for any tail shorter than a register.
+ */
+__attribute__((target("ssse3")))
+size_t des_nibble_transform_ssse3(const des_nibble_tables &tables, const uint8_t *input, uint8_t *output, size_t length) {
+	const __m128i ip_low_to_left = _mm_loadu_si128((const __m128i *)tables.ip_low_to_left);
+	const __m128i ip_high_to_left = _mm_loadu_si128((const __m128i *)tables.ip_high_to_left);
+	const __m128i ip_low_to_right = _mm_loadu_si128((const __m128i *)tables.ip_low_to_right);
+	const __m128i ip_high_to_right = _mm_loadu_si128((const __m128i *)tables.ip_high_to_right);
+	const __m128i f_first = _mm_loadu_si128((const __m128i *)tables.f_first);
+	const __m128i f_second = _mm_loadu_si128((const __m128i *)tables.f_second);
+	const __m128i fp_left = _mm_loadu_si128((const __m128i *)tables.fp_left);
+	const __m128i fp_right = _mm_loadu_si128((const __m128i *)tables.fp_right);
+	const __m128i nibble = _mm_set1_epi8(0x0F);
+
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *)(input + i));
+		__m128i low = _mm_and_si128(block, nibble);
+		__m128i high = _mm_and_si128(_mm_srli_epi16(block, 4), nibble);
+
+		//Initial permutation, straight into the two Feistel halves
+		__m128i left = _mm_or_si128(_mm_shuffle_epi8(ip_low_to_left, low), _mm_shuffle_epi8(ip_high_to_left, high));
+		__m128i right = _mm_or_si128(_mm_shuffle_epi8(ip_low_to_right, low), _mm_shuffle_epi8(ip_high_to_right, high));
+
+		//Round one, then round two with the swap folded in by just trading names
+		left = _mm_xor_si128(left, _mm_shuffle_epi8(f_first, right));
+		right = _mm_xor_si128(right, _mm_shuffle_epi8(f_second, left));
+
+		//Inverse initial permutation, round two's output is the low half
+		block = _mm_or_si128(_mm_shuffle_epi8(fp_left, right), _mm_shuffle_epi8(fp_right, left));
+		_mm_storeu_si128((__m128i *)(output + i), block);
+	}
+	return i;
+}
+
+/**
+ * AVX2 kernel, same as the SSSE3 one but 32 blocks per iteration
+ */
+__attribute__((target("avx2")))
+size_t des_nibble_transform_avx2(const des_nibble_tables &tables, const uint8_t *input, uint8_t *output, size_t length) {
+	//pshufb works per 128-bit lane so each lane needs its own copy of the tables
+	const __m256i ip_low_to_left = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables.ip_low_to_left));
+	const __m256i ip_high_to_left = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables.ip_high_to_left));
+	const __m256i ip_low_to_right = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables.ip_low_to_right));
+	const __m256i ip_high_to_right = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables.ip_high_to_right));
+	const __m256i f_first = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables.f_first));
+	const __m256i f_second = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables.f_second));
+	const __m256i fp_left = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables.fp_left));
+	const __m256i fp_right = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables.fp_right));
+	const __m256i nibble = _mm256_set1_epi8(0x0F);
+
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		__m256i block = _mm256_loadu_si256((const __m256i *)(input + i));
+		__m256i low = _mm256_and_si256(block, nibble);
+		__m256i high = _mm256_and_si256(_mm256_srli_epi16(block, 4), nibble);
+
+		__m256i left = _mm256_or_si256(_mm256_shuffle_epi8(ip_low_to_left, low), _mm256_shuffle_epi8(ip_high_to_left, high));
+		__m256i right = _mm256_or_si256(_mm256_shuffle_epi8(ip_low_to_right, low), _mm256_shuffle_epi8(ip_high_to_right, high));
+
+		left = _mm256_xor_si256(left, _mm256_shuffle_epi8(f_first, right));
+		right = _mm256_xor_si256(right, _mm256_shuffle_epi8(f_second, left));
+
+		block = _mm256_or_si256(_mm256_shuffle_epi8(fp_left, right), _mm256_shuffle_epi8(fp_right, left));
+		_mm256_storeu_si256((__m256i *)(output + i), block);
+	}
+	return i;
+}
+
+#endif //CRYPTO2_DES_X86
+
+typedef size_t (*des_nibble_kernel)(const des_nibble_tables &, const uint8_t *, uint8_t *, size_t);
+
+/**
+ * Pick the widest kernel this CPU supports, or nullptr if there isn't one and the caller should
+ * fall back to plain table lookups. Only checks the CPU once.
+ */
+des_nibble_kernel get_des_nibble_kernel() {
+#ifdef CRYPTO2_DES_X86
+	static const des_nibble_kernel kernel = []() -> des_nibble_kernel {
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			return des_nibble_transform_avx2;
+		}
+		if (__builtin_cpu_supports("ssse3")) {
+			return des_nibble_transform_ssse3;
+		}
+		return nullptr;
+	}();
+	return kernel;
+#else
+	return nullptr;
+#endif
+}
+
+#endif //CRYPTO2_DES_SIMD_H
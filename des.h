@@ -8,81 +8,139 @@
 #include <bitset>
 #include <array>
 #include <vector>
+#include <utility>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include "des-simd.h"
 
 /**
- * Permute and optionally expand/contract a bitset using an array of permuted locations
+ * Compile-time description of a bit permutation, optionally expanding or contracting it. Bit i
+ * of the output comes from bit locations[i] - 1 of the input, same layout as the lecture slides.
+ * With msb_first the table is instead numbered the way FIPS 46 does it, 1 being the highest bit
+ * of both input and output. Works for any width up to 64 bits since everything is done in a
+ * native integer.
  */
-template<size_t input_size, size_t output_size = input_size>
-std::bitset<output_size> permute(const std::bitset<input_size> &input, const std::array<int, output_size> &locations) {
-	std::bitset<output_size> output;
-	//For each bit in the output, find its corresponding bit in the input
-	for (size_t i = 0; i < output_size; i ++) {
-		output[i] = input[locations[i] - 1];
+template<size_t input_bits, bool msb_first, int... locations>
+struct basic_permutation {
+	static constexpr size_t input_size = input_bits;
+	static constexpr size_t output_size = sizeof...(locations);
+
+	static_assert(input_size <= 64 && output_size <= 64, "Permutations are done in a uint64_t");
+
+	/**
+	 * Input bit (counting from the lowest) that output bit i (also from the lowest) comes from
+	 */
+	static constexpr int source(size_t i) {
+		const int locs[] = {locations...};
+		return msb_first ? static_cast<int>(input_size) - locs[output_size - 1 - i] : locs[i] - 1;
 	}
-	return output;
-}
 
-/**
- * Split one bitset into two smaller bitsets
- */
-template<size_t full, size_t half = full / 2>
-void split(const std::bitset<full> &input, std::bitset<half> &low, std::bitset<half> &high) {
-	//First half move bits into the low output, second half goes into high output
-	for (size_t i = 0; i < full; i ++) {
-		if (i < half) {
-			low[i] = input[i];
-		} else {
-			high[i - half] = input[i];
+	/**
+	 * Mask of all the input bits that move by the same distance, so they can be moved together
+	 */
+	static constexpr uint64_t shift_mask(int shift) {
+		uint64_t mask = 0;
+		for (size_t i = 0; i < output_size; i ++) {
+			if (static_cast<int>(i) - source(i) == shift) {
+				mask |= uint64_t(1) << source(i);
+			}
 		}
+		return mask;
 	}
-}
+};
+
+template<size_t input_bits, int... locations>
+using permutation = basic_permutation<input_bits, false, locations...>;
+
+template<size_t input_bits, int... locations>
+using fips_permutation = basic_permutation<input_bits, true, locations...>;
 
 /**
- * Combine two bitsets into one larger bitset
+ * Move every input bit that travels a given distance in one mask and shift
  */
-template<size_t half, size_t full = half * 2>
-std::bitset<full> combine(const std::bitset<half> &low, const std::bitset<half> &high) {
-	std::bitset<full> output;
-	//First half of the output is the lower bits, second half is the upper bits
-	for (size_t i = 0; i < full; i ++) {
-		if (i < half) {
-			output[i] = low[i];
-		} else {
-			output[i] = high[i - half];
-		}
+template<typename perm, int shift>
+uint64_t permute_shift(uint64_t input) {
+	constexpr uint64_t mask = perm::shift_mask(shift);
+	if (mask == 0) {
+		return 0;
 	}
+	//Written so neither branch has a negative shift count, even the one that isn't taken
+	return shift >= 0 ? (input & mask) << (shift >= 0 ? shift : 0) : (input & mask) >> (shift < 0 ? -shift : 0);
+}
+
+template<typename perm, int... offsets>
+uint64_t permute_network(uint64_t input, std::integer_sequence<int, offsets...>) {
+	uint64_t output = 0;
+	//One masked shift per possible distance, the empty ones compile away to nothing
+	int expand[] = {0, (output |= permute_shift<perm, offsets - static_cast<int>(perm::input_size) + 1>(input), 0)...};
+	(void)expand;
 	return output;
 }
 
 /**
- * Left shift all the bits in the input (with wrapping around)
+ * Permute and optionally expand/contract the low bits of an integer with a permutation descriptor
+ */
+template<typename perm>
+uint64_t permute(uint64_t input) {
+	return permute_network<perm>(input, std::make_integer_sequence<int, perm::input_size + perm::output_size - 1>());
+}
+
+/**
+ * Mask with the low `size` bits set
  */
 template<size_t size>
-std::bitset<size> left_shift(const std::bitset<size> &input) {
-	std::bitset<size> output = input;
-	//This will clobber the high bit so make sure we pick it back up
-	output <<= 1;
-	output[0] = input[size - 1];
-	return output;
+constexpr uint64_t low_bits() {
+	return size >= 64 ? ~uint64_t(0) : (uint64_t(1) << (size % 64)) - 1;
 }
 
 /**
- * Swap two bitsets by reference
+ * Split one integer into two halves
+ */
+template<size_t full, size_t half = full / 2>
+void split(uint64_t input, uint64_t &low, uint64_t &high) {
+	//Low bits go into the low output, high bits go into the high output
+	low = input & low_bits<half>();
+	high = (input >> half) & low_bits<half>();
+}
+
+/**
+ * Combine two halves into one larger integer
+ */
+template<size_t half>
+uint64_t combine(uint64_t low, uint64_t high) {
+	return (low & low_bits<half>()) | ((high & low_bits<half>()) << half);
+}
+
+/**
+ * Left shift all the bits in the input (with wrapping around)
  */
 template<size_t size>
-void swap(std::bitset<size> &a, std::bitset<size> &b) {
-	std::bitset<size> tmp = a;
-	a = b;
-	b = tmp;
+uint64_t left_shift(uint64_t input) {
+	//The high bit falls off the end so pick it back up at the bottom
+	return ((input << 1) | (input >> (size - 1))) & low_bits<size>();
 }
 
+//Permutations as defined in the lecture slides
+typedef permutation<8, 2, 6, 3, 1, 4, 8, 5, 7> initial_permutation;
+typedef permutation<8, 4, 1, 3, 5, 7, 2, 8, 6> inverse_initial_permutation;
+typedef permutation<4, 4, 1, 2, 3, 2, 3, 4, 1> F_expansion;
+typedef permutation<4, 2, 4, 3, 1> P4;
+typedef permutation<10, 3, 5, 2, 7, 4, 10, 1, 9, 8, 6> P10;
+typedef permutation<10, 6, 3, 7, 4, 8, 5, 10, 9> P8;
+
+//S-Boxes
+const uint8_t S_0[4][4] = { {1, 0, 3, 2}, {3, 2, 1, 0}, {0, 2, 1, 3}, {3, 1, 3, 2} };
+const uint8_t S_1[4][4] = { {0, 1, 2, 3}, {2, 0, 1, 3}, {3, 0, 1, 0}, {2, 1, 0, 3} };
+
 /**
  * Evaluate an S-box specific to the F-function
  */
-std::bitset<2> F_sbox(const std::bitset<4> &input, const std::array<std::array<int, 4>, 4> &matrix) {
+uint64_t F_sbox(uint64_t input, const uint8_t (&matrix)[4][4]) {
 	//Get column and row indices from the bits of the input
-	int column = input[1] | (input[2] << 1);
-	int row = input[0] | (input[3] << 1);
+	uint64_t column = ((input >> 1) & 1) | (((input >> 2) & 1) << 1);
+	uint64_t row = (input & 1) | (((input >> 3) & 1) << 1);
 	//Output is the value in the S-box at that cell
 	return matrix[column][row];
 }
@@ -90,98 +148,83 @@ std::bitset<2> F_sbox(const std::bitset<4> &input, const std::array<std::array<i
 /**
  * Evaluates the "F" function as defined in the slides, containing permutations and S-boxes
  */
-std::bitset<4> F_fn(const std::bitset<4> &input, const std::bitset<8> &key) {
-	//Expansions / permutations
-	std::array<int, 8> F_expansion = {{4, 1, 2, 3, 2, 3, 4, 1}};
-	std::array<int, 4> P4 = {{2, 4, 3, 1}};
-
-	//S-Boxes
-	std::array<std::array<int, 4>, 4> S_0 = {{ {{1, 0, 3, 2}}, {{3, 2, 1, 0}}, {{0, 2, 1, 3}}, {{3, 1, 3, 2}} }};
-	std::array<std::array<int, 4>, 4> S_1 = {{ {{0, 1, 2, 3}}, {{2, 0, 1, 3}}, {{3, 0, 1, 0}}, {{2, 1, 0, 3}} }};
-
+uint64_t F_fn(uint64_t input, uint64_t key) {
 	//Expand input to 8 bits and xor with the key
-	std::bitset<8> expanded = permute(input, F_expansion);
-	expanded ^= key;
+	uint64_t expanded = permute<F_expansion>(input) ^ key;
 
 	//Then split the expanded input into halves to run through the S-boxes
-	std::bitset<4> low, high;
-	split(expanded, low, high);
+	uint64_t low, high;
+	split<8>(expanded, low, high);
 
 	//Run each side through its respective S-box
-	std::bitset<2> low_subbed = F_sbox(low, S_0);
-	std::bitset<2> high_subbed = F_sbox(high, S_1);
+	uint64_t low_subbed = F_sbox(low, S_0);
+	uint64_t high_subbed = F_sbox(high, S_1);
 
 	//Then combine them together and permute the bits to get the result
-	std::bitset<4> combined = combine(low_subbed, high_subbed);
-	std::bitset<4> permuted = permute(combined, P4);
-	return permuted;
+	uint64_t combined = combine<2>(low_subbed, high_subbed);
+	return permute<P4>(combined);
 }
 
 /**
  * Subkey generation function, takes a 10-bit initial key and outputs to two 8-bit subkeys
  */
-void generate_key(const std::bitset<10> &initial_key, std::bitset<8> &K1, std::bitset<8> &K2) {
-	//Permutations as defined in the lecture slides
-	std::array<int, 10> P10 = {{3, 5, 2, 7, 4, 10, 1, 9, 8, 6}};
-	std::array<int, 8> P8 = {{6, 3, 7, 4, 8, 5, 10, 9}};
-
+void generate_key(uint64_t initial_key, uint64_t &K1, uint64_t &K2) {
 	//Initial permutation
-	std::bitset<10> permuted_key = permute(initial_key, P10);
+	uint64_t permuted_key = permute<P10>(initial_key);
 
 	//Split into high and low key bits
-	std::bitset<5> klow, khigh;
-	split(permuted_key, klow, khigh);
+	uint64_t klow, khigh;
+	split<10>(permuted_key, klow, khigh);
 
 	//Then left shift both
-	std::bitset<5> sklow_1 = left_shift(klow);
-	std::bitset<5> skhigh_1 = left_shift(khigh);
+	uint64_t sklow_1 = left_shift<5>(klow);
+	uint64_t skhigh_1 = left_shift<5>(khigh);
 
 	//Combine together and permute to generate K1
-	std::bitset<10> key_combined_1 = combine(sklow_1, skhigh_1);
-	K1 = permute(key_combined_1, P8);
+	K1 = permute<P8>(combine<5>(sklow_1, skhigh_1));
 
 	//Shift left both sets of bits again
-	std::bitset<5> sklow_2 = left_shift(sklow_1);
-	std::bitset<5> skhigh_2 = left_shift(skhigh_1);
+	uint64_t sklow_2 = left_shift<5>(sklow_1);
+	uint64_t skhigh_2 = left_shift<5>(skhigh_1);
 
 	//Then combine and permute those to generate K2
-	std::bitset<10> key_combined_2 = combine(sklow_2, skhigh_2);
-	K2 = permute(key_combined_2, P8);
+	K2 = permute<P8>(combine<5>(sklow_2, skhigh_2));
 }
 
 /**
- * Perform toy DES encryption on an 8-bit piece of plaintext
+ * Run the two Feistel rounds, shared by encryption and decryption which only differ in the order
+ * of the subkeys
  */
-std::bitset<8> des_encrypt(const std::bitset<8> &plaintext,
-                           const std::bitset<10> &initial_key) {
-	//Generate K1 and K2 using the subkey generation function
-	std::bitset<8> K1, K2;
-	generate_key(initial_key, K1, K2);
-
-	//Permutations as defined in the lecture slides
-	std::array<int, 8> initial_permutation = {{2, 6, 3, 1, 4, 8, 5, 7}};
-	std::array<int, 8> inverse_initial_permutation = {{4, 1, 3, 5, 7, 2, 8, 6}};
-
+uint64_t des_rounds(uint64_t input, uint64_t first_key, uint64_t second_key) {
 	//Permute the bits according to the initial permutation layout
-	std::bitset<8> permuted = permute(plaintext, initial_permutation);
+	uint64_t permuted = permute<initial_permutation>(input);
 
 	//Splitting into low and high bits for Feistel Cipher
-	std::bitset<4> low, high;
-	split(permuted, low, high);
+	uint64_t low, high;
+	split<8>(permuted, low, high);
 
 	//Round one of Feistel Cipher: xor the low bits with the result of the F function applied
-	// to the high bits and the first 8 bits of the subkey and swap
-	low ^= F_fn(high, K1);
-	swap(low, high);
+	// to the high bits and the first subkey and swap
+	low ^= F_fn(high, first_key);
+	std::swap(low, high);
 	//Round 2, no more swapping because this is the last round
-	low ^= F_fn(high, K2);
+	low ^= F_fn(high, second_key);
 
 	//Combine low and high bits and permute with the inverse initial permutation to obtain
-	// final ciphertext
-	std::bitset<8> combined = combine(low, high);
-	std::bitset<8> ciphertext = permute(combined, inverse_initial_permutation);
+	// the final output
+	return permute<inverse_initial_permutation>(combine<4>(low, high));
+}
 
-	return ciphertext;
+/**
+ * Perform toy DES encryption on an 8-bit piece of plaintext
+ */
+std::bitset<8> des_encrypt(const std::bitset<8> &plaintext,
+                           const std::bitset<10> &initial_key) {
+	//Generate K1 and K2 using the subkey generation function
+	uint64_t K1, K2;
+	generate_key(initial_key.to_ullong(), K1, K2);
+
+	return std::bitset<8>{des_rounds(plaintext.to_ullong(), K1, K2)};
 }
 
 /**
@@ -190,34 +233,126 @@ std::bitset<8> des_encrypt(const std::bitset<8> &plaintext,
 std::bitset<8> des_decrypt(const std::bitset<8> &ciphertext,
                            const std::bitset<10> &initial_key) {
 	//Generate K1 and K2 using the subkey generation function
-	std::bitset<8> K1, K2;
-	generate_key(initial_key, K1, K2);
+	uint64_t K1, K2;
+	generate_key(initial_key.to_ullong(), K1, K2);
 
-	//Permutations as defined in the lecture slides
-	std::array<int, 8> initial_permutation = {{2, 6, 3, 1, 4, 8, 5, 7}};
-	std::array<int, 8> inverse_initial_permutation = {{4, 1, 3, 5, 7, 2, 8, 6}};
+	//Same rounds with the last 8 bits of the subkey first because we are decrypting instead
+	return std::bitset<8>{des_rounds(ciphertext.to_ullong(), K2, K1)};
+}
 
-	//Permute the bits according to the initial permutation layout
-	std::bitset<8> permuted = permute(ciphertext, initial_permutation);
+/**
+ * Keyed toy DES context. The block is only 8 bits wide, so the entire cipher for one key is a
+ * 256-entry table; build the forward and inverse tables once and every byte after that is a
+ * single lookup.
+ */
+struct des_codebook {
+	std::array<uint8_t, 256> forward;
+	std::array<uint8_t, 256> inverse;
+
+	//Same cipher split into nibble lookups for the vector kernels in des-simd.h
+	des_nibble_tables encrypt_tables;
+	des_nibble_tables decrypt_tables;
+
+	explicit des_codebook(const std::bitset<10> &key) {
+		for (size_t i = 0; i < 256; i ++) {
+			uint8_t ciphertext = static_cast<uint8_t>(des_encrypt(std::bitset<8>{i}, key).to_ulong());
+			forward[i] = ciphertext;
+			inverse[ciphertext] = static_cast<uint8_t>(i);
+		}
 
-	//Splitting into low and high bits for Feistel Cipher
-	std::bitset<4> low, high;
-	split(permuted, low, high);
+		uint64_t K1, K2;
+		generate_key(key.to_ullong(), K1, K2);
+
+		for (size_t i = 0; i < 16; i ++) {
+			//IP of a byte is the OR of IP of its two nibbles, same for IP^-1 of the two halves
+			uint8_t ip_low = static_cast<uint8_t>(permute<initial_permutation>(i));
+			uint8_t ip_high = static_cast<uint8_t>(permute<initial_permutation>(i << 4));
+			uint8_t fp_low = static_cast<uint8_t>(permute<inverse_initial_permutation>(i));
+			uint8_t fp_high = static_cast<uint8_t>(permute<inverse_initial_permutation>(i << 4));
+			uint8_t f_K1 = static_cast<uint8_t>(F_fn(i, K1));
+			uint8_t f_K2 = static_cast<uint8_t>(F_fn(i, K2));
+
+			for (des_nibble_tables *tables : {&encrypt_tables, &decrypt_tables}) {
+				tables->ip_low_to_left[i] = ip_low & 0x0F;
+				tables->ip_high_to_left[i] = ip_high & 0x0F;
+				tables->ip_low_to_right[i] = ip_low >> 4;
+				tables->ip_high_to_right[i] = ip_high >> 4;
+				tables->fp_left[i] = fp_low;
+				tables->fp_right[i] = fp_high;
+			}
+			//Decryption is the same network with the subkeys reversed
+			encrypt_tables.f_first[i] = f_K1;
+			encrypt_tables.f_second[i] = f_K2;
+			decrypt_tables.f_first[i] = f_K2;
+			decrypt_tables.f_second[i] = f_K1;
+		}
+	}
 
-	//Round one of Feistel Cipher: xor the low bits with the result of the F function applied
-	// to the high bits and the last 8 bits of the subkey (because we are decrypting instead)
-	low ^= F_fn(high, K2);
-	swap(low, high);
-	//Round 2, no more swapping because this is the last round
-	low ^= F_fn(high, K1);
+	uint8_t encrypt(uint8_t plaintext) const {
+		return forward[plaintext];
+	}
 
-	//Combine low and high bits and permute with the inverse initial permutation to obtain
-	// final plaintext
-	std::bitset<8> combined = combine(low, high);
-	std::bitset<8> plaintext = permute(combined, inverse_initial_permutation);
+	uint8_t decrypt(uint8_t ciphertext) const {
+		return inverse[ciphertext];
+	}
+
+	/**
+	 * Encrypt a buffer of bytes, input and output may be the same buffer. Uses the widest vector
+	 * kernel the CPU has and finishes off the tail with table lookups.
+	 */
+	void encrypt(const uint8_t *input, uint8_t *output, size_t length) const {
+		transform(encrypt_tables, forward, input, output, length);
+	}
+
+	/**
+	 * Decrypt a buffer of bytes, input and output may be the same buffer
+	 */
+	void decrypt(const uint8_t *input, uint8_t *output, size_t length) const {
+		transform(decrypt_tables, inverse, input, output, length);
+	}
 
-	return plaintext;
+private:
+	static void transform(const des_nibble_tables &tables, const std::array<uint8_t, 256> &table,
+	                      const uint8_t *input, uint8_t *output, size_t length) {
+		size_t i = 0;
+		des_nibble_kernel kernel = get_des_nibble_kernel();
+		if (kernel != nullptr) {
+			i = kernel(tables, input, output, length);
+		}
+		for (; i < length; i ++) {
+			output[i] = table[input[i]];
+		}
+	}
+};
+
+/**
+ * Get the codebook for a key, building it the first time that key is seen. There are only 1024
+ * possible keys so each one just gets its own slot.
+ */
+const des_codebook &get_codebook(const std::bitset<10> &key) {
+	static std::array<std::unique_ptr<des_codebook>, 1024> codebooks;
+	static std::array<std::once_flag, 1024> built;
+
+	size_t index = key.to_ulong();
+	std::call_once(built[index], [&key, index]() {
+		codebooks[index].reset(new des_codebook(key));
+	});
+	return *codebooks[index];
 }
 
 
+/**
+ * Encrypt a contiguous range of bytes in place
+ */
+void des_encrypt_buffer(uint8_t *data, size_t length, const std::bitset<10> &key) {
+	get_codebook(key).encrypt(data, data, length);
+}
+
+/**
+ * Decrypt a contiguous range of bytes in place
+ */
+void des_decrypt_buffer(uint8_t *data, size_t length, const std::bitset<10> &key) {
+	get_codebook(key).decrypt(data, data, length);
+}
+
 #endif //CRYPTO2_DES_H
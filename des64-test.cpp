@@ -0,0 +1,76 @@
+//
+// Created by Glenn Smith on 10/11/18.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "des64.h"
+
+/**
+ * Known answers for the full DES in des64.h: the worked example everyone checks DES against, a
+ * few from NBS SP 500-20 and the FIPS 81 ECB example as a buffer of three blocks. Each one is
+ * decrypted back too, and a buffer that isn't a whole number of blocks has to keep its tail.
+ */
+
+struct des64_vector {
+	const char *name;
+	uint64_t key;
+	uint64_t plaintext;
+	uint64_t ciphertext;
+};
+
+size_t mismatches = 0;
+
+//Counts it if a block didn't come out as expected
+void check(const char *name, const char *what, uint64_t output, uint64_t expected) {
+	if (output != expected) {
+		fprintf(stderr, "%s: %s gave %016llx, expected %016llx\n", name, what,
+		        static_cast<unsigned long long>(output), static_cast<unsigned long long>(expected));
+		mismatches ++;
+	}
+}
+
+int main() {
+	const des64_vector vectors[] = {
+		{"worked example", 0x133457799BBCDFF1ULL, 0x0123456789ABCDEFULL, 0x85E813540F0AB405ULL},
+		{"FIPS 81 \"Now is t\"", 0x0123456789ABCDEFULL, 0x4E6F772069732074ULL, 0x3FA40E8A984D4815ULL},
+		{"SP 500-20 plaintext 1", 0x0101010101010101ULL, 0x8000000000000000ULL, 0x95F8A5E5DD31D900ULL},
+		{"SP 500-20 plaintext 64", 0x0101010101010101ULL, 0x0000000000000001ULL, 0x166B40B44ABA4BD6ULL},
+		{"SP 500-20 key 1", 0x8001010101010101ULL, 0x0000000000000000ULL, 0x95A8D72813DAA94DULL},
+		{"zero ciphertext", 0x0E329232EA6D0D73ULL, 0x8787878787878787ULL, 0x0000000000000000ULL},
+	};
+	for (const des64_vector &vector : vectors) {
+		const des64_key_schedule &schedule = get_des64_key_schedule(vector.key);
+		check(vector.name, "encrypt", des64_block(vector.plaintext, schedule, false), vector.ciphertext);
+		check(vector.name, "decrypt", des64_block(vector.ciphertext, schedule, true), vector.plaintext);
+	}
+
+	//FIPS 81 appendix B, ECB, with a few bytes after the last block that have to be left alone
+	const char plaintext[] = "Now is the time for all ";
+	const uint8_t ciphertext[24] = {
+		0x3f, 0xa4, 0x0e, 0x8a, 0x98, 0x4d, 0x48, 0x15,
+		0x6a, 0x27, 0x17, 0x87, 0xab, 0x88, 0x83, 0xf9,
+		0x89, 0x3d, 0x51, 0xec, 0x4b, 0x56, 0x3b, 0x53,
+	};
+	uint8_t buffer[27];
+	memcpy(buffer, plaintext, 24);
+	memcpy(buffer + 24, "abc", 3);
+	des64_encrypt_buffer(buffer, sizeof(buffer), 0x0123456789ABCDEFULL);
+	for (size_t i = 0; i < 24; i += 8) {
+		check("FIPS 81 buffer", "encrypt", des64_load_block(buffer + i), des64_load_block(ciphertext + i));
+	}
+	des64_decrypt_buffer(buffer, sizeof(buffer), 0x0123456789ABCDEFULL);
+	for (size_t i = 0; i < 24; i += 8) {
+		check("FIPS 81 buffer", "decrypt", des64_load_block(buffer + i),
+		      des64_load_block(reinterpret_cast<const uint8_t *>(plaintext) + i));
+	}
+	if (memcmp(buffer + 24, "abc", 3) != 0) {
+		fprintf(stderr, "FIPS 81 buffer: the partial block at the end was changed\n");
+		mismatches ++;
+	}
+
+	printf("Checked %zu DES vectors and the FIPS 81 buffer: %zu mismatches\n",
+	       sizeof(vectors) / sizeof(vectors[0]), mismatches);
+	return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
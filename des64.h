@@ -0,0 +1,230 @@
+//
+// Created by Glenn Smith on 10/10/18.
+//
+
+#ifndef CRYPTO2_DES64_H
+#define CRYPTO2_DES64_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "des.h"
+
+//Full DES as defined in FIPS 46-3, tables numbered from the most significant bit like the standard
+
+typedef fips_permutation<64,
+	58, 50, 42, 34, 26, 18, 10, 2, 60, 52, 44, 36, 28, 20, 12, 4,
+	62, 54, 46, 38, 30, 22, 14, 6, 64, 56, 48, 40, 32, 24, 16, 8,
+	57, 49, 41, 33, 25, 17, 9, 1, 59, 51, 43, 35, 27, 19, 11, 3,
+	61, 53, 45, 37, 29, 21, 13, 5, 63, 55, 47, 39, 31, 23, 15, 7> des64_initial_permutation;
+
+typedef fips_permutation<64,
+	40, 8, 48, 16, 56, 24, 64, 32, 39, 7, 47, 15, 55, 23, 63, 31,
+	38, 6, 46, 14, 54, 22, 62, 30, 37, 5, 45, 13, 53, 21, 61, 29,
+	36, 4, 44, 12, 52, 20, 60, 28, 35, 3, 43, 11, 51, 19, 59, 27,
+	34, 2, 42, 10, 50, 18, 58, 26, 33, 1, 41, 9, 49, 17, 57, 25> des64_final_permutation;
+
+typedef fips_permutation<32,
+	16, 7, 20, 21, 29, 12, 28, 17, 1, 15, 23, 26, 5, 18, 31, 10,
+	2, 8, 24, 14, 32, 27, 3, 9, 19, 13, 30, 6, 22, 11, 4, 25> des64_P;
+
+typedef fips_permutation<64,
+	57, 49, 41, 33, 25, 17, 9, 1, 58, 50, 42, 34, 26, 18,
+	10, 2, 59, 51, 43, 35, 27, 19, 11, 3, 60, 52, 44, 36,
+	63, 55, 47, 39, 31, 23, 15, 7, 62, 54, 46, 38, 30, 22,
+	14, 6, 61, 53, 45, 37, 29, 21, 13, 5, 28, 20, 12, 4> des64_PC1;
+
+typedef fips_permutation<56,
+	14, 17, 11, 24, 1, 5, 3, 28, 15, 6, 21, 10,
+	23, 19, 12, 4, 26, 8, 16, 7, 27, 20, 13, 2,
+	41, 52, 31, 37, 47, 55, 30, 40, 51, 45, 33, 48,
+	44, 49, 39, 56, 34, 53, 46, 42, 50, 36, 29, 32> des64_PC2;
+
+//How far C and D rotate before each round
+const int des64_rotations[16] = {1, 1, 2, 2, 2, 2, 2, 2, 1, 2, 2, 2, 2, 2, 2, 1};
+
+//S-boxes, indexed [box][row][column]
+const uint8_t des64_sboxes[8][4][16] = {
+	{
+		{14, 4, 13, 1, 2, 15, 11, 8, 3, 10, 6, 12, 5, 9, 0, 7},
+		{0, 15, 7, 4, 14, 2, 13, 1, 10, 6, 12, 11, 9, 5, 3, 8},
+		{4, 1, 14, 8, 13, 6, 2, 11, 15, 12, 9, 7, 3, 10, 5, 0},
+		{15, 12, 8, 2, 4, 9, 1, 7, 5, 11, 3, 14, 10, 0, 6, 13},
+	}, {
+		{15, 1, 8, 14, 6, 11, 3, 4, 9, 7, 2, 13, 12, 0, 5, 10},
+		{3, 13, 4, 7, 15, 2, 8, 14, 12, 0, 1, 10, 6, 9, 11, 5},
+		{0, 14, 7, 11, 10, 4, 13, 1, 5, 8, 12, 6, 9, 3, 2, 15},
+		{13, 8, 10, 1, 3, 15, 4, 2, 11, 6, 7, 12, 0, 5, 14, 9},
+	}, {
+		{10, 0, 9, 14, 6, 3, 15, 5, 1, 13, 12, 7, 11, 4, 2, 8},
+		{13, 7, 0, 9, 3, 4, 6, 10, 2, 8, 5, 14, 12, 11, 15, 1},
+		{13, 6, 4, 9, 8, 15, 3, 0, 11, 1, 2, 12, 5, 10, 14, 7},
+		{1, 10, 13, 0, 6, 9, 8, 7, 4, 15, 14, 3, 11, 5, 2, 12},
+	}, {
+		{7, 13, 14, 3, 0, 6, 9, 10, 1, 2, 8, 5, 11, 12, 4, 15},
+		{13, 8, 11, 5, 6, 15, 0, 3, 4, 7, 2, 12, 1, 10, 14, 9},
+		{10, 6, 9, 0, 12, 11, 7, 13, 15, 1, 3, 14, 5, 2, 8, 4},
+		{3, 15, 0, 6, 10, 1, 13, 8, 9, 4, 5, 11, 12, 7, 2, 14},
+	}, {
+		{2, 12, 4, 1, 7, 10, 11, 6, 8, 5, 3, 15, 13, 0, 14, 9},
+		{14, 11, 2, 12, 4, 7, 13, 1, 5, 0, 15, 10, 3, 9, 8, 6},
+		{4, 2, 1, 11, 10, 13, 7, 8, 15, 9, 12, 5, 6, 3, 0, 14},
+		{11, 8, 12, 7, 1, 14, 2, 13, 6, 15, 0, 9, 10, 4, 5, 3},
+	}, {
+		{12, 1, 10, 15, 9, 2, 6, 8, 0, 13, 3, 4, 14, 7, 5, 11},
+		{10, 15, 4, 2, 7, 12, 9, 5, 6, 1, 13, 14, 0, 11, 3, 8},
+		{9, 14, 15, 5, 2, 8, 12, 3, 7, 0, 4, 10, 1, 13, 11, 6},
+		{4, 3, 2, 12, 9, 5, 15, 10, 11, 14, 1, 7, 6, 0, 8, 13},
+	}, {
+		{4, 11, 2, 14, 15, 0, 8, 13, 3, 12, 9, 7, 5, 10, 6, 1},
+		{13, 0, 11, 7, 4, 9, 1, 10, 14, 3, 5, 12, 2, 15, 8, 6},
+		{1, 4, 11, 13, 12, 3, 7, 14, 10, 15, 6, 8, 0, 5, 9, 2},
+		{6, 11, 13, 8, 1, 4, 10, 7, 9, 5, 0, 15, 14, 2, 3, 12},
+	}, {
+		{13, 2, 8, 4, 6, 15, 11, 1, 10, 9, 3, 14, 5, 0, 12, 7},
+		{1, 15, 13, 8, 10, 3, 7, 4, 12, 5, 6, 11, 0, 14, 9, 2},
+		{7, 11, 4, 1, 9, 12, 14, 2, 0, 6, 10, 13, 15, 3, 5, 8},
+		{2, 1, 14, 7, 4, 10, 8, 13, 15, 12, 9, 0, 3, 5, 6, 11},
+	}
+};
+
+/**
+ * Combined S-box and P tables: sp[box][six input bits] is that S-box's output already moved to
+ * where P puts it, so the whole of F after the key xor is eight lookups ORed together.
+ */
+struct des64_sp_tables {
+	uint32_t sp[8][64];
+
+	des64_sp_tables() {
+		for (int box = 0; box < 8; box ++) {
+			for (int input = 0; input < 64; input ++) {
+				//Outer two bits pick the row, middle four the column
+				int row = ((input >> 4) & 2) | (input & 1);
+				int column = (input >> 1) & 0xF;
+				uint64_t output = static_cast<uint64_t>(des64_sboxes[box][row][column]) << (28 - 4 * box);
+				sp[box][input] = static_cast<uint32_t>(permute<des64_P>(output));
+			}
+		}
+	}
+};
+
+const des64_sp_tables &get_des64_sp_tables() {
+	static const des64_sp_tables tables;
+	return tables;
+}
+
+/**
+ * Expanded key schedule: each round's 48-bit subkey already split into the 6-bit pieces that get
+ * xored into each S-box's input
+ */
+struct des64_key_schedule {
+	uint8_t subkeys[16][8];
+
+	explicit des64_key_schedule(uint64_t key) {
+		uint64_t permuted = permute<des64_PC1>(key);
+		uint64_t C = (permuted >> 28) & low_bits<28>();
+		uint64_t D = permuted & low_bits<28>();
+
+		for (int round = 0; round < 16; round ++) {
+			for (int i = 0; i < des64_rotations[round]; i ++) {
+				C = left_shift<28>(C);
+				D = left_shift<28>(D);
+			}
+			uint64_t subkey = permute<des64_PC2>((C << 28) | D);
+			for (int box = 0; box < 8; box ++) {
+				subkeys[round][box] = static_cast<uint8_t>((subkey >> (42 - 6 * box)) & 0x3F);
+			}
+		}
+	}
+};
+
+/**
+ * Get the expanded schedule for a key. Keeps a handful of recent keys per thread so the same
+ * session keys don't get expanded over and over.
+ */
+const des64_key_schedule &get_des64_key_schedule(uint64_t key) {
+	struct cache_entry {
+		uint64_t key;
+		std::unique_ptr<des64_key_schedule> schedule;
+	};
+	static thread_local cache_entry cache[16];
+
+	cache_entry &entry = cache[(key ^ (key >> 29) ^ (key >> 47)) & 15];
+	if (!entry.schedule || entry.key != key) {
+		entry.key = key;
+		entry.schedule.reset(new des64_key_schedule(key));
+	}
+	return *entry.schedule;
+}
+
+/**
+ * F function with the expansion, S-boxes and P all folded into the SP tables
+ */
+uint32_t des64_F(uint32_t R, const uint8_t (&subkey)[8], const des64_sp_tables &tables) {
+	uint32_t output = 0;
+	for (int box = 0; box < 8; box ++) {
+		//The expansion is just overlapping 6-bit windows of R, wrapping around the ends
+		int shift = (4 * box + 5) % 32;
+		uint32_t window = ((R << shift) | (R >> (32 - shift))) & 0x3F;
+		output |= tables.sp[box][window ^ subkey[box]];
+	}
+	return output;
+}
+
+/**
+ * Encrypt or decrypt one 64-bit block, which only differ in the order of the subkeys
+ */
+uint64_t des64_block(uint64_t input, const des64_key_schedule &schedule, bool decrypt) {
+	const des64_sp_tables &tables = get_des64_sp_tables();
+
+	uint64_t permuted = permute<des64_initial_permutation>(input);
+	uint32_t L = static_cast<uint32_t>(permuted >> 32);
+	uint32_t R = static_cast<uint32_t>(permuted);
+
+	for (int round = 0; round < 16; round ++) {
+		L ^= des64_F(R, schedule.subkeys[decrypt ? 15 - round : round], tables);
+		std::swap(L, R);
+	}
+
+	//The last round doesn't swap, so undo it while putting the halves back together
+	return permute<des64_final_permutation>((static_cast<uint64_t>(R) << 32) | L);
+}
+
+/**
+ * Blocks are stored big endian in the byte stream, same as every DES test vector
+ */
+uint64_t des64_load_block(const uint8_t *data) {
+	uint64_t block = 0;
+	for (int i = 0; i < 8; i ++) {
+		block = (block << 8) | data[i];
+	}
+	return block;
+}
+
+void des64_store_block(uint64_t block, uint8_t *data) {
+	for (int i = 7; i >= 0; i --) {
+		data[i] = static_cast<uint8_t>(block);
+		block >>= 8;
+	}
+}
+
+/**
+ * Encrypt a range of whole 8-byte blocks in place (ECB, same as the toy cipher does it)
+ */
+void des64_encrypt_buffer(uint8_t *data, size_t length, uint64_t key) {
+	const des64_key_schedule &schedule = get_des64_key_schedule(key);
+	for (size_t i = 0; i + 8 <= length; i += 8) {
+		des64_store_block(des64_block(des64_load_block(data + i), schedule, false), data + i);
+	}
+}
+
+/**
+ * Decrypt a range of whole 8-byte blocks in place
+ */
+void des64_decrypt_buffer(uint8_t *data, size_t length, uint64_t key) {
+	const des64_key_schedule &schedule = get_des64_key_schedule(key);
+	for (size_t i = 0; i + 8 <= length; i += 8) {
+		des64_store_block(des64_block(des64_load_block(data + i), schedule, true), data + i);
+	}
+}
+
+#endif //CRYPTO2_DES64_H
@@ -0,0 +1,200 @@
+//
+// Created by Glenn Smith on 10/11/18.
+//
+
+#ifndef CRYPTO2_DH_POOL_H
+#define CRYPTO2_DH_POOL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+#include "diffie-hellman.h"
+
+/**
+ * How full the keypair pool is and how fast it's being filled, for keeping an eye on it
+ */
+struct dh_pool_stats {
+	size_t depth;
+	size_t capacity;
+	U64 generated;
+	U64 taken;
+	//Keypairs someone wanted when the pool was empty, so they had to make their own
+	U64 misses;
+	//Keypairs per second the background threads make while they're working
+	double refill_rate;
+};
+
+/**
+ * Keypairs for one group, made ahead of time by background threads so whoever needs one doesn't
+ * have to sit through the exponentiation. Taking one is lock free (a bounded ring where each slot
+ * has a sequence number saying whose turn it is with it), so an event loop can take one per
+ * connection without ever waiting on the threads filling it. The threads sleep once it's full and
+ * get woken when it's down to half.
+ */
+class dh_pool {
+	struct slot {
+		//pos when it's ready to be filled for pos, pos + 1 once it holds a keypair for taking
+		std::atomic<size_t> sequence;
+		dh_key key;
+	};
+
+	const dh &mGroup;
+	size_t mCapacity;
+	std::unique_ptr<slot[]> mSlots;
+	//Next position to take from and to fill, on their own cache lines since different threads
+	// hammer each of them
+	alignas(64) std::atomic<size_t> mHead;
+	alignas(64) std::atomic<size_t> mTail;
+
+	std::atomic<U64> mGenerated;
+	std::atomic<U64> mTaken;
+	std::atomic<U64> mMisses;
+	std::atomic<U64> mBusyNanos;
+
+	std::atomic<bool> mStopping;
+	std::mutex mWakeMutex;
+	std::condition_variable mWake;
+	std::vector<std::thread> mThreads;
+
+	bool try_push(dh_key &key) {
+		size_t pos = mTail.load(std::memory_order_relaxed);
+		while (true) {
+			slot &s = mSlots[pos % mCapacity];
+			size_t sequence = s.sequence.load(std::memory_order_acquire);
+			intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+			if (diff == 0) {
+				if (mTail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					s.key = std::move(key);
+					s.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				//Full
+				return false;
+			} else {
+				pos = mTail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool try_pop(dh_key &key) {
+		size_t pos = mHead.load(std::memory_order_relaxed);
+		while (true) {
+			slot &s = mSlots[pos % mCapacity];
+			size_t sequence = s.sequence.load(std::memory_order_acquire);
+			intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+			if (diff == 0) {
+				if (mHead.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					key = std::move(s.key);
+					s.sequence.store(pos + mCapacity, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				//Empty
+				return false;
+			} else {
+				pos = mHead.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	void refill() {
+		while (!mStopping.load(std::memory_order_relaxed)) {
+			if (depth() >= mCapacity) {
+				//Takers don't hold the lock to wake us (they're event loops), so a wakeup can slip
+				// in between checking and sleeping; the timeout covers that
+				std::unique_lock<std::mutex> lock(mWakeMutex);
+				mWake.wait_for(lock, std::chrono::milliseconds(100), [this]() {
+					return mStopping.load(std::memory_order_relaxed) || depth() <= mCapacity / 2;
+				});
+				continue;
+			}
+
+			auto start = std::chrono::steady_clock::now();
+			dh_key key = dh_generate(mGroup);
+			mBusyNanos += static_cast<U64>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - start).count());
+			if (try_push(key)) {
+				mGenerated ++;
+			}
+		}
+	}
+
+public:
+	dh_pool(const dh &group, size_t capacity, int threads = 1) : mGroup(group), mCapacity(capacity),
+		mSlots(new slot[capacity]), mHead(0), mTail(0), mGenerated(0), mTaken(0), mMisses(0), mBusyNanos(0),
+		mStopping(false) {
+		for (size_t i = 0; i < mCapacity; i ++) {
+			mSlots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+		for (int i = 0; i < threads; i ++) {
+			mThreads.emplace_back([this]() {
+				refill();
+			});
+		}
+	}
+
+	~dh_pool() {
+		mStopping = true;
+		{
+			std::lock_guard<std::mutex> lock(mWakeMutex);
+			mWake.notify_all();
+		}
+		for (std::thread &thread : mThreads) {
+			thread.join();
+		}
+	}
+
+	dh_pool(const dh_pool &) = delete;
+	dh_pool &operator=(const dh_pool &) = delete;
+
+	const dh &group() const {
+		return mGroup;
+	}
+
+	/**
+	 * Keypairs ready to go. Only a snapshot when other threads are using the pool.
+	 */
+	size_t depth() const {
+		size_t tail = mTail.load(std::memory_order_relaxed);
+		size_t head = mHead.load(std::memory_order_relaxed);
+		return tail > head ? tail - head : 0;
+	}
+
+	/**
+	 * Get a fresh keypair. Never blocks on the background threads; if the pool is empty it makes
+	 * one right here instead.
+	 */
+	dh_key take() {
+		dh_key key;
+		if (try_pop(key)) {
+			mTaken ++;
+		} else {
+			mMisses ++;
+			key = dh_generate(mGroup);
+		}
+		if (depth() <= mCapacity / 2) {
+			mWake.notify_one();
+		}
+		return key;
+	}
+
+	dh_pool_stats stats() const {
+		dh_pool_stats stats{};
+		stats.depth = depth();
+		stats.capacity = mCapacity;
+		stats.generated = mGenerated.load();
+		stats.taken = mTaken.load();
+		stats.misses = mMisses.load();
+		U64 busy = mBusyNanos.load();
+		stats.refill_rate = busy > 0 ? stats.generated * 1e9 / busy : 0;
+		return stats;
+	}
+};
+
+#endif //CRYPTO2_DH_POOL_H
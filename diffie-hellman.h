@@ -6,32 +6,155 @@
 #define CRYPTO2_DIFFIE_HELLMAN_H
 
 #include <stdint.h>
+#include <vector>
+#include "montgomery.h"
 #include "util.h"
 
+/**
+ * Diffie-Hellman group: public keys are alpha^x mod q. Comes with everything needed to do that
+ * quickly, so only make one of each and share it.
+ */
 struct dh {
-	uint16_t q;
-	uint16_t alpha;
+	//Size of q, which is also how many bytes keys take on the wire and what the group goes by
+	unsigned bits;
+	bignum q;
+	bignum alpha;
+	montgomery mont;
+	//Private keys are always below 2^(bits - 1), so this covers every one of them
+	mont_fixed_base alpha_powers;
 
-	dh(uint16_t q, uint16_t alpha) : q(q), alpha(alpha) {}
+	dh(unsigned bits, const char *q, uint64_t alpha) : bits(bits), q(bignum_from_hex(q, (bits + 63) / 64)),
+		alpha(limbs_of(alpha, (bits + 63) / 64)), mont(this->q), alpha_powers(mont, this->alpha, bits - 1) {}
+
+	size_t bytes() const {
+		return (bits + 7) / 8;
+	}
+
+private:
+	static bignum limbs_of(uint64_t value, size_t limbs) {
+		bignum out(limbs, 0);
+		out[0] = value;
+		return out;
+	}
 };
 
-//Global params are hard coded for JUSTICE
-dh global_dh{15373, 129};
+/**
+ * Groups the KDC can be started with, by the bit size of q. The 16-bit one is the original
+ * homework group, 64 is a safe prime just under 2^64, and the rest are the RFC 2409 / RFC 3526
+ * MODP groups. Returns nullptr for any other size. Each group's tables are built on first use.
+ */
+const dh *dh_group(unsigned bits) {
+	switch (bits) {
+		case 16: {
+			//q = 15373 is only 14 bits, but keys have always gone on the wire as 16
+			static const dh group(16, "3C0D", 129);
+			return &group;
+		}
+		case 64: {
+			static const dh group(64, "FFFFFFFFFFFFDED7", 5);
+			return &group;
+		}
+		case 1024: {
+			static const dh group(1024,
+				"FFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E088A67CC74020BBEA63B139B22514A08798E3404DD"
+				"EF9519B3CD3A431B302B0A6DF25F14374FE1356D6D51C245E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7ED"
+				"EE386BFB5A899FA5AE9F24117C4B1FE649286651ECE65381FFFFFFFFFFFFFFFF", 2);
+			return &group;
+		}
+		case 2048: {
+			static const dh group(2048,
+				"FFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E088A67CC74020BBEA63B139B22514A08798E3404DD"
+				"EF9519B3CD3A431B302B0A6DF25F14374FE1356D6D51C245E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7ED"
+				"EE386BFB5A899FA5AE9F24117C4B1FE649286651ECE45B3DC2007CB8A163BF0598DA48361C55D39A69163FA8FD24CF5F"
+				"83655D23DCA3AD961C62F356208552BB9ED529077096966D670C354E4ABC9804F1746C08CA18217C32905E462E36CE3B"
+				"E39E772C180E86039B2783A2EC07A28FB5C55DF06F4C52C9DE2BCBF6955817183995497CEA956AE515D2261898FA0510"
+				"15728E5A8AACAA68FFFFFFFFFFFFFFFF", 2);
+			return &group;
+		}
+		case 3072: {
+			static const dh group(3072,
+				"FFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E088A67CC74020BBEA63B139B22514A08798E3404DD"
+				"EF9519B3CD3A431B302B0A6DF25F14374FE1356D6D51C245E485B576625E7EC6F44C42E9A637ED6B0BFF5CB6F406B7ED"
+				"EE386BFB5A899FA5AE9F24117C4B1FE649286651ECE45B3DC2007CB8A163BF0598DA48361C55D39A69163FA8FD24CF5F"
+				"83655D23DCA3AD961C62F356208552BB9ED529077096966D670C354E4ABC9804F1746C08CA18217C32905E462E36CE3B"
+				"E39E772C180E86039B2783A2EC07A28FB5C55DF06F4C52C9DE2BCBF6955817183995497CEA956AE515D2261898FA0510"
+				"15728E5A8AAAC42DAD33170D04507A33A85521ABDF1CBA64ECFB850458DBEF0A8AEA71575D060C7DB3970F85A6E1E4C7"
+				"ABF5AE8CDB0933D71E8C94E04A25619DCEE3D2261AD2EE6BF12FFA06D98A0864D87602733EC86A64521F2B18177B200C"
+				"BBE117577A615D6C770988C0BAD946E208E24FA074E5AB3143DB5BFCE0FD108E4B82D120A93AD2CAFFFFFFFFFFFFFFFF", 2);
+			return &group;
+		}
+		default:
+			return nullptr;
+	}
+}
+
+//What everyone uses unless told otherwise
+#define DEFAULT_DH_BITS 16
 
 struct dh_key {
-	uint16_t x; //Private key
-	uint16_t y; //Public key
+	bignum x; //Private key
+	bignum y; //Public key
 };
 
-//x^n mod q
-uint16_t exp_mod_16(uint16_t x, uint16_t n, uint16_t q) {
-	//This is pretty awful but again, just needs to work
-	uint64_t result = 1;
-	for (uint64_t i = 0; i < n; i ++) {
-		result *= x;
-		result %= q;
+/**
+ * Make a fresh keypair: a random nonzero x below 2^(bits - 1), and y = alpha^x
+ */
+dh_key dh_generate(const dh &group) {
+	dh_key key;
+	size_t limbs = group.mont.limbs();
+	size_t x_bits = group.bits - 1;
+	do {
+		key.x.assign(limbs, 0);
+		rand_bytes(key.x.data(), (x_bits + 63) / 64 * sizeof(U64));
+		if (x_bits % 64 != 0) {
+			key.x[x_bits / 64] &= (1ULL << (x_bits % 64)) - 1;
+		}
+	} while (bignum_bits(key.x) == 0);
+	key.y = group.alpha_powers.pow(key.x);
+	return key;
+}
+
+/**
+ * Whether someone else's public key is worth using: 1 < y < q - 1, so it isn't one of the values
+ * that pins the shared secret to something guessable
+ */
+bool dh_valid_public(const dh &group, const bignum &y) {
+	if (y.size() != group.q.size() || bignum_bits(y) <= 1) {
+		return false;
 	}
-	return static_cast<uint16_t>(result);
+	bignum q_minus_1 = group.q;
+	q_minus_1[0] -= 1;
+	return bignum_less(y, q_minus_1);
+}
+
+//k = y^x mod q
+bignum dh_shared(const dh &group, const bignum &y, const bignum &x) {
+	return group.mont.pow(y, x);
+}
+
+/**
+ * Squash a shared secret down to the 64 bits the ciphers take keys from. For groups up to 64 bits
+ * that's just the secret.
+ */
+uint64_t dh_secret_bits(const bignum &secret) {
+	uint64_t bits = 0;
+	for (U64 limb : secret) {
+		bits ^= limb;
+	}
+	return bits;
+}
+
+/**
+ * Public keys go on the wire as fixed-length big-endian byte strings, the size of q
+ */
+std::vector<U8> dh_encode_public(const dh &group, const bignum &y) {
+	std::vector<U8> bytes(group.bytes());
+	bignum_to_bytes(y, bytes.data(), bytes.size());
+	return bytes;
+}
+
+bignum dh_decode_public(const dh &group, const std::vector<U8> &bytes) {
+	return bignum_from_bytes(bytes.data(), bytes.size(), group.mont.limbs());
 }
 
 #endif //CRYPTO2_DIFFIE_HELLMAN_H
@@ -0,0 +1,103 @@
+//
+// Created by Glenn Smith on 10/10/18.
+//
+
+#ifndef CRYPTO2_EVENT_LOOP_H
+#define CRYPTO2_EVENT_LOOP_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <vector>
+
+//What happened on a socket, handed to the loop's handler
+enum {
+	EVENT_READ = 1,
+	EVENT_WRITE = 2,
+	//Hung up or errored, reading will say which
+	EVENT_CLOSE = 4,
+};
+
+/**
+ * Edge-triggered epoll reactor. Sockets are watched for both reading and writing from the moment
+ * they're added, and only report again once something new happens, so handlers have to read (or
+ * write) until the socket says EAGAIN. Waiting costs the same however many sockets are watched.
+ */
+class epoll_loop {
+	int mFd;
+	std::vector<epoll_event> mEvents;
+
+public:
+	explicit epoll_loop(size_t batch = 256) : mFd(epoll_create1(EPOLL_CLOEXEC)), mEvents(batch) {
+		if (mFd < 0) {
+			perror("epoll_create1");
+		}
+	}
+
+	~epoll_loop() {
+		if (mFd >= 0) {
+			close(mFd);
+		}
+	}
+
+	epoll_loop(const epoll_loop &) = delete;
+	epoll_loop &operator=(const epoll_loop &) = delete;
+
+	bool valid() const {
+		return mFd >= 0;
+	}
+
+	/**
+	 * Start watching a (non-blocking) socket
+	 */
+	int add(int sock) {
+		epoll_event event{};
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.fd = sock;
+		if (epoll_ctl(mFd, EPOLL_CTL_ADD, sock, &event) < 0) {
+			perror("epoll_ctl");
+			return -1;
+		}
+		return 0;
+	}
+
+	/**
+	 * Stop watching a socket. Closing it does this too, but only once every copy of it is closed.
+	 */
+	int remove(int sock) {
+		return epoll_ctl(mFd, EPOLL_CTL_DEL, sock, nullptr);
+	}
+
+	/**
+	 * Wait for at least one socket to be ready and call handler(sock, events) for each one that
+	 * is. Returns how many there were, or < 0 on error (with errno set).
+	 */
+	template<typename Handler>
+	int wait(Handler handler, int timeout = -1) {
+		int count = epoll_wait(mFd, mEvents.data(), static_cast<int>(mEvents.size()), timeout);
+		for (int i = 0; i < count; i ++) {
+			uint32_t flags = mEvents[i].events;
+			int events = 0;
+			if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				events |= EVENT_READ;
+			}
+			if (flags & EPOLLOUT) {
+				events |= EVENT_WRITE;
+			}
+			if (flags & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				events |= EVENT_CLOSE;
+			}
+			handler(mEvents[i].data.fd, events);
+		}
+
+		//Filled the whole batch, so there's probably more waiting next time
+		if (count == static_cast<int>(mEvents.size())) {
+			mEvents.resize(mEvents.size() * 2);
+		}
+		return count;
+	}
+};
+
+#endif //CRYPTO2_EVENT_LOOP_H
@@ -0,0 +1,348 @@
+//
+// Created by Glenn Smith on 10/10/18.
+//
+
+#ifndef CRYPTO2_IO_URING_H
+#define CRYPTO2_IO_URING_H
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+#include "charStream.h"
+
+/**
+ * Completion-based reactor on io_uring, talking to the kernel with the raw syscalls so there's
+ * nothing extra to link. Requests are queued on the submission ring as they come up and only
+ * handed to the kernel when wait() is next called, so a whole batch of completions' worth of
+ * replies goes in with one syscall, which also collects the next batch.
+ *
+ * Accepts and receives are multishot: armed once, they keep completing until something stops
+ * them. Received data lands in a pool of buffers registered with the kernel up front (a provided
+ * buffer ring), so only the receives that actually have data are holding a buffer. Hand each one
+ * back with recycle() once its data has been dealt with.
+ *
+ * Needs a kernel with multishot receive (6.0), which gets checked when the ring is set up; if
+ * anything is missing valid() is false and the caller should use something else.
+ */
+class uring_loop {
+	int mFd;
+
+	//Both rings live in the one mapping
+	void *mRing;
+	size_t mRingSize;
+	unsigned *mSqHead;
+	unsigned *mSqTail;
+	unsigned mSqMask;
+	unsigned *mSqArray;
+	io_uring_sqe *mSqes;
+	size_t mSqesSize;
+	unsigned *mCqHead;
+	unsigned *mCqTail;
+	unsigned mCqMask;
+	io_uring_cqe *mCqes;
+
+	//Submissions queued up since the last io_uring_enter
+	unsigned mQueued;
+
+	//Receive buffers
+	static const U16 buffer_group = 0;
+	io_uring_buf_ring *mBufRing;
+	size_t mBufRingSize;
+	unsigned mBufCount;
+	unsigned mBufSize;
+	std::vector<U8> mBuffers;
+
+	static int enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+		return static_cast<int>(syscall(__NR_io_uring_enter, fd, submit, wait, flags, nullptr, 0));
+	}
+
+	io_uring_sqe *next_sqe() {
+		unsigned tail = *mSqTail;
+		if (tail - __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE) > mSqMask) {
+			//Ring's full, let the kernel have what's there before queueing any more
+			submit();
+		}
+		io_uring_sqe *sqe = &mSqes[tail & mSqMask];
+		memset(sqe, 0, sizeof(*sqe));
+		mSqArray[tail & mSqMask] = tail & mSqMask;
+		__atomic_store_n(mSqTail, tail + 1, __ATOMIC_RELEASE);
+		mQueued ++;
+		return sqe;
+	}
+
+	void provide(unsigned index) {
+		U16 tail = mBufRing->tail;
+		//Not mBufRing->bufs: the kernel header's flexible array has an empty struct in front of it,
+		// which takes up space in C++, so it ends up in the wrong place. The entries start right at
+		// the top of the ring, with the tail overlaid on the first one.
+		io_uring_buf &buf = reinterpret_cast<io_uring_buf *>(mBufRing)[tail & (mBufCount - 1)];
+		buf.addr = reinterpret_cast<U64>(mBuffers.data() + static_cast<size_t>(index) * mBufSize);
+		buf.len = mBufSize;
+		buf.bid = static_cast<U16>(index);
+		__atomic_store_n(&mBufRing->tail, static_cast<U16>(tail + 1), __ATOMIC_RELEASE);
+	}
+
+	bool setup(unsigned entries) {
+		io_uring_params params{};
+		//Multishot requests can have a lot more completions than submissions in flight
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = entries * 4;
+		mFd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+		if (mFd < 0) {
+			return false;
+		}
+		if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+			return false;
+		}
+
+		size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		mRingSize = sqSize > cqSize ? sqSize : cqSize;
+		mRing = mmap(nullptr, mRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQ_RING);
+		if (mRing == MAP_FAILED) {
+			mRing = nullptr;
+			return false;
+		}
+		mSqesSize = params.sq_entries * sizeof(io_uring_sqe);
+		void *sqes = mmap(nullptr, mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED) {
+			return false;
+		}
+		mSqes = static_cast<io_uring_sqe *>(sqes);
+
+		U8 *ring = static_cast<U8 *>(mRing);
+		mSqHead = reinterpret_cast<unsigned *>(ring + params.sq_off.head);
+		mSqTail = reinterpret_cast<unsigned *>(ring + params.sq_off.tail);
+		mSqMask = *reinterpret_cast<unsigned *>(ring + params.sq_off.ring_mask);
+		mSqArray = reinterpret_cast<unsigned *>(ring + params.sq_off.array);
+		mCqHead = reinterpret_cast<unsigned *>(ring + params.cq_off.head);
+		mCqTail = reinterpret_cast<unsigned *>(ring + params.cq_off.tail);
+		mCqMask = *reinterpret_cast<unsigned *>(ring + params.cq_off.ring_mask);
+		mCqes = reinterpret_cast<io_uring_cqe *>(ring + params.cq_off.cqes);
+
+		//Everything we use has to be there
+		std::vector<U8> probeStorage(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+		io_uring_probe *probe = reinterpret_cast<io_uring_probe *>(probeStorage.data());
+		if (syscall(__NR_io_uring_register, mFd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+			return false;
+		}
+		for (int op : {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND}) {
+			if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool setup_buffers(unsigned count, unsigned size) {
+		mBufCount = count;
+		mBufSize = size;
+		mBuffers.resize(static_cast<size_t>(count) * size);
+
+		mBufRingSize = count * sizeof(io_uring_buf);
+		void *bufRing = mmap(nullptr, mBufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (bufRing == MAP_FAILED) {
+			return false;
+		}
+		mBufRing = static_cast<io_uring_buf_ring *>(bufRing);
+		mBufRing->tail = 0;
+
+		io_uring_buf_reg reg{};
+		reg.ring_addr = reinterpret_cast<U64>(mBufRing);
+		reg.ring_entries = count;
+		reg.bgid = buffer_group;
+		if (syscall(__NR_io_uring_register, mFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+			return false;
+		}
+		for (unsigned i = 0; i < count; i ++) {
+			provide(i);
+		}
+		return true;
+	}
+
+	/**
+	 * Older kernels accept the multishot flag and then reject the request, so try it for real on a
+	 * socket pair before committing to it
+	 */
+	bool check_multishot() {
+		int pair[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+			return false;
+		}
+		recv_multishot(pair[0], 0);
+		bool supported = ::send(pair[1], "x", 1, 0) == 1;
+
+		bool done = !supported;
+		while (!done) {
+			if (wait([&](const io_uring_cqe &cqe) {
+				if (cqe.res < 0) {
+					supported = false;
+				} else {
+					recycle(cqe);
+				}
+				done = true;
+			}) < 0 && errno != EINTR) {
+				supported = false;
+				done = true;
+			}
+		}
+		close(pair[0]);
+		close(pair[1]);
+		//Shutting the pair down ends the receive, don't leave its completion for the caller
+		while (supported && enter(mFd, 0, 1, IORING_ENTER_GETEVENTS) >= 0) {
+			bool ended = false;
+			unsigned head = *mCqHead;
+			for (; head != __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE); head ++) {
+				ended |= !(mCqes[head & mCqMask].flags & IORING_CQE_F_MORE);
+			}
+			__atomic_store_n(mCqHead, head, __ATOMIC_RELEASE);
+			if (ended) {
+				break;
+			}
+		}
+		return supported;
+	}
+
+public:
+	explicit uring_loop(unsigned entries = 256, unsigned buffers = 1024, unsigned bufferSize = 4096) :
+		mFd(-1), mRing(nullptr), mRingSize(0), mSqes(nullptr), mSqesSize(0), mQueued(0),
+		mBufRing(nullptr), mBufRingSize(0), mBufCount(0), mBufSize(0) {
+		if (!setup(entries) || !setup_buffers(buffers, bufferSize) || !check_multishot()) {
+			if (mFd >= 0) {
+				close(mFd);
+			}
+			mFd = -1;
+		}
+	}
+
+	~uring_loop() {
+		if (mFd >= 0) {
+			close(mFd);
+		}
+		if (mSqes != nullptr) {
+			munmap(mSqes, mSqesSize);
+		}
+		if (mRing != nullptr) {
+			munmap(mRing, mRingSize);
+		}
+		if (mBufRing != nullptr) {
+			munmap(mBufRing, mBufRingSize);
+		}
+	}
+
+	uring_loop(const uring_loop &) = delete;
+	uring_loop &operator=(const uring_loop &) = delete;
+
+	bool valid() const {
+		return mFd >= 0;
+	}
+
+	/**
+	 * Accept every connection that comes in on a listening socket, each one completing with the
+	 * new socket in res
+	 */
+	void accept_multishot(int sock, U64 userData) {
+		io_uring_sqe *sqe = next_sqe();
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = sock;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_CLOEXEC;
+		sqe->user_data = userData;
+	}
+
+	/**
+	 * Receive whatever arrives on a socket into the buffer pool, each chunk completing with its
+	 * length in res (0 once the other side closes)
+	 */
+	void recv_multishot(int sock, U64 userData) {
+		io_uring_sqe *sqe = next_sqe();
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = sock;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = buffer_group;
+		sqe->user_data = userData;
+	}
+
+	/**
+	 * Send some bytes, which have to stay put until the completion comes back with how many went
+	 */
+	void send(int sock, const U8 *data, size_t length, U64 userData) {
+		io_uring_sqe *sqe = next_sqe();
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = sock;
+		sqe->addr = reinterpret_cast<U64>(data);
+		sqe->len = static_cast<U32>(length);
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sqe->user_data = userData;
+	}
+
+	/**
+	 * Where a receive completion's data is, or nullptr if it didn't get a buffer
+	 */
+	const U8 *buffer(const io_uring_cqe &cqe) const {
+		if (!(cqe.flags & IORING_CQE_F_BUFFER)) {
+			return nullptr;
+		}
+		return mBuffers.data() + static_cast<size_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT) * mBufSize;
+	}
+
+	/**
+	 * Give a receive completion's buffer back to the pool
+	 */
+	void recycle(const io_uring_cqe &cqe) {
+		if (cqe.flags & IORING_CQE_F_BUFFER) {
+			provide(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+		}
+	}
+
+	/**
+	 * Hand everything queued so far to the kernel without waiting
+	 */
+	int submit() {
+		int submitted = enter(mFd, mQueued, 0, 0);
+		if (submitted > 0) {
+			mQueued -= submitted;
+		}
+		return submitted;
+	}
+
+	/**
+	 * Submit everything queued and wait for at least one completion, all in one syscall, then call
+	 * handler(cqe) for every completion there is. Returns how many there were, or < 0 on error
+	 * (with errno set).
+	 */
+	template<typename Handler>
+	int wait(Handler handler) {
+		unsigned head = *mCqHead;
+		if (head == __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE)) {
+			int submitted = enter(mFd, mQueued, 1, IORING_ENTER_GETEVENTS);
+			if (submitted < 0) {
+				return -1;
+			}
+			mQueued -= submitted;
+		} else if (mQueued > 0) {
+			submit();
+		}
+
+		int count = 0;
+		unsigned tail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head ++) {
+			//Copy it out so the slot can be released before the handler queues more work
+			io_uring_cqe cqe = mCqes[head & mCqMask];
+			__atomic_store_n(mCqHead, head + 1, __ATOMIC_RELEASE);
+			handler(cqe);
+			count ++;
+		}
+		return count;
+	}
+};
+
+#endif //CRYPTO2_IO_URING_H
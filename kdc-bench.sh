@@ -0,0 +1,49 @@
+#!/bin/bash
+#
+# Compares the KDC's backends (select, epoll, io_uring) under the same load: syscalls per request
+# and request latency. Each one gets a single shard of server_syscalls (the server with its socket
+# and event loop calls counted, see syscall-count.cpp) with kdc_load pointed at it.
+#
+# Usage: ./kdc-bench.sh [build dir] [clients] [rounds]
+# Build in Release (cmake -DCMAKE_BUILD_TYPE=Release) first. Uses port 12345, so no other KDC can
+# be running.
+
+BUILD=${1:-.}
+CLIENTS=${2:-64}
+ROUNDS=${3:-200}
+
+if [ ! -x "$BUILD/server_syscalls" ] || [ ! -x "$BUILD/kdc_load" ]; then
+	echo "No server_syscalls/kdc_load in $BUILD, build them first" >&2
+	exit 1
+fi
+
+COUNTS=$(mktemp)
+trap 'rm -f "$COUNTS"' EXIT
+
+printf "%-10s %8s %10s %18s %10s %10s\n" backend clients requests syscalls/request "p50 us" "p99 us"
+for BACKEND in select epoll io_uring; do
+	"$BUILD/server_syscalls" $BACKEND 1 > /dev/null 2> "$COUNTS" &
+	SERVER=$!
+	#Wait for it to start listening
+	for i in $(seq 50); do
+		(exec 3<> /dev/tcp/127.0.0.1/12345) 2> /dev/null && break
+		sleep 0.1
+	done
+
+	RESULT=$("$BUILD/kdc_load" $CLIENTS $ROUNDS $SERVER)
+	kill $SERVER
+	wait $SERVER 2> /dev/null
+
+	#Counts from right before and right after the rounds
+	BEFORE=$(grep Syscalls "$COUNTS" | sed -n 1p | awk '{print $2}')
+	AFTER=$(grep Syscalls "$COUNTS" | sed -n 2p | awk '{print $2}')
+	REQUESTS=$(echo "$RESULT" | awk '{print $1}')
+	P50=$(echo "$RESULT" | sed -E 's/.*p50 ([0-9.]+) us.*/\1/')
+	P99=$(echo "$RESULT" | sed -E 's/.*p99 ([0-9.]+) us.*/\1/')
+	if [ -z "$REQUESTS" ] || [ -z "$BEFORE" ] || [ -z "$AFTER" ]; then
+		echo "$BACKEND: run failed" >&2
+		continue
+	fi
+	printf "%-10s %8d %10d %18.3f %10s %10s\n" $BACKEND $CLIENTS $REQUESTS \
+		"$(awk "BEGIN { print ($AFTER - $BEFORE) / $REQUESTS }")" $P50 $P99
+done
@@ -0,0 +1,133 @@
+//
+// Created by Glenn Smith on 10/11/18.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "diffie-hellman.h"
+#include "needham-schroeder.h"
+#include "net.h"
+#include "util.h"
+
+#define KDC_ADDR "127.0.0.1"
+#define KDC_PORT 12345
+
+/**
+ * Load generator for the KDC (see kdc-bench.sh). Registers a number of clients, then runs rounds
+ * where every client asks for a ticket to another one (an NS1) and waits for the NS2, timing each.
+ * Prints how long it all took and the p50 and p99 latency. Given the server's pid, it sends it
+ * SIGUSR2 right before and after the rounds, which server_syscalls answers with its syscall count.
+ *
+ * Usage: kdc_load <clients> <rounds> [server pid]
+ */
+
+struct load_client {
+	int sock;
+	ID id;
+	frame_reader reader;
+};
+
+/**
+ * Connect and register the way a real client does, so the KDC has a key for it
+ */
+int register_client(load_client &c) {
+	if (get_client_sock(KDC_ADDR, KDC_PORT, c.sock, c.id) < 0) {
+		return -1;
+	}
+	set_nodelay(c.sock);
+
+	CharStream hello;
+	if (recv_stream(c.sock, c.reader, hello) != 0 || hello.pop<U8>() != 0) {
+		return -1;
+	}
+	const dh *group = dh_group(hello.pop<U16>());
+	if (group == nullptr) {
+		printf("KDC uses an unsupported DH group\n");
+		return -1;
+	}
+	dh_key key = dh_generate(*group);
+
+	CharStream str;
+	str.push<U8>(0);
+	str.push<ID>(c.id);
+	str.push<std::vector<U8>>(dh_encode_public(*group, key.y));
+	return send_stream(c.sock, str);
+}
+
+int main(int argc, const char **argv) {
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <clients> <rounds> [server pid]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	size_t clients = static_cast<size_t>(atoi(argv[1]));
+	size_t rounds = static_cast<size_t>(atoi(argv[2]));
+	pid_t server = argc > 3 ? static_cast<pid_t>(atoi(argv[3])) : 0;
+	if (clients < 2 || rounds < 1) {
+		fprintf(stderr, "Need at least 2 clients and 1 round\n");
+		return EXIT_FAILURE;
+	}
+
+	raise_fd_limit();
+	std::vector<load_client> load(clients);
+	for (load_client &c : load) {
+		if (register_client(c) < 0) {
+			return EXIT_FAILURE;
+		}
+	}
+	//Registration doesn't get an answer, so give the KDC a moment to get through all of them
+	usleep(300000);
+
+	std::vector<double> latencies;
+	latencies.reserve(clients * rounds);
+	std::vector<std::chrono::steady_clock::time_point> sent(clients);
+
+	if (server > 0) {
+		kill(server, SIGUSR2);
+		usleep(100000);
+	}
+	auto start = std::chrono::steady_clock::now();
+	for (size_t round = 0; round < rounds; round ++) {
+		//Everyone asks at once, then everyone waits for their answer
+		for (size_t a = 0; a < clients; a ++) {
+			NS1 ns1;
+			ns1.id_a = load[a].id;
+			//Someone different each round, never themselves
+			ns1.id_b = load[(a + 1 + round % (clients - 1)) % clients].id;
+			ns1.nonce_1 = static_cast<U8>(round);
+
+			CharStream str;
+			str.push<U8>(1);
+			str.push<NS1>(ns1);
+			sent[a] = std::chrono::steady_clock::now();
+			if (send_stream(load[a].sock, str) < 0) {
+				return EXIT_FAILURE;
+			}
+		}
+		for (size_t a = 0; a < clients; a ++) {
+			CharStream resp;
+			if (recv_stream(load[a].sock, load[a].reader, resp) != 0) {
+				return EXIT_FAILURE;
+			}
+			latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - sent[a]).count());
+		}
+	}
+	double total = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (server > 0) {
+		usleep(100000);
+		kill(server, SIGUSR2);
+		usleep(100000);
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+	printf("%zu requests in %.1f ms (%.0f/s), latency p50 %.1f us p99 %.1f us\n", latencies.size(), total * 1e3,
+	       latencies.size() / total, latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100]);
+
+	for (load_client &c : load) {
+		close(c.sock);
+	}
+	return EXIT_SUCCESS;
+}
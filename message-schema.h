@@ -0,0 +1,334 @@
+//
+// Created by Glenn Smith on 10/10/18.
+//
+
+#ifndef CRYPTO2_MESSAGE_SCHEMA_H
+#define CRYPTO2_MESSAGE_SCHEMA_H
+
+#include <bitset>
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+#include <arpa/inet.h>
+#include "charStream.h"
+
+/**
+ * Wire encoding for one type, straight to and from raw memory. Every codec has:
+ *   fixed                          Whether every value encodes to the same number of bytes
+ *   fixed_size                     That number of bytes (or the minimum, if not fixed)
+ *   size(value)                    Bytes this particular value encodes to
+ *   encode(value, out)             Write it, returning the end of what was written
+ *   decode(value, in, end)         Read it, returning the end of what was read or nullptr if
+ *                                  there weren't enough bytes
+ * The byte layout is the same as pushing the value onto a CharStream.
+ *
+ * Anything without a specialization here is a message, and gets its codec from its schema.
+ */
+template<typename T>
+struct wire_codec;
+
+/**
+ * Integers, little endian like the rest of the wire
+ */
+template<typename T>
+struct integer_codec {
+	static constexpr bool fixed = true;
+	static constexpr size_t fixed_size = sizeof(T);
+
+	static size_t size(const T &value) {
+		return fixed_size;
+	}
+
+	static U8 *encode(const T &value, U8 *out) {
+		T wire = wireOrder(value);
+		memcpy(out, &wire, sizeof(T));
+		return out + sizeof(T);
+	}
+
+	static const U8 *decode(T &value, const U8 *in, const U8 *end) {
+		if (in == nullptr || static_cast<size_t>(end - in) < sizeof(T)) {
+			return nullptr;
+		}
+		T wire;
+		memcpy(&wire, in, sizeof(T));
+		value = wireOrder(wire);
+		return in + sizeof(T);
+	}
+};
+
+template<> struct wire_codec<U8> : integer_codec<U8> {};
+template<> struct wire_codec<U16> : integer_codec<U16> {};
+template<> struct wire_codec<U32> : integer_codec<U32> {};
+template<> struct wire_codec<U64> : integer_codec<U64> {};
+template<> struct wire_codec<S8> : integer_codec<S8> {};
+template<> struct wire_codec<S16> : integer_codec<S16> {};
+template<> struct wire_codec<S32> : integer_codec<S32> {};
+template<> struct wire_codec<S64> : integer_codec<S64> {};
+
+/**
+ * Bitsets are packed little endian into as few bytes as fit
+ */
+template<size_t N>
+struct wire_codec<std::bitset<N>> {
+	static_assert(N <= 64, "Only bitsets that fit in a U64 have a codec");
+
+	static constexpr bool fixed = true;
+	static constexpr size_t fixed_size = (N + 7) / 8;
+
+	static size_t size(const std::bitset<N> &value) {
+		return fixed_size;
+	}
+
+	static U8 *encode(const std::bitset<N> &value, U8 *out) {
+		U64 wire = wireOrder<U64>(value.to_ullong());
+		memcpy(out, &wire, fixed_size);
+		return out + fixed_size;
+	}
+
+	static const U8 *decode(std::bitset<N> &value, const U8 *in, const U8 *end) {
+		if (in == nullptr || static_cast<size_t>(end - in) < fixed_size) {
+			return nullptr;
+		}
+		U64 wire = 0;
+		memcpy(&wire, in, fixed_size);
+		value = std::bitset<N>(wireOrder(wire));
+		return in + fixed_size;
+	}
+};
+
+/**
+ * IDs: family in wire order, port and address already in network order, then the padding
+ */
+template<>
+struct wire_codec<sockaddr_in> {
+	static constexpr bool fixed = true;
+	static constexpr size_t fixed_size = 2 + sizeof(in_port_t) + sizeof(in_addr) + sizeof(((sockaddr_in *)nullptr)->sin_zero);
+
+	static size_t size(const sockaddr_in &value) {
+		return fixed_size;
+	}
+
+	static U8 *encode(const sockaddr_in &value, U8 *out) {
+		out = wire_codec<U16>::encode(value.sin_family, out);
+		memcpy(out, &value.sin_port, sizeof(value.sin_port));
+		out += sizeof(value.sin_port);
+		memcpy(out, &value.sin_addr, sizeof(value.sin_addr));
+		out += sizeof(value.sin_addr);
+		memcpy(out, &value.sin_zero, sizeof(value.sin_zero));
+		return out + sizeof(value.sin_zero);
+	}
+
+	static const U8 *decode(sockaddr_in &value, const U8 *in, const U8 *end) {
+		if (in == nullptr || static_cast<size_t>(end - in) < fixed_size) {
+			return nullptr;
+		}
+		value = sockaddr_in{};
+		U16 family;
+		in = wire_codec<U16>::decode(family, in, end);
+		value.sin_family = family;
+		memcpy(&value.sin_port, in, sizeof(value.sin_port));
+		in += sizeof(value.sin_port);
+		memcpy(&value.sin_addr, in, sizeof(value.sin_addr));
+		in += sizeof(value.sin_addr);
+		memcpy(&value.sin_zero, in, sizeof(value.sin_zero));
+		return in + sizeof(value.sin_zero);
+	}
+};
+
+/**
+ * Byte buffers (eg. encrypted blocks): <16-bit length><bytes>. The only variable length field.
+ */
+template<>
+struct wire_codec<std::vector<U8>> {
+	static constexpr bool fixed = false;
+	static constexpr size_t fixed_size = 2;
+
+	static size_t size(const std::vector<U8> &value) {
+		return fixed_size + value.size();
+	}
+
+	static U8 *encode(const std::vector<U8> &value, U8 *out) {
+		out = wire_codec<U16>::encode(static_cast<U16>(value.size()), out);
+		memcpy(out, value.data(), value.size());
+		return out + value.size();
+	}
+
+	static const U8 *decode(std::vector<U8> &value, const U8 *in, const U8 *end) {
+		U16 length;
+		in = wire_codec<U16>::decode(length, in, end);
+		if (in == nullptr || static_cast<size_t>(end - in) < length) {
+			return nullptr;
+		}
+		value.assign(in, in + length);
+		return in + length;
+	}
+};
+
+/**
+ * One field of a message, by member pointer
+ */
+template<typename Message, typename Type, Type Message::*Member>
+struct field {
+	typedef wire_codec<Type> codec;
+
+	static constexpr bool fixed = codec::fixed;
+	static constexpr size_t fixed_size = codec::fixed_size;
+
+	static size_t size(const Message &message) {
+		return codec::size(message.*Member);
+	}
+
+	static U8 *encode(const Message &message, U8 *out) {
+		return codec::encode(message.*Member, out);
+	}
+
+	static const U8 *decode(Message &message, const U8 *in, const U8 *end) {
+		return codec::decode(message.*Member, in, end);
+	}
+};
+
+/**
+ * Ordered list of fields making up a message, encoded back to back
+ */
+template<typename... Fields>
+struct fields;
+
+template<>
+struct fields<> {
+	static constexpr bool fixed = true;
+	static constexpr size_t fixed_size = 0;
+
+	template<typename Message>
+	static size_t size(const Message &message) {
+		return 0;
+	}
+
+	template<typename Message>
+	static U8 *encode(const Message &message, U8 *out) {
+		return out;
+	}
+
+	template<typename Message>
+	static const U8 *decode(Message &message, const U8 *in, const U8 *end) {
+		return in;
+	}
+};
+
+template<typename First, typename... Rest>
+struct fields<First, Rest...> {
+	static constexpr bool fixed = First::fixed && fields<Rest...>::fixed;
+	static constexpr size_t fixed_size = First::fixed_size + fields<Rest...>::fixed_size;
+
+	template<typename Message>
+	static size_t size(const Message &message) {
+		return fixed ? fixed_size : First::size(message) + fields<Rest...>::size(message);
+	}
+
+	template<typename Message>
+	static U8 *encode(const Message &message, U8 *out) {
+		return fields<Rest...>::encode(message, First::encode(message, out));
+	}
+
+	template<typename Message>
+	static const U8 *decode(Message &message, const U8 *in, const U8 *end) {
+		//Fixed size messages only need the one bounds check up front
+		if (fixed && (in == nullptr || static_cast<size_t>(end - in) < fixed_size)) {
+			return nullptr;
+		}
+		return fields<Rest...>::decode(message, First::decode(message, in, end), end);
+	}
+};
+
+/**
+ * Schema for a message type: specialize this with a `typedef fields<...> type;` listing the
+ * message's fields in wire order, and the message gets a codec and CharStream push/pop for free.
+ */
+template<typename Message>
+struct message_schema;
+
+template<typename Message>
+struct wire_codec {
+	typedef typename message_schema<Message>::type schema;
+
+	static constexpr bool fixed = schema::fixed;
+	static constexpr size_t fixed_size = schema::fixed_size;
+
+	static size_t size(const Message &message) {
+		return schema::size(message);
+	}
+
+	static U8 *encode(const Message &message, U8 *out) {
+		return schema::encode(message, out);
+	}
+
+	static const U8 *decode(Message &message, const U8 *in, const U8 *end) {
+		return schema::decode(message, in, end);
+	}
+};
+
+/**
+ * Encoded size of a fixed-size message, known at compile time so it can size a stack buffer
+ */
+template<typename T>
+struct wire_size {
+	static_assert(wire_codec<T>::fixed, "Message has a variable length field");
+	static constexpr size_t value = wire_codec<T>::fixed_size;
+};
+
+/**
+ * Encode a whole value into a preallocated buffer in one go, returning the bytes written
+ */
+template<typename T>
+size_t encode_message(const T &value, U8 *out) {
+	return wire_codec<T>::encode(value, out) - out;
+}
+
+/**
+ * Decode a whole value from a buffer, returning the bytes read or 0 if there weren't enough
+ */
+template<typename T>
+size_t decode_message(T &value, const U8 *in, size_t length) {
+	const U8 *end = wire_codec<T>::decode(value, in, in + length);
+	return end == nullptr ? 0 : end - in;
+}
+
+//Anything CharStream doesn't have its own specialization for goes through its codec
+
+template<typename T>
+T CharStream::push(const T &value) {
+	size_t size = wire_codec<T>::size(value);
+	encode_message<T>(value, prepareWrite(size));
+	return value;
+}
+
+template<typename T>
+T CharStream::pop() {
+	//Through the const data() so a view gets decoded in place rather than copied
+	const CharStream &self = *this;
+	T value{};
+	size_t read = decode_message<T>(value, self.data(), size());
+	if (read == 0 && wire_codec<T>::fixed_size > 0) {
+		assert(false);
+		return value;
+	}
+	consume(read);
+	return value;
+}
+
+/**
+ * Pop a value off a stream only if there's a whole one there, for anything off the network that
+ * can't be trusted to be well formed. pop() asserts instead. Returns false, having popped
+ * nothing, if it's cut short.
+ */
+template<typename T>
+bool pop_message(CharStream &cs, T &value) {
+	const CharStream &self = cs;
+	size_t read = decode_message<T>(value, self.data(), cs.size());
+	if (read == 0 && wire_codec<T>::fixed_size > 0) {
+		return false;
+	}
+	cs.consume(read);
+	return true;
+}
+
+#endif //CRYPTO2_MESSAGE_SCHEMA_H
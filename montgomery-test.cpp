@@ -0,0 +1,234 @@
+//
+// Created by Glenn Smith on 10/11/18.
+//
+
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include "diffie-hellman.h"
+
+/**
+ * Checks the Montgomery arithmetic (montgomery.h) and the Diffie-Hellman built on it against a
+ * plain square-and-multiply that never leaves normal form: every power of alpha in the original
+ * 16-bit group, 64-bit moduli against unsigned __int128, multi-limb moduli up to max_limbs
+ * (including the 1024-bit MODP prime) for both the general and the fixed-base powers, and keypairs
+ * and shared secrets from the 16, 64 and 1024-bit groups. Inputs come from a fixed seed so a failure can be run again.
+ */
+
+size_t mismatches = 0;
+size_t checked = 0;
+
+std::mt19937_64 generator(2409);
+
+void print_hex(const bignum &value) {
+	for (size_t i = value.size(); i -- > 0; ) {
+		fprintf(stderr, "%016llx", static_cast<unsigned long long>(value[i]));
+	}
+}
+
+//Counts it if Montgomery and the reference disagree
+void check(const char *name, const bignum &output, const bignum &expected) {
+	checked ++;
+	if (output != expected) {
+		if (mismatches < 10) {
+			fprintf(stderr, "%s gave ", name);
+			print_hex(output);
+			fprintf(stderr, ", expected ");
+			print_hex(expected);
+			fprintf(stderr, "\n");
+		}
+		mismatches ++;
+	}
+}
+
+/**
+ * sum = sum + b mod m, for sum, b < m
+ */
+void reference_add(bignum &sum, const bignum &b, const bignum &m) {
+	//Through pointers, so an unoptimized build doesn't spend all its time in operator[]
+	U64 *out = sum.data();
+	const U64 *in = b.data();
+	const U64 *modulus = m.data();
+	U64 carry = 0;
+	for (size_t i = 0; i < m.size(); i ++) {
+		unsigned __int128 limb = static_cast<unsigned __int128>(out[i]) + in[i] + carry;
+		out[i] = static_cast<U64>(limb);
+		carry = static_cast<U64>(limb >> 64);
+	}
+	if (carry || !bignum_less(sum, m)) {
+		U64 borrow = 0;
+		for (size_t i = 0; i < m.size(); i ++) {
+			unsigned __int128 limb = static_cast<unsigned __int128>(out[i]) - modulus[i] - borrow;
+			out[i] = static_cast<U64>(limb);
+			borrow = static_cast<U64>(limb >> 64) & 1;
+		}
+	}
+}
+
+/**
+ * a * b mod m by doubling and adding, a bit of b at a time
+ */
+bignum reference_mul(const bignum &a, const bignum &b, const bignum &m) {
+	bignum product(m.size(), 0);
+	for (size_t bit = bignum_bits(b); bit -- > 0; ) {
+		reference_add(product, product, m);
+		if ((b[bit / 64] >> (bit % 64)) & 1) {
+			reference_add(product, a, m);
+		}
+	}
+	return product;
+}
+
+/**
+ * base^exponent mod m, square-and-multiply from the top bit
+ */
+bignum reference_pow(const bignum &base, const bignum &exponent, const bignum &m) {
+	bignum result(m.size(), 0);
+	result[0] = 1;
+	for (size_t bit = bignum_bits(exponent); bit -- > 0; ) {
+		result = reference_mul(result, result, m);
+		if ((exponent[bit / 64] >> (bit % 64)) & 1) {
+			result = reference_mul(result, base, m);
+		}
+	}
+	return result;
+}
+
+/**
+ * Random number below m, with the same number of limbs
+ */
+bignum random_below(const bignum &m) {
+	bignum value(m.size());
+	do {
+		for (U64 &limb : value) {
+			limb = generator();
+		}
+		if (m.back() != ~0ULL) {
+			value.back() %= m.back() + 1;
+		}
+	} while (!bignum_less(value, m));
+	return value;
+}
+
+/**
+ * Random number of at most bits bits, in limbs limbs
+ */
+bignum random_bits(size_t bits, size_t limbs) {
+	bignum value(limbs, 0);
+	for (size_t i = 0; i < limbs && i * 64 < bits; i ++) {
+		value[i] = generator();
+		if (bits - i * 64 < 64) {
+			value[i] &= (1ULL << (bits - i * 64)) - 1;
+		}
+	}
+	return value;
+}
+
+/**
+ * General and fixed-base powers modulo m against the reference, for exponents up to
+ * exponentBits bits (the reference is slow enough that big moduli only get short exponents)
+ */
+void check_modulus(const char *name, const bignum &m, size_t exponentBits, int count) {
+	montgomery mont(m);
+	bignum base = random_below(m);
+	mont_fixed_base powers(mont, base, exponentBits);
+	for (int i = 0; i < count; i ++) {
+		bignum exponent = random_bits(exponentBits, m.size());
+		bignum expected = reference_pow(base, exponent, m);
+		check(name, mont.pow(base, exponent), expected);
+		check(name, powers.pow(exponent), expected);
+
+		bignum other = random_below(m);
+		check(name, mont.pow(other, exponent), reference_pow(other, exponent, m));
+	}
+	//Nothing but the top bit, and nothing at all
+	bignum top(m.size(), 0);
+	top[(exponentBits - 1) / 64] = 1ULL << ((exponentBits - 1) % 64);
+	check(name, mont.pow(base, top), reference_pow(base, top, m));
+	check(name, powers.pow(top), reference_pow(base, top, m));
+	bignum zero(m.size(), 0);
+	check(name, mont.pow(base, zero), reference_pow(base, zero, m));
+	check(name, powers.pow(zero), reference_pow(base, zero, m));
+}
+
+int main() {
+	//The homework group: every exponent, against the repeated multiplication it started out as
+	const dh *group16 = dh_group(16);
+	U64 power = 1;
+	for (U64 x = 0; x < 15373; x ++) {
+		bignum exponent(1, x);
+		check("16-bit alpha^x", group16->alpha_powers.pow(exponent), bignum(1, power));
+		if (x % 7 == 0) {
+			check("16-bit pow", group16->mont.pow(group16->alpha, exponent), bignum(1, power));
+		}
+		power = power * 129 % 15373;
+	}
+
+	//One limb against unsigned __int128, including moduli right up against 2^64
+	for (int i = 0; i < 200; i ++) {
+		U64 modulus = generator() | 1;
+		if (i % 4 == 0) {
+			modulus |= 0xFFFFFFFF00000000ULL;
+		} else if (i % 4 == 1) {
+			modulus >>= generator() % 60;
+			modulus |= 1;
+		}
+		if (modulus == 1) {
+			continue;
+		}
+		montgomery mont(bignum(1, modulus));
+		U64 base = generator() % modulus;
+		U64 exponent = generator();
+		U64 expected = 1;
+		for (int bit = 63; bit >= 0; bit --) {
+			expected = static_cast<U64>(static_cast<unsigned __int128>(expected) * expected % modulus);
+			if ((exponent >> bit) & 1) {
+				expected = static_cast<U64>(static_cast<unsigned __int128>(expected) * base % modulus);
+			}
+		}
+		check("64-bit pow", mont.pow(bignum(1, base), bignum(1, exponent)), bignum(1, expected));
+	}
+
+	//Random odd moduli of a few limbs, and the MODP primes
+	for (size_t limbs = 2; limbs <= 4; limbs ++) {
+		bignum m = random_bits(64 * limbs, limbs);
+		m[0] |= 1;
+		m.back() |= 1ULL << 63;
+		check_modulus("multi-limb pow", m, 64 * limbs, 5);
+		for (U64 &limb : m) {
+			limb = ~0ULL;
+		}
+		check_modulus("all-ones pow", m, 64 * limbs, 2);
+	}
+	check_modulus("1024-bit MODP pow", dh_group(1024)->q, 128, 2);
+	//Up to the largest modulus there's room for, with exponents short enough for the reference
+	const size_t big_limbs[] = {16, 32, montgomery::max_limbs};
+	for (size_t limbs : big_limbs) {
+		bignum m = random_bits(64 * limbs, limbs);
+		m[0] |= 1;
+		m.back() |= 1ULL << 63;
+		check_modulus("big modulus pow", m, 16, 1);
+	}
+
+	//Keypairs and shared secrets, with both sides of the exchange agreeing. Full-size private keys
+	//are too much for the reference past 64 bits, so there the public key is checked against the
+	//general power instead of the fixed-base tables it came from (both were checked above). The
+	//bigger groups are the same code with more limbs, and take a while to set up.
+	const unsigned sizes[] = {16, 64, 1024};
+	for (unsigned bits : sizes) {
+		const dh *group = dh_group(bits);
+		dh_key a = dh_generate(*group);
+		dh_key b = dh_generate(*group);
+		bignum shared = dh_shared(*group, b.y, a.x);
+		check("DH shared", dh_shared(*group, a.y, b.x), shared);
+		if (bits <= 64) {
+			check("DH public", a.y, reference_pow(group->alpha, a.x, group->q));
+			check("DH shared", shared, reference_pow(b.y, a.x, group->q));
+		} else {
+			check("DH public", a.y, group->mont.pow(group->alpha, a.x));
+		}
+	}
+
+	printf("Checked %zu Montgomery powers against the reference: %zu mismatches\n", checked, mismatches);
+	return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,296 @@
+//
+// Created by Glenn Smith on 10/11/18.
+//
+
+#ifndef CRYPTO2_MONTGOMERY_H
+#define CRYPTO2_MONTGOMERY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "charStream.h"
+
+/**
+ * Big unsigned integer as 64-bit limbs, least significant first. Everything modulo one modulus
+ * uses the same number of limbs as the modulus, zero padded.
+ */
+typedef std::vector<U64> bignum;
+
+/**
+ * Parse big-endian hex, eg. an RFC group prime, into limbs
+ */
+bignum bignum_from_hex(const char *hex, size_t limbs) {
+	bignum value(limbs, 0);
+	size_t digits = strlen(hex);
+	for (size_t i = 0; i < digits && i / 16 < limbs; i ++) {
+		char c = hex[digits - 1 - i];
+		U64 nibble = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : c - 'A' + 10;
+		value[i / 16] |= nibble << (4 * (i % 16));
+	}
+	return value;
+}
+
+/**
+ * Read a big-endian byte string (how numbers go on the wire) into limbs
+ */
+bignum bignum_from_bytes(const U8 *bytes, size_t length, size_t limbs) {
+	bignum value(limbs, 0);
+	for (size_t i = 0; i < length && i / 8 < limbs; i ++) {
+		value[i / 8] |= static_cast<U64>(bytes[length - 1 - i]) << (8 * (i % 8));
+	}
+	return value;
+}
+
+/**
+ * Write the low length bytes of a number out big-endian
+ */
+void bignum_to_bytes(const bignum &value, U8 *bytes, size_t length) {
+	for (size_t i = 0; i < length; i ++) {
+		bytes[length - 1 - i] = i / 8 < value.size() ? static_cast<U8>(value[i / 8] >> (8 * (i % 8))) : 0;
+	}
+}
+
+/**
+ * a < b, for numbers with the same number of limbs. Not constant time, only for public values.
+ */
+bool bignum_less(const bignum &a, const bignum &b) {
+	for (size_t i = a.size(); i -- > 0; ) {
+		if (a[i] != b[i]) {
+			return a[i] < b[i];
+		}
+	}
+	return false;
+}
+
+size_t bignum_bits(const bignum &value) {
+	for (size_t i = value.size(); i -- > 0; ) {
+		if (value[i] != 0) {
+			return i * 64 + 64 - __builtin_clzll(value[i]);
+		}
+	}
+	return 0;
+}
+
+/**
+ * Arithmetic modulo an odd number in Montgomery form: x is kept as xR mod m with R = 2^(64 *
+ * limbs), which turns every reduction into multiplies and shifts instead of a division. The
+ * multiply and exponentiation take the same time and touch the same memory whatever the values,
+ * so the private exponents going through them don't leak through timing.
+ */
+class montgomery {
+public:
+	//Enough for a 4096-bit modulus
+	static const size_t max_limbs = 64;
+
+private:
+	size_t mLimbs;
+	bignum mModulus;
+	//-m^-1 mod 2^64
+	U64 mInverse;
+	//R mod m (one, in Montgomery form) and R^2 mod m (for converting into it)
+	bignum mOne;
+	bignum mR2;
+
+	/**
+	 * value = 2 * value mod m, for setting up R mod m. Only ever sees public values.
+	 */
+	void double_mod(bignum &value) const {
+		U64 carry = 0;
+		for (size_t i = 0; i < mLimbs; i ++) {
+			U64 next = value[i] >> 63;
+			value[i] = (value[i] << 1) | carry;
+			carry = next;
+		}
+		if (carry || !bignum_less(value, mModulus)) {
+			U64 borrow = 0;
+			for (size_t i = 0; i < mLimbs; i ++) {
+				unsigned __int128 diff = static_cast<unsigned __int128>(value[i]) - mModulus[i] - borrow;
+				value[i] = static_cast<U64>(diff);
+				borrow = static_cast<U64>(diff >> 64) & 1;
+			}
+		}
+	}
+
+public:
+	/**
+	 * Set up for an odd modulus of at most max_limbs limbs
+	 */
+	explicit montgomery(const bignum &modulus) : mLimbs(modulus.size()), mModulus(modulus) {
+		//Newton's method, each step doubles the number of correct low bits
+		U64 inverse = 1;
+		for (int i = 0; i < 6; i ++) {
+			inverse *= 2 - mModulus[0] * inverse;
+		}
+		mInverse = ~inverse + 1;
+
+		mOne.assign(mLimbs, 0);
+		mOne[0] = 1;
+		for (size_t i = 0; i < 64 * mLimbs; i ++) {
+			double_mod(mOne);
+		}
+		mR2 = mOne;
+		for (size_t i = 0; i < 64 * mLimbs; i ++) {
+			double_mod(mR2);
+		}
+	}
+
+	size_t limbs() const {
+		return mLimbs;
+	}
+
+	const bignum &modulus() const {
+		return mModulus;
+	}
+
+	const bignum &one() const {
+		return mOne;
+	}
+
+	/**
+	 * out = a * b / R mod m (coarsely integrated operand scanning). out may be a or b.
+	 */
+	void mul(const U64 *a, const U64 *b, U64 *out) const {
+		U64 t[max_limbs + 2];
+		memset(t, 0, (mLimbs + 2) * sizeof(U64));
+		const U64 *m = mModulus.data();
+
+		for (size_t i = 0; i < mLimbs; i ++) {
+			U64 carry = 0;
+			for (size_t j = 0; j < mLimbs; j ++) {
+				unsigned __int128 sum = static_cast<unsigned __int128>(a[j]) * b[i] + t[j] + carry;
+				t[j] = static_cast<U64>(sum);
+				carry = static_cast<U64>(sum >> 64);
+			}
+			unsigned __int128 top = static_cast<unsigned __int128>(t[mLimbs]) + carry;
+			t[mLimbs] = static_cast<U64>(top);
+			t[mLimbs + 1] = static_cast<U64>(top >> 64);
+
+			//Add the multiple of m that clears the bottom limb, then shift it away
+			U64 factor = t[0] * mInverse;
+			unsigned __int128 sum = static_cast<unsigned __int128>(factor) * m[0] + t[0];
+			carry = static_cast<U64>(sum >> 64);
+			for (size_t j = 1; j < mLimbs; j ++) {
+				sum = static_cast<unsigned __int128>(factor) * m[j] + t[j] + carry;
+				t[j - 1] = static_cast<U64>(sum);
+				carry = static_cast<U64>(sum >> 64);
+			}
+			top = static_cast<unsigned __int128>(t[mLimbs]) + carry;
+			t[mLimbs - 1] = static_cast<U64>(top);
+			t[mLimbs] = t[mLimbs + 1] + static_cast<U64>(top >> 64);
+		}
+
+		//t < 2m, subtract m once if it's over, without branching on it
+		U64 reduced[max_limbs];
+		U64 borrow = 0;
+		for (size_t j = 0; j < mLimbs; j ++) {
+			unsigned __int128 diff = static_cast<unsigned __int128>(t[j]) - m[j] - borrow;
+			reduced[j] = static_cast<U64>(diff);
+			borrow = static_cast<U64>(diff >> 64) & 1;
+		}
+		//Keep t only if the subtraction went negative and there was nothing above the top limb
+		U64 keep = ~(static_cast<U64>(t[mLimbs] == 0 && borrow == 1) - 1);
+		for (size_t j = 0; j < mLimbs; j ++) {
+			out[j] = (t[j] & keep) | (reduced[j] & ~keep);
+		}
+	}
+
+	bignum to_mont(const bignum &value) const {
+		bignum out(mLimbs);
+		mul(value.data(), mR2.data(), out.data());
+		return out;
+	}
+
+	bignum from_mont(const bignum &value) const {
+		bignum plain_one(mLimbs, 0);
+		plain_one[0] = 1;
+		bignum out(mLimbs);
+		mul(value.data(), plain_one.data(), out.data());
+		return out;
+	}
+
+	/**
+	 * Copy table[index] (each entry limbs() long) to out, reading every entry so which one it was
+	 * doesn't show in the cache
+	 */
+	void select(const U64 *table, size_t entries, size_t index, U64 *out) const {
+		memset(out, 0, mLimbs * sizeof(U64));
+		for (size_t e = 0; e < entries; e ++) {
+			U64 mask = ~(static_cast<U64>(e == index) - 1);
+			for (size_t j = 0; j < mLimbs; j ++) {
+				out[j] |= table[e * mLimbs + j] & mask;
+			}
+		}
+	}
+
+	/**
+	 * base^exponent mod m, all in plain (not Montgomery) form. Fixed 4-bit windows over every
+	 * limb of the exponent, so it's the same squarings and multiplies for any exponent that size.
+	 */
+	bignum pow(const bignum &base, const bignum &exponent) const {
+		//base^0 ... base^15
+		std::vector<U64> table(16 * mLimbs);
+		memcpy(&table[0], mOne.data(), mLimbs * sizeof(U64));
+		bignum base_mont = to_mont(base);
+		memcpy(&table[mLimbs], base_mont.data(), mLimbs * sizeof(U64));
+		for (size_t d = 2; d < 16; d ++) {
+			mul(&table[(d - 1) * mLimbs], base_mont.data(), &table[d * mLimbs]);
+		}
+
+		bignum result = mOne;
+		bignum factor(mLimbs);
+		for (size_t window = exponent.size() * 16; window -- > 0; ) {
+			for (int i = 0; i < 4; i ++) {
+				mul(result.data(), result.data(), result.data());
+			}
+			size_t digit = (exponent[window / 16] >> (4 * (window % 16))) & 0xF;
+			select(table.data(), 16, digit, factor.data());
+			mul(result.data(), factor.data(), result.data());
+		}
+		return from_mont(result);
+	}
+};
+
+/**
+ * Powers of one fixed base, precomputed for every 4-bit window of the exponent: table[w][d] =
+ * base^(d * 16^w). A power is then one (constant time) lookup and multiply per window, with no
+ * squaring at all, which is most of the work in a general exponentiation.
+ */
+class mont_fixed_base {
+	const montgomery &mMont;
+	size_t mWindows;
+	std::vector<U64> mTable;
+
+public:
+	mont_fixed_base(const montgomery &mont, const bignum &base, size_t exponentBits) : mMont(mont),
+		mWindows((exponentBits + 3) / 4), mTable(mWindows * 16 * mont.limbs()) {
+		size_t limbs = mont.limbs();
+		bignum window_base = mont.to_mont(base);
+		for (size_t w = 0; w < mWindows; w ++) {
+			U64 *entries = &mTable[w * 16 * limbs];
+			memcpy(entries, mont.one().data(), limbs * sizeof(U64));
+			for (size_t d = 1; d < 16; d ++) {
+				mont.mul(&entries[(d - 1) * limbs], window_base.data(), &entries[d * limbs]);
+			}
+			//base^(16^(w + 1)) is the next window's base
+			mont.mul(&entries[15 * limbs], window_base.data(), window_base.data());
+		}
+	}
+
+	/**
+	 * base^exponent mod m, for exponents up to the size this was made for
+	 */
+	bignum pow(const bignum &exponent) const {
+		size_t limbs = mMont.limbs();
+		bignum result = mMont.one();
+		bignum factor(limbs);
+		for (size_t w = 0; w < mWindows; w ++) {
+			size_t digit = w / 16 < exponent.size() ? (exponent[w / 16] >> (4 * (w % 16))) & 0xF : 0;
+			mMont.select(&mTable[w * 16 * limbs], 16, digit, factor.data());
+			mMont.mul(result.data(), factor.data(), result.data());
+		}
+		return mMont.from_mont(result);
+	}
+};
+
+#endif //CRYPTO2_MONTGOMERY_H
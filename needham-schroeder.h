@@ -7,8 +7,10 @@
 
 #include <arpa/inet.h>
 #include <bitset>
-#include "des.h"
+#include <string.h>
 #include "charStream.h"
+#include "cipher-backend.h"
+#include "message-schema.h"
 
 typedef struct sockaddr_in ID;
 typedef std::vector<U8> encrypt_buf;
@@ -20,7 +22,7 @@ struct NS1 {
 };
 
 struct NS2 {
-	std::bitset<10> session_key;
+	cipher_key session_key;
 	ID id_b;
 	uint8_t nonce_1;
 	uint64_t timestamp;
@@ -28,7 +30,7 @@ struct NS2 {
 };
 
 struct NS3 {
-	std::bitset<10> session_key;
+	cipher_key session_key;
 	ID id_a;
 	uint64_t timestamp;
 };
@@ -45,130 +47,141 @@ uint8_t nonce_2_fn(uint8_t nonce_2) {
 	return ~nonce_2;
 }
 
-template<>
-encrypt_buf CharStream::push(const encrypt_buf &value) {
-	push<uint16_t>(value.size());
-	for (U8 byte : value) {
-		push<uint8_t>(byte);
-	}
-	return value;
-}
+//Wire layout of each message, in order. Everything but NS2 is fixed size.
 
 template<>
-encrypt_buf CharStream::pop() {
-	encrypt_buf value;
-	uint16_t size = pop<uint16_t>();
-	value.reserve(size);
-	for (int i = 0; i < size; i ++) {
-		value.push_back(pop<uint8_t>());
-	}
-	return value;
-}
+struct message_schema<NS1> {
+	typedef fields<
+		field<NS1, ID, &NS1::id_a>,
+		field<NS1, ID, &NS1::id_b>,
+		field<NS1, uint8_t, &NS1::nonce_1>
+	> type;
+};
 
 template<>
-NS1 CharStream::push(const NS1 &value) {
-	push<sockaddr_in>(value.id_a);
-	push<sockaddr_in>(value.id_b);
-	push<uint8_t>(value.nonce_1);
-	return value;
-}
+struct message_schema<NS2> {
+	typedef fields<
+		field<NS2, cipher_key, &NS2::session_key>,
+		field<NS2, ID, &NS2::id_b>,
+		field<NS2, uint8_t, &NS2::nonce_1>,
+		field<NS2, uint64_t, &NS2::timestamp>,
+		field<NS2, encrypt_buf, &NS2::encrypt_ns3>
+	> type;
+};
 
 template<>
-NS1 CharStream::pop() {
-	NS1 value{};
-	value.id_a = pop<sockaddr_in>();
-	value.id_b = pop<sockaddr_in>();
-	value.nonce_1 = pop<uint8_t>();
-	return value;
-}
+struct message_schema<NS3> {
+	typedef fields<
+		field<NS3, cipher_key, &NS3::session_key>,
+		field<NS3, ID, &NS3::id_a>,
+		field<NS3, uint64_t, &NS3::timestamp>
+	> type;
+};
 
 template<>
-NS2 CharStream::push(const NS2 &value) {
-	push<10>(value.session_key);
-	push<ID>(value.id_b);
-	push<uint8_t>(value.nonce_1);
-	push<uint64_t>(value.timestamp);
-	push<encrypt_buf>(value.encrypt_ns3);
-	return value;
-}
+struct message_schema<NS4> {
+	typedef fields<
+		field<NS4, uint8_t, &NS4::nonce_2>
+	> type;
+};
 
 template<>
-NS2 CharStream::pop() {
-	NS2 value{};
-	value.session_key = pop<10>();
-	value.id_b = pop<ID>();
-	value.nonce_1 = pop<uint8_t>();
-	value.timestamp = pop<uint64_t>();
-	value.encrypt_ns3 = pop<encrypt_buf>();
-	return value;
-}
+struct message_schema<NS5> {
+	typedef fields<
+		field<NS5, uint8_t, &NS5::f_nonce_2>
+	> type;
+};
 
-template<>
-NS3 CharStream::push(const NS3 &value) {
-	push<10>(value.session_key);
-	push<ID>(value.id_a);
-	push<uint64_t>(value.timestamp);
-	return value;
-}
+/**
+ * Size of a message once it's been encrypted and padded out to the cipher's block size
+ */
+template<typename T>
+struct encrypted_size {
+	static constexpr size_t value = (wire_size<T>::value + session_cipher::block_size - 1) / session_cipher::block_size * session_cipher::block_size;
+};
 
-template<>
-NS3 CharStream::pop() {
-	NS3 value{};
-	value.session_key = pop<10>();
-	value.id_a = pop<ID>();
-	value.timestamp = pop<uint64_t>();
-	return value;
+/**
+ * Encrypt a fixed-size message into a preallocated buffer of encrypted_size<T> bytes, eg. on the
+ * stack. Padded with zeros out to the cipher's block size, which is harmless since decoding only
+ * ever reads as much as the message needs.
+ */
+template<typename T>
+size_t encrypt(const T &thing, const cipher_key &key, U8 *out) {
+	size_t length = encode_message<T>(thing, out);
+	memset(out + length, 0, encrypted_size<T>::value - length);
+	session_cipher::encrypt(out, encrypted_size<T>::value, key);
+	return encrypted_size<T>::value;
 }
 
-template<>
-NS4 CharStream::push(const NS4 &value) {
-	push<uint8_t>(value.nonce_2);
-	return value;
+/**
+ * Encrypt into an existing buffer, reusing its storage so there's no allocation once it has
+ * grown to fit
+ */
+template<typename T>
+void encrypt(const T &thing, const cipher_key &key, encrypt_buf &encrypted) {
+	size_t length = wire_codec<T>::size(thing);
+	size_t padded = (length + session_cipher::block_size - 1) / session_cipher::block_size * session_cipher::block_size;
+	encrypted.resize(padded);
+	encode_message<T>(thing, encrypted.data());
+	memset(encrypted.data() + length, 0, padded - length);
+
+	session_cipher::encrypt(encrypted.data(), encrypted.size(), key);
 }
 
-template<>
-NS4 CharStream::pop() {
-	NS4 value{};
-	value.nonce_2 = pop<uint8_t>();
-	return value;
+template<typename T>
+encrypt_buf encrypt(const T &thing, const cipher_key &key) {
+	encrypt_buf encrypted;
+	encrypt<T>(thing, key, encrypted);
+	return encrypted;
 }
 
-template<>
-NS5 CharStream::push(const NS5 &value) {
-	push<uint8_t>(value.f_nonce_2);
-	return value;
-}
+/**
+ * A whole <msg number><encrypted block> packet for a fixed-size message, built on the stack
+ */
+template<typename T>
+struct encrypted_packet {
+	U8 bytes[1 + wire_size<U16>::value + encrypted_size<T>::value];
 
-template<>
-NS5 CharStream::pop() {
-	NS5 value{};
-	value.f_nonce_2 = pop<uint8_t>();
-	return value;
-}
+	encrypted_packet(U8 cmd, const T &thing, const cipher_key &key) {
+		bytes[0] = cmd;
+		U8 *out = wire_codec<U16>::encode(encrypted_size<T>::value, bytes + 1);
+		encrypt<T>(thing, key, out);
+	}
 
-template<typename T>
-encrypt_buf encrypt(const T &thing, const std::bitset<10> &key) {
-	CharStream str;
-	str.push<T>(thing);
-
-	std::vector<U8> bytes = str.getBuffer();
-	encrypt_buf encrypted{};
-	for (U8 byte : bytes) {
-		encrypted.push_back(static_cast<U8>(des_encrypt(std::bitset<8>{byte}, key).to_ullong()));
+	CharStream stream() const {
+		return CharStream::view(bytes, sizeof(bytes));
 	}
+};
 
-	return encrypted;
+/**
+ * Decrypt a message, returning false if there isn't a whole one in there (it was cut short)
+ */
+template<typename T>
+bool decrypt(const encrypt_buf &encrypted, const cipher_key &key, T &value) {
+	//Decrypted into the same scratch space every time so this doesn't allocate once it's warm
+	static thread_local std::vector<U8> scratch;
+	scratch.assign(encrypted.begin(), encrypted.end());
+	session_cipher::decrypt(scratch.data(), scratch.size(), key);
+	return decode_message<T>(value, scratch.data(), scratch.size()) != 0;
 }
 
 template<typename T>
-T decrypt(const encrypt_buf &encrypted, const std::bitset<10> &key) {
-	std::vector<U8> bytes;
-	for (U8 byte : encrypted) {
-		bytes.push_back(static_cast<U8>(des_decrypt(std::bitset<8>{byte}, key).to_ullong()));
+T decrypt(const encrypt_buf &encrypted, const cipher_key &key) {
+	T value{};
+	if (!decrypt<T>(encrypted, key, value)) {
+		assert(false);
 	}
+	return value;
+}
 
-	CharStream str(bytes.data(), bytes.size());
-	return str.pop<T>();
+/**
+ * Pop an encrypted message off a packet and decrypt it, for packets off the network. Returns
+ * false if the packet or the message in it is cut short.
+ */
+template<typename T>
+bool pop_encrypted(CharStream &cs, const cipher_key &key, T &value) {
+	encrypt_buf encrypted;
+	return pop_message<encrypt_buf>(cs, encrypted) && decrypt<T>(encrypted, key, value);
 }
 
 #endif //CRYPTO2_NEEDHAM_SCHROEDER_H
@@ -6,12 +6,29 @@
 #define CRYPTO2_NET_H
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <algorithm>
 #include "charStream.h"
 
-int get_server_sock(int bind_addr, short bind_port, int &sock, sockaddr_in &addr) {
+//Every message on the wire is <32-bit little endian length><message>, so messages survive TCP
+// splitting or coalescing them, and can be pipelined
+#define FRAME_HEADER_SIZE 4
+//Anything claiming to be bigger than this is garbage
+#define MAX_FRAME_SIZE (16 * 1024 * 1024)
+
+/**
+ * Open a listening socket. With reuse_port, any number of sockets can listen on the same port and
+ * the kernel spreads incoming connections between them.
+ */
+int get_server_sock(int bind_addr, short bind_port, int &sock, sockaddr_in &addr, bool reuse_port = false) {
 	socklen_t len = sizeof(sockaddr_in);
 
 	sock = socket(PF_INET, SOCK_STREAM, 0);
@@ -20,19 +37,25 @@ int get_server_sock(int bind_addr, short bind_port, int &sock, sockaddr_in &addr
 		return -1;
 	}
 
+	//Don't clog up the port. Has to happen before bind() or it does nothing.
+	int value = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const void *)&value , sizeof(int));
+	if (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const void *)&value, sizeof(int)) < 0) {
+		perror("SO_REUSEPORT");
+		close(sock);
+		return -1;
+	}
+
 	addr.sin_family = PF_INET;
 	addr.sin_addr.s_addr = htonl(bind_addr);
 	addr.sin_port = htons(bind_port);
 	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
 		perror("tcp bind()");
+		close(sock);
 		return -1;
 	}
 
-	//Don't clog up the port
-	int value = 1;
-	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const void *)&value , sizeof(int));
-
-	listen(sock, 100);
+	listen(sock, SOMAXCONN);
 
 	if (getsockname(sock, (sockaddr *)&addr, &len) < 0) {
 		perror("getsockname()");
@@ -70,34 +93,262 @@ int get_client_sock(const char *bind_addr, short bind_port, int &sock, sockaddr_
 	return 0;
 }
 
-int send_stream(int sock, const CharStream &str) {
-	ssize_t nsend = send(sock, str.getBuffer().data(), str.size(), 0);
-	if (nsend < 0) {
-		perror("send");
+/**
+ * Send small writes right away instead of holding them back until the last one is acked. Matters
+ * on a connection that's reused for request/response traffic, where the other side has nothing to
+ * send back (and so ack with) after our last message.
+ */
+void set_nodelay(int sock) {
+	int value = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const void *)&value, sizeof(int));
+}
+
+/**
+ * Make closing a socket reset the connection, throwing away whatever's still queued to send on it
+ * (and so letting go of it) instead of carrying on sending it after the close.
+ */
+void set_abort_on_close(int sock) {
+	linger value{};
+	value.l_onoff = 1;
+	value.l_linger = 0;
+	setsockopt(sock, SOL_SOCKET, SO_LINGER, (const void *)&value, sizeof(value));
+}
+
+/**
+ * Start connecting a new non-blocking socket to addr. Returns 0 if it's connected or on its way
+ * (the socket turns writable once it's done either way, then ask connect_error() how it went),
+ * < 0 on error.
+ */
+int start_connect(const sockaddr_in &addr, int &sock) {
+	sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		perror("tcp socket()");
 		return -1;
 	}
-	if (nsend == 0) {
-		printf("Other side closed\n");
-		return 1;
+	set_nodelay(sock);
+	if (connect(sock, (const sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+		perror("connect");
+		close(sock);
+		sock = -1;
+		return -1;
 	}
 	return 0;
 }
 
-int recv_stream(int sock, CharStream &str) {
-	//What do we get?
-	char buffer[1024];
-	ssize_t nrecv = recv(sock, buffer, 1024, 0);
-	if (nrecv < 0) {
-		perror("recv");
+/**
+ * How a connection from start_connect() turned out: 0 if it worked, otherwise why not (an errno)
+ */
+int connect_error(int sock) {
+	int error = 0;
+	socklen_t len = sizeof(error);
+	if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+		return errno;
+	}
+	return error;
+}
+
+/**
+ * Switch a socket to non-blocking, for use with an event loop
+ */
+int set_nonblocking(int sock) {
+	int flags = fcntl(sock, F_GETFL, 0);
+	if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0) {
+		perror("fcntl");
 		return -1;
 	}
-	if (nrecv == 0) {
-		printf("Other side closed\n");
-		return 1;
+	return 0;
+}
+
+/**
+ * Let this process have as many sockets open as it's allowed to, since the default soft limit
+ * (usually 1024) is a lot less than a busy server wants
+ */
+void raise_fd_limit() {
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
 	}
+}
+
+/**
+ * Send one framed message, header and body in the same syscall. Keeps going until it's all out.
+ */
+int send_stream(int sock, const CharStream &str) {
+	U32 header = wireOrder<U32>(static_cast<U32>(str.size()));
+
+	iovec iov[2];
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = const_cast<U8 *>(str.data());
+	iov[1].iov_len = str.size();
+
+	msghdr msg{};
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	while (iov[0].iov_len + iov[1].iov_len > 0) {
+		ssize_t nsend = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (nsend < 0) {
+			perror("send");
+			return -1;
+		}
+		if (nsend == 0) {
+			printf("Other side closed\n");
+			return 1;
+		}
 
-	str = CharStream((U8 *)buffer, nrecv);
+		//Partial send, skip past whatever made it out
+		for (int i = 0; i < 2; i ++) {
+			size_t skip = std::min(static_cast<size_t>(nsend), iov[i].iov_len);
+			iov[i].iov_base = static_cast<U8 *>(iov[i].iov_base) + skip;
+			iov[i].iov_len -= skip;
+			nsend -= skip;
+		}
+	}
 	return 0;
 }
 
+/**
+ * Per-connection reassembly buffer. Bytes go in as they arrive off the socket, whole messages
+ * come out once all of their bytes are here, however the reads happened to line up.
+ */
+class frame_reader {
+	CharStream mBuffer;
+
+public:
+	//How much fill() asks for at once. Big enough for lots of small messages at once, or a good
+	// chunk of a big one.
+	static const size_t fill_size = 16 * 1024;
+
+	/**
+	 * Read whatever the socket has into the buffer. Returns what recv() did: bytes read, 0 if the
+	 * other side closed, or < 0 on error (with errno set).
+	 */
+	ssize_t fill(int sock) {
+		U8 *buffer = mBuffer.prepareWrite(fill_size);
+		ssize_t nrecv = recv(sock, buffer, fill_size, 0);
+		mBuffer.commitWrite(nrecv > 0 ? nrecv : 0);
+		return nrecv;
+	}
+
+	/**
+	 * Add bytes that were received somewhere else, eg. by io_uring into one of its buffers
+	 */
+	void append(const U8 *data, size_t length) {
+		mBuffer.pushBytes(data, length);
+	}
+
+	/**
+	 * Pop the next complete message, if there is one, into frame as a view of the buffer. The
+	 * view is only good until the next fill(). Returns -1 if the stream is garbage.
+	 */
+	int next(CharStream &frame) {
+		if (mBuffer.size() < FRAME_HEADER_SIZE) {
+			return 0;
+		}
+		U32 length;
+		memcpy(&length, static_cast<const CharStream &>(mBuffer).data(), sizeof(length));
+		length = wireOrder(length);
+		if (length > MAX_FRAME_SIZE) {
+			return -1;
+		}
+		if (mBuffer.size() < FRAME_HEADER_SIZE + length) {
+			return 0;
+		}
+
+		mBuffer.consume(FRAME_HEADER_SIZE);
+		frame = CharStream::view(mBuffer.consume(length), length);
+		return 1;
+	}
+
+	/**
+	 * Give the buffer's memory back if there's no partial message in it, so thousands of idle
+	 * connections don't each sit on a read buffer
+	 */
+	void release() {
+		if (mBuffer.size() == 0) {
+			std::vector<U8> empty;
+			mBuffer.swap(empty);
+		}
+	}
+};
+
+/**
+ * Per-connection output buffer for non-blocking sockets. Messages get framed and queued up, then
+ * sent as far as the socket will take them; whatever's left goes out on the next flush() once
+ * the socket is writable again.
+ */
+class frame_writer {
+	CharStream mBuffer;
+
+public:
+	void push(const CharStream &str) {
+		mBuffer.push<U32>(static_cast<U32>(str.size()));
+		mBuffer.pushBytes(str.data(), str.size());
+	}
+
+	bool empty() const {
+		return mBuffer.size() == 0;
+	}
+
+	/**
+	 * Take everything queued so far, for sending asynchronously from a buffer nothing else will
+	 * touch in the meantime. Whatever was in out becomes the (empty) queue, keeping its capacity.
+	 */
+	void take(std::vector<U8> &out) {
+		out.clear();
+		mBuffer.swap(out);
+	}
+
+	/**
+	 * Send as much as possible. Returns 0 if it all went or the socket is full for now, < 0 on
+	 * error (with errno set).
+	 */
+	int flush(int sock) {
+		const CharStream &buffer = mBuffer;
+		while (buffer.size() > 0) {
+			ssize_t nsend = send(sock, buffer.data(), buffer.size(), MSG_NOSIGNAL);
+			if (nsend < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					return 0;
+				}
+				return -1;
+			}
+			mBuffer.consume(nsend);
+		}
+		mBuffer.clear();
+		return 0;
+	}
+};
+
+/**
+ * Blocking read of the next message on a socket, reading more off it until one is complete
+ */
+int recv_stream(int sock, frame_reader &reader, CharStream &str) {
+	while (true) {
+		int status = reader.next(str);
+		if (status < 0) {
+			printf("Bad frame\n");
+			return -1;
+		}
+		if (status > 0) {
+			return 0;
+		}
+
+		ssize_t nrecv = reader.fill(sock);
+		if (nrecv < 0) {
+			perror("recv");
+			return -1;
+		}
+		if (nrecv == 0) {
+			printf("Other side closed\n");
+			return 1;
+		}
+	}
+}
+
 #endif //CRYPTO2_NET_H
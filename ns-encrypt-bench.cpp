@@ -0,0 +1,95 @@
+//
+// Created by Glenn Smith on 10/11/18.
+//
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include "des-reference.h"
+#include "needham-schroeder.h"
+
+/**
+ * Throughput of the KDC's NS2/NS3 encryption (kdc::handle_message in server.cpp): building the
+ * NS3 under B's key, putting it in the NS2 and encrypting that under A's key. Once the way it
+ * started out, every byte through the bitset des_encrypt with the key schedule rebuilt each time,
+ * and once through encrypt<T> as the server does it now (the codebooks, on the toy DES).
+ *
+ * Usage: ns_encrypt_bench
+ */
+
+//Keep going for at least this long (seconds) per measurement
+#define BENCH_MIN_SECONDS 0.5
+
+/**
+ * The original encrypt<T>: encode, then one bitset des_encrypt per byte into a new buffer
+ */
+template<typename T>
+encrypt_buf bitset_encrypt(const T &thing, const std::bitset<10> &key) {
+	std::vector<U8> bytes(wire_codec<T>::size(thing));
+	encode_message<T>(thing, bytes.data());
+
+	encrypt_buf encrypted{};
+	for (U8 byte : bytes) {
+		encrypted.push_back(static_cast<U8>(bitset_des_encrypt(std::bitset<8>{byte}, key).to_ullong()));
+	}
+	return encrypted;
+}
+
+/**
+ * Run one NS2 (with its NS3) through encrypt_both as many times as fits in the time, and print
+ * the encrypted bytes per second and NS2s per second
+ */
+template<typename Encrypt>
+void measure(const char *name, Encrypt encrypt_both) {
+	NS2 ns2{};
+	ns2.id_b.sin_family = AF_INET;
+	ns2.id_b.sin_port = htons(51179);
+	ns2.id_b.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	NS3 ns3{};
+	ns3.id_a = ns2.id_b;
+
+	auto start = std::chrono::steady_clock::now();
+	size_t bytes = 0;
+	size_t count = 0;
+	double seconds = 0;
+	do {
+		ns2.nonce_1 = static_cast<U8>(count);
+		ns2.session_key = session_cipher::random_key();
+		ns2.timestamp = current_timestamp();
+		ns3.session_key = ns2.session_key;
+		ns3.timestamp = ns2.timestamp;
+
+		bytes += encrypt_both(ns2, ns3);
+		count ++;
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	} while (seconds < BENCH_MIN_SECONDS);
+	printf("%-36s %12.2f %12.0f\n", name, bytes / seconds / 1e6, count / seconds);
+}
+
+int main() {
+	cipher_key key_a = session_cipher::random_key();
+	cipher_key key_b = session_cipher::random_key();
+	std::bitset<10> toy_key_a(session_cipher::key_value(key_a));
+	std::bitset<10> toy_key_b(session_cipher::key_value(key_b));
+
+	printf("%-36s %12s %12s\n", "", "MB/s", "NS2s/s");
+	measure("bitset des_encrypt per byte (before)", [&](NS2 &ns2, NS3 &ns3) {
+		ns2.encrypt_ns3 = bitset_encrypt<NS3>(ns3, toy_key_b);
+		encrypt_buf encrypt_ns2 = bitset_encrypt<NS2>(ns2, toy_key_a);
+		return ns2.encrypt_ns3.size() + encrypt_ns2.size();
+	});
+
+	//Reused between requests like the server's, so they keep their capacity
+	encrypt_buf encrypt_ns2;
+#ifdef CRYPTO2_FULL_DES
+	const char *name = "encrypt<T>, full DES";
+#else
+	const char *name = "encrypt<T>, codebooks";
+#endif
+	measure(name, [&](NS2 &ns2, NS3 &ns3) {
+		encrypt<NS3>(ns3, key_b, ns2.encrypt_ns3);
+		encrypt<NS2>(ns2, key_a, encrypt_ns2);
+		return ns2.encrypt_ns3.size() + encrypt_ns2.size();
+	});
+	return EXIT_SUCCESS;
+}
@@ -6,174 +6,622 @@
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <atomic>
+#include <thread>
 #include <vector>
 #include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/select.h>
 #include "net.h"
+#include "event-loop.h"
+#include "io-uring.h"
 #include "charStream.h"
+#include "client-registry.h"
 #include "needham-schroeder.h"
 #include "diffie-hellman.h"
+#include "dh-pool.h"
 #include "util.h"
 
 #define KDC_PORT 12345
+//How many keypairs to keep ready for new connections
+#define DH_POOL_SIZE 256
+
+//Handed out to connections as they're accepted, by every thread
+std::atomic<U64> next_connection_id{1};
 
 struct client {
+	//Whether this slot has a connection in it
+	bool active;
 	int sock;
 	sockaddr_in addr;
-	std::bitset<10> key;
+	cipher_key key;
+	//Our half of the key exchange for this connection; every connection gets a fresh keypair
+	bignum dh_private;
+	//Whether they've sent us their public key yet, and so are in the registry
+	bool registered;
+	//Unique across every connection any thread has had, to tell registrations apart
+	U64 id;
+	//Bytes received that don't make up a whole message yet
+	frame_reader reader;
+	//Replies the socket wasn't ready to take yet
+	frame_writer writer;
 };
 
-int main(int argc, const char **argv) {
-	short server_port = KDC_PORT;
-	sockaddr_in server_addr{};
-	int server_sock;
+/**
+ * One shard of the KDC: the connections one thread is handling. Everything else is shared.
+ */
+struct kdc {
+	const dh &group;
+	dh_pool &keys;
+	client_registry &registry;
+	//Connection state, indexed by socket fd so looking up a ready socket is just an index
+	std::vector<client> clients;
 
-	if (get_server_sock(INADDR_ANY, server_port, server_sock, server_addr) < 0) {
-		return EXIT_FAILURE;
+	//Reused for every NS1 so the encrypted buffers keep their capacity between requests
+	NS2 ns2;
+	encrypt_buf encrypt_ns2;
+	CharStream resp;
+
+	kdc(dh_pool &keys, client_registry &registry) : group(keys.group()), keys(keys), registry(registry), ns2{} {}
+
+	/**
+	 * Start tracking a newly accepted connection and queue up a public key for it
+	 */
+	client &connect(int sock, const sockaddr_in &addr) {
+		if (static_cast<size_t>(sock) >= clients.size()) {
+			clients.resize(sock + 1);
+		}
+		client &c = clients[sock];
+		c.active = true;
+		c.sock = sock;
+		c.addr = addr;
+		c.id = next_connection_id++;
+		dh_key key = keys.take();
+		c.dh_private = std::move(key.x);
+
+		CharStream str;
+		str.push<U8>(0);
+		str.push<U16>(static_cast<U16>(group.bits));
+		str.push<std::vector<U8>>(dh_encode_public(group, key.y));
+		c.writer.push(str);
+		return c;
 	}
 
-	on_scope_exit server_sock_closer{[server_sock]() {
-		close(server_sock);
-	}};
+	/**
+	 * Close a connection and free up its slot
+	 */
+	void disconnect(client &c) {
+		if (c.registered) {
+			registry.remove(c.addr, c.id);
+		}
+		close(c.sock);
+		c = client{};
+	}
 
-	dh_key server_key{};
-	server_key.x = static_cast<uint16_t>(rand_u64() % global_dh.q);
-	server_key.y = exp_mod_16(global_dh.alpha, server_key.x, global_dh.q);
+	/**
+	 * Handle one whole message from a client, queueing up any reply. Returns < 0 if it's malformed
+	 * (cut short), and the client should be dropped.
+	 */
+	int handle_message(client &client_a, CharStream &cs) {
+		U8 cmd;
+		if (!pop_message<U8>(cs, cmd)) {
+			return -1;
+		}
 
-	std::vector<client> clients;
+		if (cmd == 0) {
+			//Copy the correct listening port for this client
+			sockaddr_in addr;
+			//Generate and register session key
+			std::vector<U8> pub_bytes;
+			if (!pop_message<ID>(cs, addr) || !pop_message<std::vector<U8>>(cs, pub_bytes)) {
+				return -1;
+			}
+			bignum pub_key = dh_decode_public(group, pub_bytes);
+			if (pub_bytes.size() != group.bytes() || !dh_valid_public(group, pub_key)) {
+				printf("Client %s:%d sent a bad public key, ignoring\n", inet_ntoa(client_a.addr.sin_addr),
+				       ntohs(client_a.addr.sin_port));
+				return 0;
+			}
+			client_a.key = session_cipher::key_from_secret(dh_secret_bits(dh_shared(group, pub_key, client_a.dh_private)));
+			if (client_a.registered) {
+				registry.remove(client_a.addr, client_a.id);
+			}
+			client_a.addr.sin_port = addr.sin_port;
+			registry.insert(client_a.addr, client_a.key, client_a.id);
+			client_a.registered = true;
 
-	while (true) {
-		fd_set fds;
-		int max_fd = server_sock;
-		FD_ZERO(&fds);
-		FD_SET(server_sock, &fds);
+			printf("Client %s:%d registers with pubkey ...%016llx\n", inet_ntoa(client_a.addr.sin_addr),
+			       ntohs(client_a.addr.sin_port), static_cast<unsigned long long>(pub_key[0]));
+		} else if (cmd == 1) {
+			NS1 ns1;
+			if (!pop_message<NS1>(cs, ns1)) {
+				return -1;
+			}
+
+			printf("Client %s:%d requesting info for %s:%d\n",
+			       inet_ntoa(client_a.addr.sin_addr),
+			       ntohs(client_a.addr.sin_port), inet_ntoa(ns1.id_b.sin_addr),
+			       ntohs(ns1.id_b.sin_port));
+			//Better try to get them their NS2
+
+			cipher_key key_b;
+			if (registry.find(ns1.id_b, key_b)) {
+				//Here we go
+				ns2.nonce_1 = ns1.nonce_1;
+				ns2.id_b = ns1.id_b;
+				ns2.session_key = session_cipher::random_key();
+				ns2.timestamp = current_timestamp();
 
-		for (auto client : clients) {
-			FD_SET(client.sock, &fds);
-			if (client.sock > max_fd) {
-				max_fd = client.sock;
+				NS3 ns3;
+				ns3.session_key = ns2.session_key;
+				ns3.id_a = ns1.id_a;
+				ns3.timestamp = current_timestamp();
+
+				encrypt<NS3>(ns3, key_b, ns2.encrypt_ns3);
+				encrypt<NS2>(ns2, client_a.key, encrypt_ns2);
+
+				resp.clear();
+				resp.push<U8>(2);
+				resp.push<encrypt_buf>(encrypt_ns2);
+
+				client_a.writer.push(resp);
 			}
 		}
+		return 0;
+	}
 
-		if (select(max_fd + 1, &fds, nullptr, nullptr, nullptr) < 0) {
-			perror("select");
-			if (errno == EINTR) {
-				continue;
-			} else {
-				break;
+	/**
+	 * Handle every whole message that's arrived from a client. Returns < 0 if the client should be
+	 * dropped.
+	 */
+	int handle_frames(client &c) {
+		CharStream cs;
+		int status;
+		while ((status = c.reader.next(cs)) > 0) {
+			if (handle_message(c, cs) < 0) {
+				printf("Malformed message from %s:%d\n", inet_ntoa(c.addr.sin_addr), ntohs(c.addr.sin_port));
+				return -1;
 			}
 		}
+		if (status < 0) {
+			printf("Bad frame from %s:%d\n", inet_ntoa(c.addr.sin_addr), ntohs(c.addr.sin_port));
+			return -1;
+		}
+		return 0;
+	}
 
-		if (FD_ISSET(server_sock, &fds)) {
-			//New connection
-			client c;
-			socklen_t len = sizeof(sockaddr_in);
-			c.sock = accept(server_sock, (sockaddr *)&c.addr, &len);
-			if (c.sock < 0) {
-				perror("accept");
+	/**
+	 * Read everything a client has sent and handle every whole message in it. Edge triggered, so
+	 * this has to keep going until the socket runs dry. Returns < 0 if the client should be dropped.
+	 */
+	int read_client(client &c) {
+		while (true) {
+			ssize_t nrecv = c.reader.fill(c.sock);
+			if (nrecv < 0) {
 				if (errno == EINTR) {
 					continue;
-				} else {
+				}
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
 					break;
 				}
+				perror("recv");
+				return -1;
+			}
+			if (nrecv == 0) {
+				//They disconnected
+				printf("Disconnect: %s:%d\n", inet_ntoa(c.addr.sin_addr), ntohs(c.addr.sin_port));
+				return -1;
 			}
 
-			CharStream str;
-			str.push<U8>(0);
-			str.push<U16>(server_key.y);
-			if (send_stream(c.sock, str) < 0) {
-				if (errno == EINTR) {
-					continue;
-				} else {
+			//Could be any number of whole messages in there, decoded right where they landed. Has
+			// to happen before the next fill() since that can move the buffer.
+			if (handle_frames(c) < 0) {
+				return -1;
+			}
+
+			//A short read means the socket was empty, no need for another recv() to hear EAGAIN
+			if (static_cast<size_t>(nrecv) < frame_reader::fill_size) {
+				break;
+			}
+		}
+		c.reader.release();
+		return 0;
+	}
+};
+
+/**
+ * Serve on an edge-triggered epoll loop
+ */
+int run_epoll(kdc &state, int server_sock) {
+	epoll_loop loop;
+	if (!loop.valid() || set_nonblocking(server_sock) < 0 || loop.add(server_sock) < 0) {
+		return -1;
+	}
+
+	auto handle_event = [&](int sock, int events) {
+		if (sock == server_sock) {
+			//New connections, take all of them since we won't hear about these again
+			while (true) {
+				sockaddr_in addr{};
+				socklen_t len = sizeof(sockaddr_in);
+				int client_sock = accept4(server_sock, (sockaddr *)&addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				if (client_sock < 0) {
+					if (errno == EINTR || errno == ECONNABORTED) {
+						continue;
+					}
+					if (errno != EAGAIN && errno != EWOULDBLOCK) {
+						perror("accept");
+					}
 					break;
 				}
+
+				client &c = state.connect(client_sock, addr);
+				if (loop.add(client_sock) < 0) {
+					state.disconnect(c);
+				}
 			}
+			return;
+		}
 
-			clients.push_back(c);
+		if (static_cast<size_t>(sock) >= state.clients.size() || !state.clients[sock].active) {
+			return;
+		}
+		client &c = state.clients[sock];
+
+		if ((events & EVENT_READ) && state.read_client(c) < 0) {
+			state.disconnect(c);
+			return;
+		}
+		//Replies to whatever we just read, or leftovers now that the socket has room
+		if (!c.writer.empty() && c.writer.flush(c.sock) < 0) {
+			perror("send");
+			state.disconnect(c);
 		}
+	};
 
-		for (auto it = clients.begin(); it != clients.end(); ) {
-			client &client_a = *it;
-			if (FD_ISSET(client_a.sock, &fds)) {
-				//That sock read some data
-				char buffer[1024];
-				ssize_t nrecv = recv(client_a.sock, buffer, 1024, 0);
-				if (nrecv < 0) {
-					perror("recv");
-					if (errno == EINTR) {
+	while (true) {
+		if (loop.wait(handle_event) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			return -1;
+		}
+	}
+}
+
+/**
+ * Serve on plain select(), the way the KDC did before it had an event loop. Only kept around to
+ * compare the others against (see kdc-bench.sh): every wait hands the kernel every socket and then
+ * scans all of them, and it can't take sockets past FD_SETSIZE at all.
+ */
+int run_select(kdc &state, int server_sock) {
+	if (set_nonblocking(server_sock) < 0) {
+		return -1;
+	}
+
+	while (true) {
+		fd_set reads, writes;
+		FD_ZERO(&reads);
+		FD_ZERO(&writes);
+		FD_SET(server_sock, &reads);
+		int max_fd = server_sock;
+		for (const client &c : state.clients) {
+			if (!c.active) {
+				continue;
+			}
+			FD_SET(c.sock, &reads);
+			if (!c.writer.empty()) {
+				FD_SET(c.sock, &writes);
+			}
+			if (c.sock > max_fd) {
+				max_fd = c.sock;
+			}
+		}
+
+		if (select(max_fd + 1, &reads, &writes, nullptr, nullptr) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("select");
+			return -1;
+		}
+
+		//Clients first, since accepting can move them around
+		for (client &c : state.clients) {
+			if (!c.active || (!FD_ISSET(c.sock, &reads) && !FD_ISSET(c.sock, &writes))) {
+				continue;
+			}
+			if (FD_ISSET(c.sock, &reads) && state.read_client(c) < 0) {
+				state.disconnect(c);
+				continue;
+			}
+			if (!c.writer.empty() && c.writer.flush(c.sock) < 0) {
+				perror("send");
+				state.disconnect(c);
+			}
+		}
+
+		if (FD_ISSET(server_sock, &reads)) {
+			while (true) {
+				sockaddr_in addr{};
+				socklen_t len = sizeof(sockaddr_in);
+				int client_sock = accept4(server_sock, (sockaddr *)&addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				if (client_sock < 0) {
+					if (errno == EINTR || errno == ECONNABORTED) {
 						continue;
-					} else {
-						goto done;
 					}
+					if (errno != EAGAIN && errno != EWOULDBLOCK) {
+						perror("accept");
+					}
+					break;
 				}
-				if (nrecv == 0) {
-					//They disconnected
-					printf("Disconnect: %s:%d\n", inet_ntoa(client_a.addr.sin_addr), ntohs(client_a.addr.sin_port));
-					close(client_a.sock);
-					it = clients.erase(it);
+				if (client_sock >= FD_SETSIZE) {
+					printf("Too many connections for select, dropping %s:%d\n", inet_ntoa(addr.sin_addr),
+					       ntohs(addr.sin_port));
+					close(client_sock);
 					continue;
 				}
+				//Its public key goes out once select says it's writable
+				state.connect(client_sock, addr);
+			}
+		}
+	}
+}
+
+/**
+ * Serve on io_uring. Completions come back tagged with what they were for and which connection,
+ * with a generation count so anything still in flight for a closed socket gets ignored rather
+ * than landing on whoever gets that fd next.
+ */
+int run_uring(kdc &state, int server_sock, uring_loop &loop) {
+	enum : U64 {
+		OP_ACCEPT = 1,
+		OP_RECV = 2,
+		OP_SEND = 3,
+	};
+	auto tag = [](U64 op, U32 generation, int sock) -> U64 {
+		return (op << 56) | (static_cast<U64>(generation & 0xFFFFFF) << 32) | static_cast<U32>(sock);
+	};
+
+	//Transport state for each connection, indexed by fd like the clients
+	struct connection {
+		U32 generation;
+		//What's being sent right now, which has to stay put until the kernel's done with it
+		std::vector<U8> sending;
+		size_t sent;
+		bool busy;
+	};
+	std::vector<connection> connections;
+	//Send buffers of dropped connections whose sends are still in flight, by tag
+	std::vector<std::pair<U64, std::vector<U8>>> orphans;
+
+	auto flush = [&](client &c) {
+		connection &conn = connections[c.sock];
+		if (conn.busy || c.writer.empty()) {
+			return;
+		}
+		c.writer.take(conn.sending);
+		conn.sent = 0;
+		conn.busy = true;
+		loop.send(c.sock, conn.sending.data(), conn.sending.size(), tag(OP_SEND, conn.generation, c.sock));
+	};
+
+	auto drop = [&](client &c) {
+		connection &conn = connections[c.sock];
+		if (conn.busy) {
+			orphans.emplace_back(tag(OP_SEND, conn.generation, c.sock), std::move(conn.sending));
+			conn.sending = std::vector<U8>();
+			conn.busy = false;
+		}
+		//Ends the multishot receive (and any send) so the kernel lets go of the socket
+		shutdown(c.sock, SHUT_RDWR);
+		state.disconnect(c);
+	};
+
+	loop.accept_multishot(server_sock, tag(OP_ACCEPT, 0, server_sock));
+
+	auto handle_completion = [&](const io_uring_cqe &cqe) {
+		U64 op = cqe.user_data >> 56;
+		U32 generation = static_cast<U32>(cqe.user_data >> 32) & 0xFFFFFF;
+		int sock = static_cast<int>(static_cast<U32>(cqe.user_data));
+		bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+
+		if (op == OP_ACCEPT) {
+			if (cqe.res >= 0) {
+				int client_sock = cqe.res;
+				sockaddr_in addr{};
+				socklen_t len = sizeof(sockaddr_in);
+				getpeername(client_sock, (sockaddr *)&addr, &len);
+
+				if (static_cast<size_t>(client_sock) >= connections.size()) {
+					connections.resize(client_sock + 1);
+				}
+				connection &conn = connections[client_sock];
+				conn.generation ++;
+				client &c = state.connect(client_sock, addr);
+				loop.recv_multishot(client_sock, tag(OP_RECV, conn.generation, client_sock));
+				flush(c);
+			} else if (cqe.res != -EINTR && cqe.res != -ECONNABORTED) {
+				errno = -cqe.res;
+				perror("accept");
+			}
+			if (!more) {
+				loop.accept_multishot(server_sock, tag(OP_ACCEPT, 0, server_sock));
+			}
+			return;
+		}
+
+		bool current = static_cast<size_t>(sock) < connections.size() &&
+			(connections[sock].generation & 0xFFFFFF) == generation && state.clients[sock].active;
+
+		if (op == OP_RECV) {
+			if (!current) {
+				loop.recycle(cqe);
+				return;
+			}
+			client &c = state.clients[sock];
+			if (cqe.res > 0) {
+				c.reader.append(loop.buffer(cqe), cqe.res);
+				loop.recycle(cqe);
+				if (state.handle_frames(c) < 0) {
+					drop(c);
+					return;
+				}
+				flush(c);
+				if (!more) {
+					loop.recv_multishot(sock, cqe.user_data);
+				}
+			} else if (cqe.res == 0) {
+				printf("Disconnect: %s:%d\n", inet_ntoa(c.addr.sin_addr), ntohs(c.addr.sin_port));
+				drop(c);
+			} else if (cqe.res == -ENOBUFS || cqe.res == -EINTR) {
+				//Ran out of buffers for a moment, they're back by now
+				loop.recv_multishot(sock, cqe.user_data);
+			} else {
+				errno = -cqe.res;
+				perror("recv");
+				drop(c);
+			}
+			return;
+		}
 
-				CharStream cs((U8 *)buffer, nrecv);
-				U8 cmd = cs.pop<U8>();
-
-				if (cmd == 0) {
-					//Copy the correct listening port for this client
-					sockaddr_in addr = cs.pop<ID>();
-					client_a.addr.sin_port = addr.sin_port;
-
-					//Generate and register session key
-					uint16_t pub_key = cs.pop<U16>();
-					uint16_t session_key = exp_mod_16(pub_key, server_key.x, global_dh.q);
-					client_a.key = std::bitset<10>{static_cast<uint64_t>(session_key)};
-
-					printf("Client %s:%d registers with pubkey %d\n", inet_ntoa(client_a.addr.sin_addr),
-					       ntohs(client_a.addr.sin_port), static_cast<int>(pub_key));
-				} else if (cmd == 1) {
-					NS1 ns1 = cs.pop<NS1>();
-
-					printf("Client %s:%d requesting info for %s:%d\n",
-					       inet_ntoa(client_a.addr.sin_addr),
-					       ntohs(client_a.addr.sin_port), inet_ntoa(ns1.id_b.sin_addr),
-					       ntohs(ns1.id_b.sin_port));
-					//Better try to get them their NS2
-
-					for (auto client_b : clients) {
-						if (client_b.addr.sin_addr.s_addr == ns1.id_b.sin_addr.s_addr &&
-						    client_b.addr.sin_port == ns1.id_b.sin_port) {
-							//Here we go
-							NS2 ns2;
-							ns2.nonce_1 = ns1.nonce_1;
-							ns2.id_b = ns1.id_b;
-							ns2.session_key = std::bitset<10>(rand_u64());
-							ns2.timestamp = current_timestamp();
-
-							NS3 ns3;
-							ns3.session_key = ns2.session_key;
-							ns3.id_a = ns1.id_a;
-							ns3.timestamp = current_timestamp();
-
-							ns2.encrypt_ns3 = encrypt<NS3>(ns3, client_b.key);
-
-							encrypt_buf encrypt_ns2 = encrypt<NS2>(ns2, client_a.key);
-
-							CharStream resp;
-							resp.push<U8>(2);
-							resp.push<encrypt_buf>(encrypt_ns2);
-
-							if (send_stream(client_a.sock, resp) < 0) {
-								if (errno != EINTR) {
-									goto done;
-								}
-							}
-							break;
-						}
+		if (op == OP_SEND) {
+			if (!current) {
+				for (auto it = orphans.begin(); it != orphans.end(); ++it) {
+					if (it->first == cqe.user_data) {
+						orphans.erase(it);
+						break;
 					}
 				}
+				return;
 			}
-			++it;
+			client &c = state.clients[sock];
+			connection &conn = connections[sock];
+			if (cqe.res < 0) {
+				errno = -cqe.res;
+				perror("send");
+				conn.busy = false;
+				drop(c);
+				return;
+			}
+			conn.sent += cqe.res;
+			if (conn.sent < conn.sending.size()) {
+				//Partial send, go again with the rest
+				loop.send(sock, conn.sending.data() + conn.sent, conn.sending.size() - conn.sent, cqe.user_data);
+				return;
+			}
+			conn.busy = false;
+			flush(c);
+		}
+	};
+
+	while (true) {
+		if (loop.wait(handle_completion) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("io_uring_enter");
+			return -1;
 		}
 	}
+}
+
+/**
+ * Run one shard: its own listening socket on the shared port (the kernel spreads incoming
+ * connections between them) and its own event loop
+ */
+int run_shard(int shard, const char *backend, dh_pool &keys, client_registry &registry) {
+	sockaddr_in server_addr{};
+	int server_sock;
+	if (get_server_sock(INADDR_ANY, KDC_PORT, server_sock, server_addr, true) < 0) {
+		return -1;
+	}
+
+	on_scope_exit server_sock_closer{[server_sock]() {
+		close(server_sock);
+	}};
+
+	kdc state(keys, registry);
 
-done:
+	if (strcmp(backend, "select") == 0) {
+		printf("Shard %d using select\n", shard);
+		return run_select(state, server_sock);
+	}
+	if (strcmp(backend, "epoll") != 0) {
+		uring_loop loop;
+		if (loop.valid()) {
+			printf("Shard %d using io_uring\n", shard);
+			return run_uring(state, server_sock, loop);
+		}
+		printf("Shard %d: io_uring not available, falling back to epoll\n", shard);
+	}
+
+	printf("Shard %d using epoll\n", shard);
+	return run_epoll(state, server_sock);
+}
+
+int main(int argc, const char **argv) {
+	//Which event loop to use: io_uring if the kernel has what it needs, otherwise epoll. select is
+	// only there for comparison.
+	const char *backend = argc > 1 ? argv[1] : "auto";
+	//One shard per core unless told otherwise
+	int threads = argc > 2 ? atoi(argv[2]) : static_cast<int>(std::thread::hardware_concurrency());
+	//Size of the Diffie-Hellman group clients register in
+	const dh *group = dh_group(argc > 3 ? static_cast<unsigned>(atoi(argv[3])) : DEFAULT_DH_BITS);
+	if ((strcmp(backend, "auto") != 0 && strcmp(backend, "io_uring") != 0 && strcmp(backend, "epoll") != 0
+	     && strcmp(backend, "select") != 0) || group == nullptr) {
+		fprintf(stderr, "Usage: %s [auto|io_uring|epoll|select] [threads] [16|64|1024|2048|3072]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+
+	raise_fd_limit();
+
+	printf("Using %u-bit Diffie-Hellman group\n", group->bits);
+	//Keypairs for new connections, made ahead of time so the shards never have to stop for one
+	dh_pool keys(*group, DH_POOL_SIZE);
+
+	client_registry registry;
+
+	//Only this thread handles SIGUSR1 (as a request for stats), so block it before the shards
+	// start and inherit the mask
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+	//Every shard runs until something goes badly wrong with it; if that happens, take the whole
+	// KDC down rather than carrying on with some of the clients unreachable
+	std::vector<std::thread> shards;
+	for (int i = 0; i < threads; i ++) {
+		shards.emplace_back([i, backend, &keys, &registry]() {
+			if (run_shard(i, backend, keys, registry) < 0) {
+				exit(EXIT_FAILURE);
+			}
+		});
+	}
+
+	while (true) {
+		int signal;
+		if (sigwait(&signals, &signal) != 0) {
+			break;
+		}
+		registry_stats stats = registry.stats();
+		printf("Registry: %zu clients in %zu buckets (%.1f%% full), probes %.2f average %zu worst\n",
+		       stats.clients, stats.buckets, stats.occupancy * 100, stats.mean_probe, stats.max_probe);
+		dh_pool_stats pool = keys.stats();
+		printf("DH pool: %zu/%zu keypairs ready, %llu made (%.0f/s while refilling), %llu taken, %llu made inline\n",
+		       pool.depth, pool.capacity, static_cast<unsigned long long>(pool.generated), pool.refill_rate,
+		       static_cast<unsigned long long>(pool.taken), static_cast<unsigned long long>(pool.misses));
+		fflush(stdout);
+	}
+
+	for (std::thread &shard : shards) {
+		shard.join();
+	}
 	return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,75 @@
+//
+// Created by Glenn Smith on 10/11/18.
+//
+
+#include <atomic>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * Counts the system calls the KDC makes doing its job, for kdc-bench.sh. Linked into a second
+ * build of the server (server_syscalls) with every socket and event loop call it makes wrapped
+ * (-Wl,--wrap=...), so each one bumps the count on its way through to libc. SIGUSR2 makes it
+ * print the count so far to stderr.
+ */
+
+static std::atomic<unsigned long> syscall_count{0};
+
+#define COUNTED(ret, name, params, args) \
+	extern "C" ret __real_##name params; \
+	extern "C" ret __wrap_##name params { \
+		syscall_count.fetch_add(1, std::memory_order_relaxed); \
+		return __real_##name args; \
+	}
+
+COUNTED(ssize_t, recv, (int sock, void *buffer, size_t length, int flags), (sock, buffer, length, flags))
+COUNTED(ssize_t, send, (int sock, const void *buffer, size_t length, int flags), (sock, buffer, length, flags))
+COUNTED(ssize_t, sendmsg, (int sock, const msghdr *msg, int flags), (sock, msg, flags))
+COUNTED(int, accept4, (int sock, sockaddr *addr, socklen_t *len, int flags), (sock, addr, len, flags))
+COUNTED(int, getpeername, (int sock, sockaddr *addr, socklen_t *len), (sock, addr, len))
+COUNTED(int, close, (int fd), (fd))
+COUNTED(int, epoll_wait, (int fd, epoll_event *events, int count, int timeout), (fd, events, count, timeout))
+COUNTED(int, epoll_ctl, (int fd, int op, int sock, epoll_event *event), (fd, op, sock, event))
+COUNTED(int, select, (int count, fd_set *reads, fd_set *writes, fd_set *errors, timeval *timeout),
+        (count, reads, writes, errors, timeout))
+
+//io_uring has no libc wrappers, so its setup, enter and register all go through syscall()
+extern "C" long __real_syscall(long number, ...);
+extern "C" long __wrap_syscall(long number, ...) {
+	syscall_count.fetch_add(1, std::memory_order_relaxed);
+	va_list args;
+	va_start(args, number);
+	long a = va_arg(args, long), b = va_arg(args, long), c = va_arg(args, long);
+	long d = va_arg(args, long), e = va_arg(args, long), f = va_arg(args, long);
+	va_end(args);
+	return __real_syscall(number, a, b, c, d, e, f);
+}
+
+/**
+ * Print the count with nothing but write(), since this runs in a signal handler
+ */
+static void print_count(int) {
+	char text[64] = "Syscalls: ";
+	char digits[24];
+	size_t count = 0;
+	unsigned long value = syscall_count.load(std::memory_order_relaxed);
+	do {
+		digits[count ++] = static_cast<char>('0' + value % 10);
+		value /= 10;
+	} while (value > 0);
+	size_t length = 10;
+	while (count > 0) {
+		text[length ++] = digits[-- count];
+	}
+	text[length ++] = '\n';
+	ssize_t ignored = write(STDERR_FILENO, text, length);
+	(void)ignored;
+}
+
+__attribute__((constructor)) static void install_handler() {
+	signal(SIGUSR2, print_count);
+}
@@ -0,0 +1,128 @@
+//
+// Created by Glenn Smith on 10/10/18.
+//
+
+#ifndef CRYPTO2_THREAD_POOL_H
+#define CRYPTO2_THREAD_POOL_H
+
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fixed set of worker threads pulling jobs off a shared queue
+ */
+class thread_pool {
+	std::vector<std::thread> mWorkers;
+	std::deque<std::function<void()>> mJobs;
+	std::mutex mMutex;
+	std::condition_variable mJobReady;
+	bool mStopping;
+
+	void work() {
+		while (true) {
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> lock(mMutex);
+				mJobReady.wait(lock, [this]() {
+					return mStopping || !mJobs.empty();
+				});
+				if (mJobs.empty()) {
+					//Only get here if we're stopping
+					return;
+				}
+				job = std::move(mJobs.front());
+				mJobs.pop_front();
+			}
+			job();
+		}
+	}
+
+public:
+	explicit thread_pool(size_t threads = std::thread::hardware_concurrency()) : mStopping(false) {
+		for (size_t i = 0; i < threads; i ++) {
+			mWorkers.emplace_back([this]() {
+				work();
+			});
+		}
+	}
+
+	~thread_pool() {
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mStopping = true;
+		}
+		mJobReady.notify_all();
+		for (std::thread &worker : mWorkers) {
+			worker.join();
+		}
+	}
+
+	thread_pool(const thread_pool &) = delete;
+	thread_pool &operator=(const thread_pool &) = delete;
+
+	size_t size() const {
+		return mWorkers.size();
+	}
+
+	/**
+	 * Queue a job to run on some worker at some point
+	 */
+	void submit(std::function<void()> job) {
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mJobs.push_back(std::move(job));
+		}
+		mJobReady.notify_one();
+	}
+
+	/**
+	 * Run fn(0) ... fn(count - 1) spread across the workers and the calling thread, returning once
+	 * every one of them has finished
+	 */
+	void run(size_t count, const std::function<void(size_t)> &fn) {
+		struct batch {
+			std::atomic<size_t> next{0};
+			size_t finished = 0;
+			std::mutex mutex;
+			std::condition_variable done;
+		};
+		std::shared_ptr<batch> state = std::make_shared<batch>();
+
+		//Everybody grabs indices off the same counter until they run out
+		auto drain = [state, count, &fn]() {
+			size_t ran = 0;
+			for (size_t i = state->next++; i < count; i = state->next++) {
+				fn(i);
+				ran ++;
+			}
+			if (ran > 0) {
+				std::lock_guard<std::mutex> lock(state->mutex);
+				state->finished += ran;
+				if (state->finished == count) {
+					state->done.notify_all();
+				}
+			}
+		};
+
+		size_t helpers = std::min(mWorkers.size(), count > 0 ? count - 1 : 0);
+		for (size_t i = 0; i < helpers; i ++) {
+			submit(drain);
+		}
+		drain();
+
+		std::unique_lock<std::mutex> lock(state->mutex);
+		state->done.wait(lock, [&state, count]() {
+			return state->finished == count;
+		});
+	}
+};
+
+#endif //CRYPTO2_THREAD_POOL_H
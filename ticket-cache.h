@@ -0,0 +1,105 @@
+//
+// Created by Glenn Smith on 10/11/18.
+//
+
+#ifndef CRYPTO2_TICKET_CACHE_H
+#define CRYPTO2_TICKET_CACHE_H
+
+#include <arpa/inet.h>
+#include <list>
+#include <stdint.h>
+#include <unordered_map>
+#include "needham-schroeder.h"
+#include "util.h"
+
+/**
+ * What the KDC gave us for talking to one peer: the session key and the NS3 ticket for them
+ */
+struct ticket {
+	ID peer;
+	cipher_key session_key;
+	encrypt_buf encrypt_ns3;
+	//Stop using it at this time (seconds): whichever comes first of our TTL and the peer
+	// refusing the ticket's timestamp
+	uint64_t expires;
+};
+
+/**
+ * Tickets from earlier handshakes, so talking to the same peer again can skip straight to NS3
+ * instead of going through the KDC first. Holds at most a fixed number, dropping the least
+ * recently used when it needs room, and never hands out one that's expired.
+ */
+class ticket_cache {
+	size_t mCapacity;
+	uint64_t mTtl;
+	//Most recently used first
+	std::list<ticket> mTickets;
+	std::unordered_map<U64, std::list<ticket>::iterator> mIndex;
+
+	static U64 id_key(const ID &id) {
+		return (static_cast<U64>(id.sin_addr.s_addr) << 16) | id.sin_port;
+	}
+
+public:
+	/**
+	 * ttl is how long (seconds) to keep a ticket at most, 0 to not cache at all
+	 */
+	ticket_cache(size_t capacity, uint64_t ttl) : mCapacity(capacity), mTtl(ttl) {}
+
+	size_t size() const {
+		return mTickets.size();
+	}
+
+	/**
+	 * Remember the ticket from an NS2. timestamp is the one the KDC put in it (and in the ticket).
+	 */
+	void insert(const ID &peer, const cipher_key &session_key, const encrypt_buf &encrypt_ns3, uint64_t timestamp) {
+		if (mTtl == 0 || mCapacity == 0) {
+			return;
+		}
+		uint64_t expires = current_timestamp() + mTtl;
+		if (timestamp + TIMESTAMP_WINDOW < expires) {
+			expires = timestamp + TIMESTAMP_WINDOW;
+		}
+
+		remove(peer);
+		if (mTickets.size() >= mCapacity) {
+			mIndex.erase(id_key(mTickets.back().peer));
+			mTickets.pop_back();
+		}
+		mTickets.push_front(ticket{peer, session_key, encrypt_ns3, expires});
+		mIndex[id_key(peer)] = mTickets.begin();
+	}
+
+	/**
+	 * Ticket for a peer if there's one that's still good, otherwise nullptr. Valid until the
+	 * cache is next changed.
+	 */
+	const ticket *find(const ID &peer) {
+		auto found = mIndex.find(id_key(peer));
+		if (found == mIndex.end()) {
+			return nullptr;
+		}
+		if (current_timestamp() >= found->second->expires) {
+			mTickets.erase(found->second);
+			mIndex.erase(found);
+			return nullptr;
+		}
+		//Move it to the front as the most recently used
+		mTickets.splice(mTickets.begin(), mTickets, found->second);
+		return &*found->second;
+	}
+
+	/**
+	 * Forget a peer's ticket, eg. because they didn't accept it
+	 */
+	void remove(const ID &peer) {
+		auto found = mIndex.find(id_key(peer));
+		if (found != mIndex.end()) {
+			mTickets.erase(found->second);
+			mIndex.erase(found);
+		}
+	}
+};
+
+#endif //CRYPTO2_TICKET_CACHE_H
@@ -0,0 +1,86 @@
+#!/bin/bash
+#
+# Throughput and memory of the data channel on a big stream: one client receiving into a file and
+# another sending it a file of random bytes over loopback, once straight from the file (mapped,
+# zerocopy where the kernel does it) and once piped through stdin. Prints each end's MB/s and peak
+# RSS, and checks what was received matches what was sent.
+#
+# Usage: ./transfer-bench.sh [build dir] [MB] [extra client send args, eg. rekey 0 0]
+# Build in Release (cmake -DCMAKE_BUILD_TYPE=Release) first. Runs its own KDC, so port 12345 has
+# to be free. Needs twice the size free in $TMPDIR for the input and output.
+
+BUILD=${1:-.}
+SIZE=${2:-1024}
+shift $(($# < 2 ? $# : 2))
+
+if [ ! -x "$BUILD/server" ] || [ ! -x "$BUILD/client" ]; then
+	echo "No server/client in $BUILD, build them first" >&2
+	exit 1
+fi
+
+WORK=$(mktemp -d)
+trap 'kill $SERVER $RECEIVER 2> /dev/null; rm -rf "$WORK"' EXIT
+echo "Making ${SIZE}MB of input" >&2
+head -c ${SIZE}M /dev/urandom > "$WORK/input"
+
+#Peak RSS (kB) of a process that's still running
+peak() {
+	awk '/VmHWM/ {print $2}' /proc/$1/status 2> /dev/null
+}
+
+#The receiver reads commands from stdin, so give it one that stays open and says nothing
+mkfifo "$WORK/commands"
+exec 3<> "$WORK/commands"
+
+stdbuf -oL "$BUILD/server" > "$WORK/server.log" 2>&1 &
+SERVER=$!
+for i in $(seq 50); do
+	(exec 3<> /dev/tcp/127.0.0.1/12345) 2> /dev/null && break
+	sleep 0.1
+done
+
+printf "%-6s %10s %12s %12s %14s %14s\n" input MB "send MB/s" "recv MB/s" "send peak kB" "recv peak kB"
+for MODE in file pipe; do
+	rm -f "$WORK/output"
+	#Its port is on the line the server prints when it registers
+	REGISTERED=$(grep -c registers "$WORK/server.log")
+	stdbuf -oL "$BUILD/client" recv "$WORK/output" < "$WORK/commands" > "$WORK/recv.log" 2>&1 &
+	RECEIVER=$!
+	for i in $(seq 50); do
+		[ "$(grep -c registers "$WORK/server.log")" -gt $REGISTERED ] && break
+		sleep 0.1
+	done
+	PORT=$(grep registers "$WORK/server.log" | tail -1 | sed -E 's/.*:([0-9]+) registers.*/\1/')
+
+	if [ $MODE = file ]; then
+		stdbuf -oL "$BUILD/client" send 127.0.0.1 $PORT "$WORK/input" "$@" > "$WORK/send.log" 2>&1 &
+	else
+		stdbuf -oL "$BUILD/client" send 127.0.0.1 $PORT "$@" < "$WORK/input" > "$WORK/send.log" 2>&1 &
+	fi
+	SENDER=$!
+	#It's gone once it's done, so keep track of its peak as it goes
+	SEND_PEAK=0
+	while kill -0 $SENDER 2> /dev/null; do
+		NOW=$(peak $SENDER)
+		[ -n "$NOW" ] && [ "$NOW" -gt "$SEND_PEAK" ] && SEND_PEAK=$NOW
+		sleep 0.02
+	done
+	wait $SENDER
+	STATUS=$?
+	sleep 0.3
+	RECV_PEAK=$(peak $RECEIVER)
+	kill $RECEIVER
+	wait $RECEIVER 2> /dev/null
+
+	SEND_RATE=$(sed -nE 's/^Sent .*\(([0-9.]+) MB\/s.*/\1/p' "$WORK/send.log")
+	RECV_RATE=$(sed -nE 's/^Received .*\(([0-9.]+) MB\/s\)/\1/p' "$WORK/recv.log")
+	if [ $STATUS -ne 0 ] || [ -z "$SEND_RATE" ] || [ -z "$RECV_RATE" ]; then
+		echo "$MODE: transfer failed" >&2
+		cat "$WORK/send.log" "$WORK/recv.log" >&2
+		continue
+	fi
+	if ! cmp -s "$WORK/input" "$WORK/output"; then
+		echo "$MODE: output doesn't match the input" >&2
+	fi
+	printf "%-6s %10d %12s %12s %14s %14s\n" $MODE $SIZE $SEND_RATE $RECV_RATE $SEND_PEAK $RECV_PEAK
+done
@@ -6,8 +6,9 @@
 #define CRYPTO2_UTIL_H
 
 #include <functional>
-#include <random>
 #include <sys/time.h>
+#include <time.h>
+#include "csprng.h"
 
 struct on_scope_exit {
 	typedef std::function<void()> exit_fn;
@@ -20,20 +21,32 @@ struct on_scope_exit {
 };
 
 uint64_t rand_u64() {
-	std::uniform_int_distribution<uint64_t> distribution;
-	std::random_device rd;
-	std::mt19937_64 generator{rd()};
-	return distribution(generator);
+	return thread_random().next_u64();
+}
+
+void rand_bytes(void *out, size_t length) {
+	thread_random().fill(out, length);
 }
 
 uint64_t current_timestamp() {
 	return static_cast<uint64_t>(time(nullptr));
 }
 
+/**
+ * Milliseconds on a clock that only goes forwards, for timeouts
+ */
+uint64_t monotonic_ms() {
+	timespec now{};
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return static_cast<uint64_t>(now.tv_sec) * 1000 + static_cast<uint64_t>(now.tv_nsec) / 1000000;
+}
+
+//How long (seconds) a timestamped message stays valid
+#define TIMESTAMP_WINDOW 10
+
 bool is_valid_timestamp(uint64_t timestamp) {
-	//10 seconds is the valid window
 	time_t current = time(nullptr);
-	return current < timestamp + 10;
+	return current < timestamp + TIMESTAMP_WINDOW;
 }
 
 #endif //CRYPTO2_UTIL_H